@@ -12,27 +12,27 @@
  * 
  */
 
-#define MPVDEBUG 0
-
-/*
-* New fields were added to  mpv_event_end_file record in 
-* the client API for version 1.108.
-* We want to keep the code for future use, but on Debian 10
-* it won't compile yet
-*/
-#define MPV_CLIENT_GT_1108 0
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <math.h>
 #include <time.h>
 #include <tcl.h>
 #include <mpv/client.h>
 #include "tclmpv.h"
+/*
+* config.h defines MPV_CLIENT_GT_1108 when the playlist entry fields
+* of mpv_event_end_file (client API 1.108) are available
+*/
 #include "config.h"
 
 #define RETURN_IF_NOT_INIT(instance_ptr)								\
@@ -89,1074 +89,7168 @@ const char
     return efr_table[reason];
 }
 
-/* executed in some arbitrary thread */
+/*
+* Converts an mpv_node to a Tcl_Obj of the matching type:
+* maps become dicts, arrays become lists, numbers and flags are
+* returned as numeric objects and never need to be re-parsed.
+*/
+Tcl_Obj *
+mpvNodeToObj (
+	mpv_node	*node
+	)
+{
+	Tcl_Obj		*obj;
+	int			i;
+
+	switch (node->format) {
+		case MPV_FORMAT_STRING:
+		case MPV_FORMAT_OSD_STRING: {
+			obj = Tcl_NewStringObj (node->u.string, -1);
+			break;
+		}
+		case MPV_FORMAT_FLAG: {
+			obj = Tcl_NewBooleanObj (node->u.flag);
+			break;
+		}
+		case MPV_FORMAT_INT64: {
+			obj = Tcl_NewWideIntObj ((Tcl_WideInt) node->u.int64);
+			break;
+		}
+		case MPV_FORMAT_DOUBLE: {
+			obj = Tcl_NewDoubleObj (node->u.double_);
+			break;
+		}
+		case MPV_FORMAT_NODE_ARRAY: {
+			obj = Tcl_NewListObj (0, NULL);
+			for (i = 0; i < node->u.list->num; ++i) {
+				Tcl_ListObjAppendElement (NULL, obj, mpvNodeToObj (&node->u.list->values[i]));
+			}
+			break;
+		}
+		case MPV_FORMAT_NODE_MAP: {
+			obj = Tcl_NewDictObj ();
+			for (i = 0; i < node->u.list->num; ++i) {
+				Tcl_DictObjPut (NULL, obj, Tcl_NewStringObj (node->u.list->keys[i], -1),
+					mpvNodeToObj (&node->u.list->values[i]));
+			}
+			break;
+		}
+		case MPV_FORMAT_BYTE_ARRAY: {
+			obj = Tcl_NewByteArrayObj ((unsigned char *) node->u.ba->data, (int) node->u.ba->size);
+			break;
+		}
+		default: {
+			obj = Tcl_NewObj ();
+			break;
+		}
+	}
+	return obj;
+}
+
+/*
+* Converts a Tcl_Obj to an mpv_node. The node type follows the
+* internal representation of the object: dicts, lists, integers and
+* doubles are passed as such, everything else as a string which mpv
+* parses itself. Strings point into the Tcl_Obj, which must be kept
+* alive while the node is in use. Free the node with mpvFreeNode.
+*/
 void
-mpvCallbackHandler (
-  void *cd
-  )
+mpvObjToNode (
+	Tcl_Obj		*obj,
+	mpv_node	*node
+	)
 {
-  mpvData_t     *mpvData = (mpvData_t *) cd;
+	const Tcl_ObjType	*typePtr = obj->typePtr;
+	Tcl_DictSearch		search;
+	Tcl_Obj				*key;
+	Tcl_Obj				*value;
+	Tcl_Obj				**elems;
+	Tcl_WideInt			wval;
+	int					done;
+	int					count;
+	int					i;
 
-  mpvData->hasEvent = 1;
+	if (typePtr != NULL && typePtr == Tcl_GetObjType ("dict") &&
+			Tcl_DictObjSize (NULL, obj, &count) == TCL_OK) {
+		node->format = MPV_FORMAT_NODE_MAP;
+		node->u.list = (mpv_node_list *) ckalloc (sizeof (mpv_node_list));
+		node->u.list->num = 0;
+		node->u.list->values = (mpv_node *) ckalloc (sizeof (mpv_node) * (size_t) (count + 1));
+		node->u.list->keys = (char **) ckalloc (sizeof (char *) * (size_t) (count + 1));
+		Tcl_DictObjFirst (NULL, obj, &search, &key, &value, &done);
+		for (i = 0; ! done && i < count; ++i) {
+			node->u.list->keys[i] = Tcl_GetString (key);
+			mpvObjToNode (value, &node->u.list->values[i]);
+			node->u.list->num++;
+			Tcl_DictObjNext (&search, &key, &value, &done);
+		}
+		Tcl_DictObjDone (&search);
+	} else if (typePtr != NULL && typePtr == Tcl_GetObjType ("list") &&
+			Tcl_ListObjGetElements (NULL, obj, &count, &elems) == TCL_OK) {
+		node->format = MPV_FORMAT_NODE_ARRAY;
+		node->u.list = (mpv_node_list *) ckalloc (sizeof (mpv_node_list));
+		node->u.list->num = count;
+		node->u.list->values = (mpv_node *) ckalloc (sizeof (mpv_node) * (size_t) (count + 1));
+		node->u.list->keys = NULL;
+		for (i = 0; i < count; ++i) {
+			mpvObjToNode (elems[i], &node->u.list->values[i]);
+		}
+	} else if (typePtr != NULL && typePtr == Tcl_GetObjType ("double") &&
+			Tcl_GetDoubleFromObj (NULL, obj, &node->u.double_) == TCL_OK) {
+		node->format = MPV_FORMAT_DOUBLE;
+	} else if (typePtr != NULL && (typePtr == Tcl_GetObjType ("int") ||
+			typePtr == Tcl_GetObjType ("wideInt")) &&
+			Tcl_GetWideIntFromObj (NULL, obj, &wval) == TCL_OK) {
+		node->format = MPV_FORMAT_INT64;
+		node->u.int64 = (int64_t) wval;
+	} else {
+		node->format = MPV_FORMAT_STRING;
+		node->u.string = Tcl_GetString (obj);
+	}
 }
 
 void
-mpvEventHandler (
-  ClientData cd
-  )
+mpvFreeNode (
+	mpv_node	*node
+	)
 {
-	mpvData_t   *mpvData = (mpvData_t *) cd;
-	playstate   stateflag;
-	struct		timespec curtime;
-	int			idle_active;
+	int		i;
 
-#if MPVDEBUG
-	clock_gettime (CLOCK_MONOTONIC, &curtime);
-	fprintf (mpvData->debugfh, "[%ld.%ld] mpv: mpvEventHandler entered \n", curtime.tv_sec, curtime.tv_nsec);
-	fflush (mpvData->debugfh); 
-#endif
-	if (mpvData->inst == NULL) {
-		return;
+	if (node->format == MPV_FORMAT_NODE_MAP || node->format == MPV_FORMAT_NODE_ARRAY) {
+		for (i = 0; i < node->u.list->num; ++i) {
+			mpvFreeNode (&node->u.list->values[i]);
+		}
+		ckfree ((char *) node->u.list->values);
+		if (node->u.list->keys != NULL) {
+			ckfree ((char *) node->u.list->keys);
+		}
+		ckfree ((char *) node->u.list);
 	}
+	node->format = MPV_FORMAT_NONE;
+}
 
-	if (mpvData->hasEvent == 0) {
-		mpvData->timerToken = Tcl_CreateTimerHandler (CHKTIMER, &mpvEventHandler, mpvData);
-		return;
+/*
+* Converts the value of a property change event, whatever format
+* it was observed with.
+*/
+Tcl_Obj *
+mpvPropertyToObj (
+	mpv_event_property	*prop
+	)
+{
+	switch (prop->format) {
+		case MPV_FORMAT_STRING:
+		case MPV_FORMAT_OSD_STRING: {
+			return Tcl_NewStringObj (* (char **) prop->data, -1);
+		}
+		case MPV_FORMAT_FLAG: {
+			return Tcl_NewBooleanObj (* (int *) prop->data);
+		}
+		case MPV_FORMAT_INT64: {
+			return Tcl_NewWideIntObj ((Tcl_WideInt) * (int64_t *) prop->data);
+		}
+		case MPV_FORMAT_DOUBLE: {
+			return Tcl_NewDoubleObj (* (double *) prop->data);
+		}
+		case MPV_FORMAT_NODE: {
+			return mpvNodeToObj ((mpv_node *) prop->data);
+		}
+		default: {
+			/* MPV_FORMAT_NONE: the property is not available */
+			return Tcl_NewObj ();
+		}
 	}
+}
 
-  mpvData->hasEvent = 0;
+/*
+* Stores the value of a property change in the cache slot of the
+* registry entry. When the property becomes unavailable the last
+* value is kept, but the slot is marked invalid.
+*/
+void
+mpvCacheProperty (
+	mpvObserved_t		*obs,
+	mpv_event_property	*prop
+	)
+{
+	if (obs->value != NULL) {
+		Tcl_DecrRefCount (obs->value);
+		obs->value = NULL;
+	}
+	obs->valid = 1;
+	switch (prop->format) {
+		case MPV_FORMAT_DOUBLE: {
+			obs->cache.d = * (double *) prop->data;
+			break;
+		}
+		case MPV_FORMAT_FLAG: {
+			obs->cache.flag = * (int *) prop->data;
+			break;
+		}
+		case MPV_FORMAT_INT64: {
+			obs->cache.i = (Tcl_WideInt) * (int64_t *) prop->data;
+			break;
+		}
+		case MPV_FORMAT_STRING:
+		case MPV_FORMAT_NODE: {
+			obs->value = mpvPropertyToObj (prop);
+			Tcl_IncrRefCount (obs->value);
+			break;
+		}
+		default: {
+			obs->valid = 0;
+			break;
+		}
+	}
+}
 
-	mpv_event *event = mpv_wait_event (mpvData->inst, 0.0);
-	stateflag = stateMap[(int) mpvData->stateMapIdx[event->event_id]].stateflag;
-	clock_gettime (CLOCK_MONOTONIC, &curtime);
-#if MPVDEBUG
-	fprintf (mpvData->debugfh, "[%ld.%ld] mpv_event_name: %s\n", curtime.tv_sec, curtime.tv_nsec, mpv_event_name (event->event_id));
-#endif
+/*
+* Returns the cached value of a registry entry, an empty object
+* when the property is not available.
+*/
+Tcl_Obj *
+mpvCachedObj (
+	mpvObserved_t	*obs
+	)
+{
+	if (! obs->valid) {
+		return Tcl_NewObj ();
+	}
+	switch (obs->format) {
+		case MPV_FORMAT_DOUBLE: {
+			return Tcl_NewDoubleObj (obs->cache.d);
+		}
+		case MPV_FORMAT_FLAG: {
+			return Tcl_NewBooleanObj (obs->cache.flag);
+		}
+		case MPV_FORMAT_INT64: {
+			return Tcl_NewWideIntObj (obs->cache.i);
+		}
+		default: {
+			return obs->value;
+		}
+	}
+}
 
-	while (event->event_id != MPV_EVENT_NONE) {
-		
-		if (event->event_id == MPV_EVENT_END_FILE ) {
-			mpv_event_end_file *end_file = (mpv_event_end_file *) event->data;
-			mpvData->end_file = (mpv_event_end_file) {.reason = end_file->reason, .error = end_file->error};
-#if MPVDEBUG
-			fprintf (mpvData->debugfh, "[%ld.%ld] mpv end file: reason %d, %s\n", \
-				curtime.tv_sec, curtime.tv_nsec, (int) end_file->reason, mpv_efr_string(end_file->reason));
-			fprintf (mpvData->debugfh, "[%ld.%ld] mpv end file: error %d, %s\n", \
-				curtime.tv_sec, curtime.tv_nsec, (int) end_file->error, mpv_error_string(end_file->error));
-#if MPV_CLIENT_GT_1108
-			fprintf (mpvData->debugfh, "[%ld.%ld] mpv end file: playlist entry id %ld\n", \
-				curtime.tv_sec, curtime.tv_nsec, (int) end_file->playlist_entry_id);
-			fprintf (mpvData->debugfh, "[%ld.%ld] mpv end file: playlist insert id %ld\n", \
-				curtime.tv_sec, curtime.tv_nsec, (int) end_file->playlist_insert_id);
-			fprintf (mpvData->debugfh, "[%ld.%ld] mpv end file: playlist insert num entries %d\n", \
-				curtime.tv_sec, curtime.tv_nsec, (int) end_file->playlist_insert_num_entries);
-#endif
-#endif
+mpvObserved_t *
+mpvFindObserved (
+	mpvData_t	*mpvData,
+	const char	*name
+	)
+{
+	int		i;
+
+	for (i = 0; i < mpvData->observedCount; ++i) {
+		if (mpvData->observed[i].name != NULL &&
+				strcmp (mpvData->observed[i].name, name) == 0) {
+			return &mpvData->observed[i];
 		}
+	}
+	return NULL;
+}
 
-		if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
+/* the observation policy of a new registry entry: every change */
+void
+mpvObservedInit (
+	mpvObserved_t	*obs
+	)
+{
+	obs->mindelta = 0.0;
+	obs->maxrate = 0.0;
+	obs->lastNumeric = 0.0;
+	obs->hasNumeric = 0;
+	obs->held = 0;
+	obs->lastNotify = 0;
+}
 
-			/************ start event == property change  ***************/
-			mpv_event_property *prop = (mpv_event_property *) event->data;
+/*
+* Returns 0 when a numeric property changed by less than its
+* -mindelta, the event is then dropped before it reaches the cache.
+*/
+int
+mpvObservedAccept (
+	mpvObserved_t		*obs,
+	mpv_event_property	*prop
+	)
+{
+	mpv_node	*node;
+	double		v;
 
-#if MPVDEBUG
-			if (mpvData->debugfh != NULL) {
-				fprintf (mpvData->debugfh, "[%ld.%ld] mpv: ev: prop: %s\n", curtime.tv_sec, curtime.tv_nsec, prop->name);
-				fflush (mpvData->debugfh); 
+	switch (prop->format) {
+		case MPV_FORMAT_DOUBLE: {
+			v = * (double *) prop->data;
+			break;
+		}
+		case MPV_FORMAT_INT64: {
+			v = (double) * (int64_t *) prop->data;
+			break;
+		}
+		case MPV_FORMAT_NODE: {
+			node = (mpv_node *) prop->data;
+			if (node->format == MPV_FORMAT_DOUBLE) {
+				v = node->u.double_;
+			} else if (node->format == MPV_FORMAT_INT64) {
+				v = (double) node->u.int64;
+			} else {
+				obs->hasNumeric = 0;
+				return 1;
 			}
-#endif
+			break;
+		}
+		default: {
+			obs->hasNumeric = 0;
+			return 1;
+		}
+	}
+	if (obs->mindelta > 0.0 && obs->hasNumeric && fabs (v - obs->lastNumeric) < obs->mindelta) {
+		return 0;
+	}
+	obs->lastNumeric = v;
+	obs->hasNumeric = 1;
+	return 1;
+}
 
-			if (strcmp (prop->name, "time-pos") == 0) {
-				// AFAIK when a time-pos event is received, the player is proceeding
-				if (mpvData->state == PS_BUFFERING) {
-					mpvData->state = PS_PLAYING;
-				}
-				if (prop->format == MPV_FORMAT_DOUBLE) {
-					mpvData->tm = * (double *) prop->data;
-				}
-#if MPVDEBUG
-					fprintf (mpvData->debugfh, "format: %d, new time-pos: %.2f\n", prop->format, mpvData->tm);
-					fflush (mpvData->debugfh); 
-#endif
-			} else if (strcmp (prop->name, "duration") == 0) {
-				if (prop->format == MPV_FORMAT_DOUBLE) {
-					mpvData->duration = * (double *) prop->data;
-				}
-#if MPVDEBUG
-				fprintf (mpvData->debugfh, "mpv: ev: dur: %.2f\n", mpvData->duration);
-				fflush (mpvData->debugfh); 
-#endif
-			} else if (strcmp (prop->name, "idle-active") == 0) {
-				if (mpv_get_property(mpvData->inst, "idle-active", MPV_FORMAT_FLAG, &idle_active) == 0) {
-#if MPVDEBUG
-					fprintf (mpvData->debugfh, "mpv: ev: idle_active: %d\n", idle_active);
-					fflush (mpvData->debugfh); 
-#endif
-					if (idle_active) { 
-					// only use this to enter into idle state not to leave it
-						mpvData->state = PS_IDLE;
-					} 
-				}
-			}
-		/***********i END PROPERTY CHANGE ***************/
-		} else if (stateflag != PS_NONE) {
-				  mpvData->state = stateflag;
-#if MPVDEBUG
-        fprintf (mpvData->debugfh, "mpv: state: %s\n", stateToStr(mpvData->state));
-		fflush (mpvData->debugfh); 
-#endif
-		} /****** end stateflage != PS_NONE ********/
+/*
+* Queues the notification of a changed property. A property changing
+* again in the same drain pass is notified once, with the last value.
+*/
+void
+mpvObservedMark (
+	mpvData_t	*mpvData,
+	int			idx
+	)
+{
+	mpvObserved_t	*obs = &mpvData->observed[idx];
 
-		mpv_event *event = mpv_wait_event (mpvData->inst, 0.0);
-		stateflag = stateMap[(int) mpvData->stateMapIdx[event->event_id]].stateflag;
+	if (obs->dirty) {
+		return;
+	}
+	obs->dirty = 1;
+	obs->nextDirty = 0;
+	if (mpvData->dirtyTail == 0) {
+		mpvData->dirtyHead = idx + 1;
+	} else {
+		mpvData->observed[mpvData->dirtyTail - 1].nextDirty = idx + 1;
+	}
+	mpvData->dirtyTail = idx + 1;
+}
 
-#if MPVDEBUG
-		clock_gettime (CLOCK_MONOTONIC, &curtime);
-		fprintf (mpvData->debugfh, "[%ld.%ld] mpv_event_name: %s\n", curtime.tv_sec, curtime.tv_nsec, mpv_event_name (event->event_id));
-		fflush (mpvData->debugfh); 
-#endif
-	} /******** end while event != 0 *********/
+/*
+* Removes a property from the queue and drops its held notification,
+* when its slot is freed or reused by another property.
+*/
+void
+mpvObservedUnmark (
+	mpvData_t	*mpvData,
+	int			idx
+	)
+{
+	mpvObserved_t	*obs = &mpvData->observed[idx];
+	int				prev;
+	int				cur;
 
-  mpvData->timerToken = Tcl_CreateTimerHandler (CHKTIMER, &mpvEventHandler, mpvData);
+	if (obs->dirty) {
+		prev = 0;
+		cur = mpvData->dirtyHead;
+		while (cur != 0 && cur != idx + 1) {
+			prev = cur;
+			cur = mpvData->observed[cur - 1].nextDirty;
+		}
+		if (cur != 0) {
+			if (prev == 0) {
+				mpvData->dirtyHead = obs->nextDirty;
+			} else {
+				mpvData->observed[prev - 1].nextDirty = obs->nextDirty;
+			}
+			if (mpvData->dirtyTail == idx + 1) {
+				mpvData->dirtyTail = prev;
+			}
+		}
+	}
+	obs->dirty = 0;
+	obs->nextDirty = 0;
+	obs->held = 0;
 }
 
-int
-mpvDurationCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+/*
+* Notifies the queued properties in the order they first changed.
+* Called before the next event which is not a property change and
+* at the end of the drain pass. A property notified less than
+* 1/maxrate seconds ago is held for a timer.
+*/
+void
+mpvObservedFlush (
+	mpvData_t	*mpvData
+	)
 {
-  double            tm;
-  mpvData_t *mpvData = (mpvData_t *) cd;
-	
-	RETURN_IF_NOT_INIT (mpvData->inst);
+	mpvObserved_t	*obs;
+	uint64_t		now;
+	uint64_t		period;
+	uint64_t		due;
+	int				idx;
 
-  if (objc != 1) {
-    Tcl_WrongNumArgs(interp, 1, objv, "");
-    return TCL_ERROR;
-  }
-
-    tm = mpvData->duration;
-    Tcl_SetObjResult (interp, Tcl_NewDoubleObj (tm));
-	return TCL_OK;
+	now = mpvStatsNow ();
+	while (mpvData->dirtyHead != 0 && mpvData->inst != NULL) {
+		idx = mpvData->dirtyHead - 1;
+		obs = &mpvData->observed[idx];
+		mpvData->dirtyHead = obs->nextDirty;
+		if (mpvData->dirtyHead == 0) {
+			mpvData->dirtyTail = 0;
+		}
+		obs->dirty = 0;
+		obs->nextDirty = 0;
+		if (obs->name == NULL) {
+			obs->held = 0;
+			continue;
+		}
+		if (obs->maxrate > 0.0) {
+			period = (uint64_t) (1000000000.0 / obs->maxrate);
+			if (obs->lastNotify != 0 && now - obs->lastNotify < period) {
+				obs->held = 1;
+				/* the timer fires for the first held property due */
+				due = obs->lastNotify + period;
+				if (mpvData->holdTimer == NULL || due < mpvData->holdDue) {
+					if (mpvData->holdTimer != NULL) {
+						Tcl_DeleteTimerHandler (mpvData->holdTimer);
+					}
+					mpvData->holdDue = due;
+					mpvData->holdTimer = Tcl_CreateTimerHandler (
+						(int) ((due - now) / 1000000) + 1,
+						mpvObservedTimer, (ClientData) mpvData);
+				}
+				continue;
+			}
+		}
+		obs->held = 0;
+		obs->lastNotify = now;
+		mpvObservedNotify (mpvData, idx);
+	}
 }
 
-int
-mpvEofInfoCmd (
-	ClientData cd,
-	Tcl_Interp* interp,
-	int objc,
-	Tcl_Obj * const objv[]
+/* runs the callbacks of a changed property */
+void
+mpvObservedNotify (
+	mpvData_t	*mpvData,
+	int			idx
 	)
 {
-	mpvData_t	*mpvData = (mpvData_t *) cd;
-	
-	RETURN_IF_NOT_INIT (mpvData->inst);
+	mpvObserved_t	*obs = &mpvData->observed[idx];
+	Tcl_Obj			*details;
+	Tcl_Obj			*value;
+	Tcl_Obj			*name;
 
-	if (objc != 1) {
-		Tcl_WrongNumArgs(interp, 1, objv, "");
-		return TCL_ERROR;
+	TRACE (mpvData, TL_DEBUG, TR_PROPERTY, obs->valid ? obs->format : MPV_FORMAT_NONE, 0,
+		obs->format == MPV_FORMAT_FLAG ? (int64_t) obs->cache.flag :
+		obs->format == MPV_FORMAT_INT64 ? (int64_t) obs->cache.i : 0,
+		obs->format == MPV_FORMAT_DOUBLE ? obs->cache.d : 0.0, obs->name);
+
+	if (idx + 1 == PROP_PAUSE && obs->valid && HASCALLBACK (mpvData, CB_PAUSE)) {
+		details = mpvCallbackDetails (CB_PAUSE);
+		Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("paused", -1),
+			Tcl_NewBooleanObj (obs->cache.flag));
+		mpvInvokeCallback (mpvData, CB_PAUSE, details);
 	}
 
-	Tcl_Obj *list = Tcl_NewListObj(0, NULL);
-	Tcl_Obj *str = Tcl_NewStringObj(mpv_efr_string (mpvData->end_file.reason), -1);
-	Tcl_ListObjAppendElement(interp, list, str);	
-	str = Tcl_NewStringObj(mpv_error_string (mpvData->end_file.error), -1);
-	Tcl_ListObjAppendElement(interp, list, str);	
-	Tcl_SetObjResult (interp, list);
-	return TCL_OK;
+	/* a callback may have grown the registry, obs is not valid anymore */
+	obs = &mpvData->observed[idx];
+	if ((obs->script != NULL || HASCALLBACK (mpvData, CB_PROPERTY_CHANGE)) &&
+			obs->name != NULL && mpvData->inst != NULL) {
+		value = mpvCachedObj (obs);
+		Tcl_IncrRefCount (value);
+		name = Tcl_NewStringObj (obs->name, -1);
+		Tcl_IncrRefCount (name);
+		if (obs->script != NULL) {
+			details = mpvCallbackDetails (CB_PROPERTY_CHANGE);
+			Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("name", -1), name);
+			Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("value", -1), value);
+			mpvInvokeObserver (mpvData, obs->script, details);
+		}
+		if (HASCALLBACK (mpvData, CB_PROPERTY_CHANGE) && mpvData->inst != NULL) {
+			details = mpvCallbackDetails (CB_PROPERTY_CHANGE);
+			Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("name", -1), name);
+			Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("value", -1), value);
+			mpvInvokeCallback (mpvData, CB_PROPERTY_CHANGE, details);
+		}
+		Tcl_DecrRefCount (name);
+		Tcl_DecrRefCount (value);
+	}
 }
 
-int
-mpvGetTimeCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+/* notifies the properties held by their -maxrate */
+void
+mpvObservedTimer (
+	ClientData	cd
+	)
 {
-  int       rc;
-  double    tm;
-  mpvData_t *mpvData = (mpvData_t *) cd;
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	int			i;
 
-  if (objc != 1) {
-    Tcl_WrongNumArgs(interp, 1, objv, "");
-    return TCL_ERROR;
-  }
+	mpvData->holdTimer = NULL;
+	if (mpvData->inst == NULL) {
+		return;
+	}
+	Tcl_Preserve (mpvData);
+	for (i = 0; i < mpvData->observedCount; ++i) {
+		if (mpvData->observed[i].held) {
+			mpvObservedMark (mpvData, i);
+		}
+	}
+	mpvObservedFlush (mpvData);
+	Tcl_Release (mpvData);
+}
 
-  rc = TCL_OK;
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    tm = mpvData->tm;
-    Tcl_SetObjResult (interp, Tcl_NewDoubleObj (tm));
-  }
-  return rc;
+/* drops the pending notifications, when the player is closed */
+void
+mpvObservedReset (
+	mpvData_t	*mpvData
+	)
+{
+	int			i;
+
+	if (mpvData->holdTimer != NULL) {
+		Tcl_DeleteTimerHandler (mpvData->holdTimer);
+		mpvData->holdTimer = NULL;
+	}
+	for (i = 0; i < mpvData->observedCount; ++i) {
+		mpvData->observed[i].dirty = 0;
+		mpvData->observed[i].nextDirty = 0;
+		mpvData->observed[i].held = 0;
+		mpvData->observed[i].hasNumeric = 0;
+		mpvData->observed[i].lastNotify = 0;
+	}
+	mpvData->dirtyHead = 0;
+	mpvData->dirtyTail = 0;
 }
 
+/*
+* Parses the leading options of the commands which can run
+* asynchronously: ?-async? ?-command script?. -command implies
+* -async. On return *first is the index of the first argument.
+* Returns TCL_ERROR when -command is the last word, the caller
+* reports its wrong # args message.
+*/
 int
-mpvIsPlayCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvAsyncOptions (
+	Tcl_Interp	*interp,
+	int			objc,
+	Tcl_Obj		* const objv[],
+	int			*first,
+	int			*async,
+	Tcl_Obj		**callback
+	)
 {
-  int       rc;
-  int       rval;
-  mpvData_t *mpvData = (mpvData_t *) cd;
-
-  if (objc != 1) {
-    Tcl_WrongNumArgs(interp, 1, objv, "");
-    return TCL_ERROR;
-  }
+	const char	*opt;
+	int			i;
 
-  rc = TCL_OK;
-  rval = 0;
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    /*
-     * In order to match the implementation of VLC's internal
-     * isplaying command, return true if the player is paused
-     * If the telnet VLC interface is ever dropped, this interface
-     * could be enhanced.
-     */
-    if (mpvData->state ==  PS_OPENING ||
-        mpvData->state ==  PS_PLAYING ||
-        mpvData->state ==  PS_PAUSED) {
-      rval = 1;
-    }
-    Tcl_SetObjResult (interp, Tcl_NewIntObj (rval));
-  }
-  return rc;
+	*async = 0;
+	*callback = NULL;
+	for (i = 1; i < objc; ++i) {
+		opt = Tcl_GetString (objv[i]);
+		if (strcmp (opt, "-async") == 0) {
+			*async = 1;
+		} else if (strcmp (opt, "-command") == 0) {
+			if (i + 1 >= objc) {
+				*first = i;
+				return TCL_ERROR;
+			}
+			*async = 1;
+			*callback = objv[++i];
+		} else {
+			break;
+		}
+	}
+	*first = i;
+	return TCL_OK;
 }
 
-int
-mpvMediaCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+/*
+* Registers an asynchronous request and returns the reply_userdata to
+* pass to mpv, 0 for a synchronous request. The reply calls the
+* -command script, if any, and gives the round trip time of the
+* command prefix name for ::tclmpv::stats.
+*/
+uint64_t
+mpvAsyncRegister (
+	mpvData_t	*mpvData,
+	int			async,
+	Tcl_Obj		*callback,
+	const char	*prefix,
+	const char	*name
+	)
 {
-	int			status;
-	mpvData_t	*mpvData = (mpvData_t *) cd;
-	char		*fn;
-	struct stat	statinfo;
-	double		dval;
-	char		errmsg[256];
-
-	/*
-	* This function can only be used to load media files which can be found on the
-	* file system. No http streams etc.
-	* When the file does not exist the function returns an error.
-	* The rquested file is loaded and replaces the currently playing file. No other
-	* options can be passed.
-	*/
+	Tcl_HashEntry	*hPtr;
+	mpvRequest_t	*req;
+	uint64_t		id;
+	int				isNew;
 
-	RETURN_IF_NOT_INIT (mpvData->inst);
-
-	if (objc < 2) {
-		Tcl_WrongNumArgs(interp, 1, objv, "media");
-		return TCL_ERROR;
+	if (! async) {
+		return 0;
 	}
+	req = (mpvRequest_t *) ckalloc (sizeof (mpvRequest_t));
+	req->script = NULL;
+	if (callback != NULL && Tcl_GetCharLength (callback) > 0) {
+		req->script = callback;
+		Tcl_IncrRefCount (callback);
+	}
+	req->hist = mpvStatsCommandHist (mpvData, prefix, name);
+	req->sent = mpvStatsNow ();
+	id = ++mpvData->nextReplyId;
+	hPtr = Tcl_CreateHashEntry (&mpvData->pending, (char *) (uintptr_t) id, &isNew);
+	Tcl_SetHashValue (hPtr, req);
+	return id;
+}
 
+void
+mpvAsyncFree (
+	mpvRequest_t	*req
+	)
+{
+	if (req->script != NULL) {
+		Tcl_DecrRefCount (req->script);
+	}
+	ckfree ((char *) req);
+}
 
-	#if MPVDEBUG
-	fprintf (mpvData->debugfh, "number of arguments to media command: %d\n", objc);
-	fflush (mpvData->debugfh); 
-
-    if (mpvData->debugfh != NULL) {
-      fprintf (mpvData->debugfh, "mpvData->inst: %p, mpvData->device: %s\n", (void *) mpvData->inst, mpvData->device);
-		fflush (mpvData->debugfh); 
-    }
-	#endif
+/* the request could not be sent, no reply will arrive */
+void
+mpvAsyncCancel (
+	mpvData_t	*mpvData,
+	uint64_t	id
+	)
+{
+	Tcl_HashEntry	*hPtr;
 
-	if (mpvData->device != NULL) {
-		status = mpv_set_property (mpvData->inst, "audio-device", MPV_FORMAT_STRING, (void *) mpvData->device);
-	#if MPVDEBUG
-		if (mpvData->debugfh != NULL) {
-			fprintf (mpvData->debugfh, "set-ad:status:%d %s\n", status, mpv_error_string(status));
-			fflush (mpvData->debugfh); 
-		}
-	#endif
+	if (id == 0) {
+		return;
+	}
+	hPtr = Tcl_FindHashEntry (&mpvData->pending, (char *) (uintptr_t) id);
+	if (hPtr != NULL) {
+		mpvAsyncFree ((mpvRequest_t *) Tcl_GetHashValue (hPtr));
+		Tcl_DeleteHashEntry (hPtr);
 	}
+}
 
-	fn = Tcl_GetString(objv[1]);
-    if (stat (fn, &statinfo) != 0) {
-		snprintf (errmsg, sizeof(errmsg), "mediafile %s does not exist", fn); 
-		Tcl_AddErrorInfo (interp, errmsg);
-		return  TCL_ERROR;
-    }
+/*
+* Calls the -command script of an asynchronous request with a dict
+* holding the event name, the status (ok or error), the mpv error
+* string and, for commands, the result.
+*/
+void
+mpvAsyncReply (
+	mpvData_t	*mpvData,
+	mpv_event	*event
+	)
+{
+	Tcl_HashEntry	*hPtr;
+	mpvRequest_t	*req;
+	Tcl_Obj			*details;
 
-      /* reset the duration and time */
-    mpvData->duration = 0.0;
-    mpvData->tm = 0.0;
-    /* like many players, mpv will start playing when the 'loadfile'
-     * command is executed.
-     */
-    const char *cmd[] = {"loadfile", fn, "replace", NULL};
-    status = mpv_command (mpvData->inst, cmd);
-	if (status) {
-		Tcl_AddErrorInfo (interp, "error executing mpv loadfile command");
-		return TCL_ERROR;	
+	hPtr = Tcl_FindHashEntry (&mpvData->pending, (char *) (uintptr_t) event->reply_userdata);
+	if (hPtr == NULL) {
+		return;
 	}
-
-    dval = 1.0;
-    status = mpv_set_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &dval);
-	if (status) {
-		Tcl_AddErrorInfo (interp, "error executing mpv set property command: speed ");
-		return TCL_ERROR;	
+	req = (mpvRequest_t *) Tcl_GetHashValue (hPtr);
+	Tcl_DeleteHashEntry (hPtr);
+	mpvStatsAdd (req->hist, (mpvStatsNow () - req->sent) / 1000);
+	if (req->script == NULL) {
+		mpvAsyncFree (req);
+		return;
 	}
 
-	return TCL_OK;
+	details = Tcl_NewDictObj ();
+	Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("event", -1),
+		Tcl_NewStringObj (event->event_id == MPV_EVENT_COMMAND_REPLY ?
+			"command-reply" : "set-property-reply", -1));
+	Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("status", -1),
+		Tcl_NewStringObj (event->error < 0 ? "error" : "ok", -1));
+	Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("error", -1),
+		Tcl_NewStringObj (mpv_error_string (event->error), -1));
+#if MPV_CLIENT_API_VERSION >= MPV_MAKE_VERSION(1, 104)
+	if (event->event_id == MPV_EVENT_COMMAND_REPLY && event->data != NULL) {
+		Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("result", -1),
+			mpvNodeToObj (&((mpv_event_command *) event->data)->result));
+	}
+#endif
+	mpvInvokeObserver (mpvData, req->script, details);
+	mpvAsyncFree (req);
 }
 
+/* runs an mpv command, asynchronously when requested */
 int
-mpvLoadFileCmd (
-	ClientData cd,
-	Tcl_Interp* interp,
-	int objc,
-	Tcl_Obj * const objv[]
+mpvCommand (
+	mpvData_t	*mpvData,
+	int			async,
+	uint64_t	id,
+	const char	**cmd,
+	mpv_node	*result
 	)
 {
-	int				rc;
-	int				status;
-	int				validflag;
-	mpvData_t		*mpvData = (mpvData_t *) cd;
-	char			*fn;
-	char			*arg2;
-	double			dval;
-	char			errmsg[256];
-	unsigned int	ivers;
-	char			lf_opt_4 = 0; //loadfile uses the options as 4th argument (since mpv 0.38)
-
-	/********
-	Call with: ::tcl::tclmpv::loadfile filename ?flags? ?options?
-	flags: replace | append | append-play
-	options: option1=foo,option2=bar
-	There must be no spaces in the options arguments
-	********/
-	RETURN_IF_NOT_INIT (mpvData->inst);
+	uint64_t	start;
+	int			status;
 
-	if (objc < 2 || objc > 4) {
-		Tcl_WrongNumArgs(interp, 1, objv, "URL ?flags? ?options?");
-		return TCL_ERROR;
+	if (result != NULL) {
+		result->format = MPV_FORMAT_NONE;
 	}
+	start = mpvStatsNow ();
+	if (async) {
+		status = mpv_command_async (mpvData->inst, id, cmd);
+#if MPV_CLIENT_GT_1108
+	} else if (result != NULL) {
+		status = mpv_command_ret (mpvData->inst, cmd, result);
+#endif
+	} else {
+		status = mpv_command (mpvData->inst, cmd);
+	}
+	if (! async || status < 0) {
+		mpvStatsCommand (mpvData, NULL, cmd[0], start, status);
+	}
+	TRACE (mpvData, TL_V, TR_COMMAND, async, status, (int64_t) id, 0.0, cmd[0]);
+	return status;
+}
 
+/*
+* Sets the property values a load depends on, the audio device of
+* ::tclmpv::audiodevset and a speed of 1.0, ahead of the loadfile
+* command. A value is only written when it differs from the value
+* last set, for the speed also from the speed mpv last reported, so
+* an unchanged player loads without extra round trips.
+* Returns 0 or the mpv error of the failed write, with the message
+* added to the errorInfo of interp.
+*/
+int
+mpvDirtyApply (
+	mpvData_t	*mpvData,
+	Tcl_Interp	*interp
+	)
+{
+	char		errmsg [200];
+	double		speed;
+	int			status;
 
-	rc = TCL_OK;
-
-	if (mpvData->device != NULL) {
-		status = mpv_set_property (mpvData->inst, "audio-device", MPV_FORMAT_STRING, (void *) mpvData->device);
-		if ( status < 0) {
-			snprintf (errmsg, sizeof(errmsg), "error setting audio device: %s", mpv_error_string(status)); 
+	if (mpvData->device != NULL && (mpvData->appliedDevice == NULL ||
+			strcmp (mpvData->device, mpvData->appliedDevice) != 0)) {
+		status = mpv_set_property (mpvData->inst, "audio-device",
+			MPV_FORMAT_STRING, (void *) &mpvData->device);
+		TRACE (mpvData, TL_V, TR_COMMAND, 0, status, 0, 0.0, "audio-device");
+		if (mpvData->appliedDevice != NULL) {
+			free ((void *) mpvData->appliedDevice);
+			mpvData->appliedDevice = NULL;
+		}
+		if (status < 0) {
+			snprintf (errmsg, sizeof (errmsg), "error setting audio device: %s",
+				mpv_error_string (status));
 			Tcl_AddErrorInfo (interp, errmsg);
-			return TCL_ERROR;
+			return status;
 		}
+		mpvData->appliedDevice = strdup (mpvData->device);
 	}
-
-    fn = Tcl_GetString(objv[1]);
-	/*******
-	* There is no check whether this is a valid file name. Even if it
-	* does not exist the mpv loadfile command does not return an error
-	* but play state returns to stopped as result of end-of-file.
-	* This is not unlike the command line clients of mpv
-	*******/
-
-    dval = 1.0;
-    status = mpv_set_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &dval);
-	#if MPVDEBUG
-    fprintf (mpvData->debugfh, "loadfile speed-1:status:%d %s\n", status, mpv_error_string(status));
-	fflush (mpvData->debugfh); 
-	#endif
-	if (status) {
-		Tcl_AddErrorInfo (interp, "error setting playback speed");
-		return TCL_ERROR;
+	if (mpvData->appliedSpeed != 1.0 ||
+			! PROPCACHE (mpvData, PROP_SPEED).valid ||
+			PROPCACHE (mpvData, PROP_SPEED).cache.d != 1.0) {
+		speed = 1.0;
+		status = mpv_set_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &speed);
+		TRACE (mpvData, TL_V, TR_COMMAND, 0, status, 0, speed, "speed");
+		if (status < 0) {
+			mpvData->appliedSpeed = -1.0;
+			Tcl_AddErrorInfo (interp, "error setting playback speed");
+			return status;
+		}
+		mpvData->appliedSpeed = speed;
 	}
+	return 0;
+}
 
-	/*******
-	* Since mpv version 0.38 there is a change in the argument list
-	* to call loadfile.
-	* A third argument (insertion index) was added before the option
-	* list. This breaks all calls to loadfile which uses the option
-	* list. When loadfile is called with an option list, a third argument
-	* "-1" must be added.
-	* This is a change in mpv, not in the mpv API, which remains the same.
-	* Only the contents of the string passed to mpv changes, not the command
-	* itself.
-	* With mpv version 0.38, API version 2.3 was released. So we will check here
-	* for API version 2.3 and add this third parameter.
-	* Format of version number in /usr/include/mpv/client.h
-	*******/
-	ivers = mpv_client_api_version();
-	if (((ivers >> 16) >= 2) && ((ivers & 0x00FF) >=3)) {
-		lf_opt_4 = 1;
-	} else {
-		lf_opt_4 = 0;
+/*
+* Forgets the values last sent, after they were changed by other
+* means, e.g. ::tclmpv::set or ::tclmpv::batch.
+*/
+void
+mpvDirtyReset (
+	mpvData_t	*mpvData
+	)
+{
+	if (mpvData->appliedDevice != NULL) {
+		free ((void *) mpvData->appliedDevice);
+		mpvData->appliedDevice = NULL;
 	}
-	
-	validflag = 1;
-	status = 0;
-	// If the objc is 3 or 4, the 2nd argument can be a flag
-	if (objc > 2) {
-		arg2 = Tcl_GetString(objv[2]);
-		if (strcmp (arg2, "replace") &&
-			strcmp (arg2, "append") &&
-			strcmp (arg2, "append-play")) {
-		//None of the values did match, so we don't have a flag
-		validflag = 0;
-		}
-		// If objc is 3 and arg2 is not a valid flag it is an option
-		// if it is a valid flag then a flag was passed and not an option
-		// If objc is 4 arg2 must be a valid flag. If not it is an error
-		if (objc == 3) {
-			if (validflag) {
-				const char* cmd[] = {"loadfile", fn, arg2, NULL};
-				status = mpv_command (mpvData->inst, cmd);
-				#if MPVDEBUG
-				fprintf (mpvData->debugfh, "loadfile: valid flag %s;\n", arg2);
-				fflush (mpvData->debugfh); 
-				#endif
-			} else { 
-			/* Not a valid flag so it must be an option */
-				if (lf_opt_4 == 1) {
-					const char* cmd[] = {"loadfile", fn, "replace", "-1", arg2, NULL};
-					status = mpv_command (mpvData->inst, cmd);
-				} else {
-					const char* cmd[] = {"loadfile", fn, "replace",  arg2, NULL};
-					status = mpv_command (mpvData->inst, cmd);
-				}
-				#if MPVDEBUG
-				fprintf (mpvData->debugfh, "loadfile: no valid flags. options passed: %s;\n", arg2);
-				fflush (mpvData->debugfh); 
-				#endif
-			}
-		} else {
-			/* Number of parameters > 2, < 5 and not 3 so must be 4 */
-			if (validflag) {
-				if (lf_opt_4 == 1) {
-					const char* cmd[] = {"loadfile", fn,  arg2, "-1", Tcl_GetString(objv[3]), NULL};
-					status = mpv_command (mpvData->inst, cmd);
-				} else {
-					const char* cmd[] = {"loadfile", fn,  arg2, Tcl_GetString(objv[3]), NULL};
-					status = mpv_command (mpvData->inst, cmd);
-				}
-				#if MPVDEBUG
-				fprintf (mpvData->debugfh, "loadfile: valid flag: %s,  options passed: %s\n", arg2, Tcl_GetString(objv[3]));
-				fflush (mpvData->debugfh); 
-				#endif
-			} else {
-				rc = TCL_ERROR;
-			}
-		}
-    } else {
-		/* no flags, no options */
-		const char* cmd[] = {"loadfile", fn, "replace", NULL};
-		status = mpv_command (mpvData->inst, cmd);
-		#if MPVDEBUG
-		fprintf (mpvData->debugfh, "loadfile: no flags, no options\n");
-		fflush (mpvData->debugfh); 
-		#endif
-	} 
+	mpvData->appliedSpeed = -1.0;
+}
 
-	/******** cmd is out of scope here. This logging will be enabled once *****
-	/         I find a better way to compose cmd 
-	#if MPVDEBUG
-	int i = 0;
-	fprintf (mpvData->debugfh, "loadfile: actual command passed to mpv_command: \n");
-	while (cmd[i] != NULL) {
-		fprintf (mpvData->debugfh, "[%d]: %s, ", i, cmd[i] );
-		i++;
-	}	
-	fprintf (mpvData->debugfh, "\n" );
-	fflush (mpvData->debugfh); 
-	#endif
-	***************************************************************************/
-
-	#if MPVDEBUG
-    fprintf (mpvData->debugfh, "loadfile: mpv_command status:%d %s\n", status, mpv_error_string(status));
-	fflush (mpvData->debugfh); 
-	#endif
+/*
+* Returns the playlist_entry_id from the result of a loadfile command
+* as a Tcl_Obj, an empty object when mpv did not return one.
+* The result node is freed.
+*/
+Tcl_Obj *
+mpvEntryIdObj (
+	mpv_node	*result
+	)
+{
+	Tcl_Obj		*idObj;
+	int			i;
 
-	if (rc) {
-		Tcl_AddErrorInfo (interp, "invalid flag specified, must be \"replace\", \"append\" or \"append-play\"");
-		return rc;
+	idObj = Tcl_NewObj ();
+	if (result->format == MPV_FORMAT_NODE_MAP) {
+		for (i = 0; i < result->u.list->num; ++i) {
+			if (strcmp (result->u.list->keys[i], "playlist_entry_id") == 0 &&
+					result->u.list->values[i].format == MPV_FORMAT_INT64) {
+				Tcl_DecrRefCount (idObj);
+				idObj = Tcl_NewWideIntObj ((Tcl_WideInt) result->u.list->values[i].u.int64);
+			}
+		}
 	}
-	if (status) {
-		snprintf (errmsg, sizeof(errmsg), "error loading file into mpv: %s", mpv_error_string(status)); 
-		Tcl_AddErrorInfo (interp, errmsg);
-		return TCL_ERROR;
+	if (result->format != MPV_FORMAT_NONE) {
+		mpv_free_node_contents (result);
 	}
-	(void)status;
+	return idObj;
+}
 
-	/* reset the duration and time */
-	mpvData->duration = 0.0;
-	mpvData->tm = 0.0;
+/* executed in some arbitrary thread */
+void
+mpvCallbackHandler (
+  void *cd
+  )
+{
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+  uint64_t      none = 0;
 
-	return TCL_OK;
+  mpvWakeupEvent_t  *evPtr;
+  int           queued = 0;
+
+  /* the first wakeup since the last drain */
+  __atomic_compare_exchange_n (&mpvData->stats.wakeupNsec, &none, mpvStatsNow (),
+    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+  __atomic_store_n (&mpvData->hasEvent, 1, __ATOMIC_RELEASE);
+  if (mpvData->wakeupMode == WAKEUP_FD && mpvData->wakeupFd[1] >= 0) {
+    /* a full pipe means a wakeup is already pending, so the result is ignored */
+    if (write (mpvData->wakeupFd[1], "w", 1) < 0) {
+      ;
+    }
+  }
+  /* one queued event drains everything, later wakeups are folded into it */
+  if (mpvData->wakeupMode == WAKEUP_EVENT &&
+      __atomic_compare_exchange_n (&mpvData->eventQueued, &queued, 1,
+        0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    evPtr = (mpvWakeupEvent_t *) ckalloc (sizeof (mpvWakeupEvent_t));
+    evPtr->header.proc = mpvWakeupEventProc;
+    evPtr->mpvData = mpvData;
+    Tcl_ThreadQueueEvent (mpvData->owner, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert (mpvData->owner);
+  }
 }
 
+/*
+* Event driven wakeup: queued by mpvCallbackHandler to the thread
+* owning the player. mpvWakeupClose removes events still queued when
+* the player is closed.
+*/
 int
-mpvPauseCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvWakeupEventProc (
+	Tcl_Event	*evPtr,
+	int			flags
+	)
 {
-  int       rc;
-  int       status, ppause, result;
-  mpvData_t *mpvData = (mpvData_t *) cd;
+	mpvData_t	*mpvData = ((mpvWakeupEvent_t *) evPtr)->mpvData;
 
-#if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "objc: %d\n", objc);
-        fprintf (mpvData->debugfh, "mpvData->inst: %p \n", (void *) mpvData->inst);
-        fprintf (mpvData->debugfh, "mpvData->state %x \n", mpvData->state);
-        fprintf (mpvData->debugfh, "mpvData->paused: %x \n", mpvData->paused);
-		fflush (mpvData->debugfh);
-      }
-#endif
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+	/* cleared first, so a wakeup during the drain queues a new event */
+	__atomic_store_n (&mpvData->eventQueued, 0, __ATOMIC_RELEASE);
+	__atomic_store_n (&mpvData->hasEvent, 0, __ATOMIC_RELEASE);
+	Tcl_Preserve (mpvData);
+	mpvEventHandler (mpvData);
+	Tcl_Release (mpvData);
+	return 1;
+}
 
-  if (objc != 1) {
-    Tcl_WrongNumArgs(interp, 1, objv, "");
-    return TCL_ERROR;
-  }
+int
+mpvWakeupEventFilter (
+	Tcl_Event	*evPtr,
+	ClientData	cd
+	)
+{
+	return evPtr->proc == mpvWakeupEventProc &&
+		((mpvWakeupEvent_t *) evPtr)->mpvData == (mpvData_t *) cd;
+}
+
+/*
+* Timer driven wakeup: poll the flag set by mpvCallbackHandler
+* every CHKTIMER ms and drain the mpv event queue when it is set.
+*/
+void
+mpvTimerHandler (
+	ClientData cd
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+
+	if (mpvData->inst == NULL) {
+		return;
+	}
+
+	/* a callback may delete the player while events are drained */
+	Tcl_Preserve (mpvData);
+	if (__atomic_exchange_n (&mpvData->hasEvent, 0, __ATOMIC_ACQ_REL)) {
+		mpvEventHandler (mpvData);
+	}
+
+	if (mpvData->inst != NULL) {
+		mpvData->timerToken = Tcl_CreateTimerHandler (CHKTIMER, &mpvTimerHandler, mpvData);
+	}
+	Tcl_Release (mpvData);
+}
+
+/*
+* File descriptor driven wakeup: called by the Tcl notifier as soon as
+* mpvCallbackHandler has written to the wakeup pipe. Nothing runs
+* while mpv is quiet.
+*/
+void
+mpvWakeupHandler (
+	ClientData cd,
+	int mask
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	char		buf [64];
+
+	/* empty the pipe first, so a wakeup during the drain is not lost */
+	while (read (mpvData->wakeupFd[0], buf, sizeof(buf)) > 0) {
+		;
+	}
+	__atomic_store_n (&mpvData->hasEvent, 0, __ATOMIC_RELEASE);
+	Tcl_Preserve (mpvData);
+	mpvEventHandler (mpvData);
+	Tcl_Release (mpvData);
+}
+
+int
+mpvWakeupOpen (
+	mpvData_t	*mpvData
+	)
+{
+#if defined(_WIN32)
+	/* Tcl file handlers are not available, fall back to polling */
+	mpvData->wakeupMode = WAKEUP_TIMER;
+	return 0;
+#else
+	int		i;
+
+	if (pipe (mpvData->wakeupFd) != 0) {
+		mpvData->wakeupFd[0] = -1;
+		mpvData->wakeupFd[1] = -1;
+		return -1;
+	}
+	for (i = 0; i < 2; ++i) {
+		fcntl (mpvData->wakeupFd[i], F_SETFL, fcntl (mpvData->wakeupFd[i], F_GETFL) | O_NONBLOCK);
+		fcntl (mpvData->wakeupFd[i], F_SETFD, FD_CLOEXEC);
+	}
+	Tcl_CreateFileHandler (mpvData->wakeupFd[0], TCL_READABLE, &mpvWakeupHandler, mpvData);
+	return 0;
+#endif
+}
+
+void
+mpvWakeupClose (
+	mpvData_t	*mpvData
+	)
+{
+	/*
+	* Must be called after the mpv instance is destroyed, the wakeup
+	* callback may write to the pipe until then.
+	*/
+#if ! defined(_WIN32)
+	if (mpvData->wakeupFd[0] >= 0) {
+		Tcl_DeleteFileHandler (mpvData->wakeupFd[0]);
+		close (mpvData->wakeupFd[0]);
+		close (mpvData->wakeupFd[1]);
+	}
+#endif
+	mpvData->wakeupFd[0] = -1;
+	mpvData->wakeupFd[1] = -1;
+	Tcl_DeleteEvents (mpvWakeupEventFilter, (ClientData) mpvData);
+	__atomic_store_n (&mpvData->eventQueued, 0, __ATOMIC_RELEASE);
+}
+
+/*
+* Returns a new dict holding the event name, the caller adds the details.
+*/
+Tcl_Obj *
+mpvCallbackDetails (
+	cbevent	ev
+	)
+{
+	Tcl_Obj	*details;
+
+	details = Tcl_NewDictObj ();
+	Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("event", -1),
+		Tcl_NewStringObj (cbEventNames[ev], -1));
+	return details;
+}
+
+/*
+* Runs the script registered with ::tclmpv::on for this event in the
+* global scope, with the details dict appended as a single argument.
+* Errors in the script are reported as background errors. The scripts
+* of proxies in other threads get the event queued.
+*/
+void
+mpvInvokeCallback (
+	mpvData_t	*mpvData,
+	cbevent		ev,
+	Tcl_Obj		*details
+	)
+{
+	if (mpvData->share != NULL) {
+		mpvShareNotify (mpvData, ev, details);
+	}
+	mpvInvokeObserver (mpvData, mpvData->callbacks[ev], details);
+}
+
+void
+mpvInvokeObserver (
+	mpvData_t	*mpvData,
+	Tcl_Obj		*script,
+	Tcl_Obj		*details
+	)
+{
+	mpvInvokeScript (mpvData->interp, script, details);
+}
+
+/*
+* Evaluates script with details appended at global level. The result
+* and error state of the interpreter are preserved, errors are reported
+* as background errors.
+*/
+void
+mpvInvokeScript (
+	Tcl_Interp	*interp,
+	Tcl_Obj		*script,
+	Tcl_Obj		*details
+	)
+{
+	Tcl_Obj			*cmd;
+	Tcl_InterpState	istate;
+
+	Tcl_IncrRefCount (details);
+	if (script == NULL) {
+		Tcl_DecrRefCount (details);
+		return;
+	}
+
+	cmd = Tcl_DuplicateObj (script);
+	Tcl_IncrRefCount (cmd);
+	if (Tcl_ListObjAppendElement (interp, cmd, details) == TCL_OK) {
+		Tcl_Preserve (interp);
+		istate = Tcl_SaveInterpState (interp, TCL_OK);
+		if (Tcl_EvalObjEx (interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK) {
+			Tcl_AddErrorInfo (interp, "\n    (tclmpv event callback)");
+			Tcl_BackgroundError (interp);
+		}
+		Tcl_RestoreInterpState (interp, istate);
+		Tcl_Release (interp);
+	}
+	Tcl_DecrRefCount (cmd);
+	Tcl_DecrRefCount (details);
+}
+
+/*
+* Sets the reference point from which gettime -precise extrapolates
+* the playback position.
+*/
+void
+mpvAnchorPosition (
+	mpvData_t		*mpvData,
+	double			pos,
+	struct timespec	*now
+	)
+{
+	mpvData->posAnchor = pos;
+	mpvData->posStamp = *now;
+}
+
+/*
+* Returns the playback position at monotonic time now, extrapolated
+* from the last time-pos sample with the cached speed and pause state.
+* No request is made to mpv.
+*/
+double
+mpvPrecisePosition (
+	mpvData_t		*mpvData,
+	struct timespec	*now
+	)
+{
+	double			pos;
+	double			elapsed;
+	double			speed;
+
+	if (! PROPCACHE (mpvData, PROP_TIME_POS).valid) {
+		return 0.0;
+	}
+	pos = mpvData->posAnchor;
+	if (mpvData->state != PS_PLAYING ||
+			(PROPCACHE (mpvData, PROP_PAUSE).valid && PROPCACHE (mpvData, PROP_PAUSE).cache.flag)) {
+		return pos;
+	}
+
+	elapsed = (double) (now->tv_sec - mpvData->posStamp.tv_sec) +
+		(double) (now->tv_nsec - mpvData->posStamp.tv_nsec) / 1e9;
+	/* time-pos arrives many times per second while playing, a longer gap
+	 * means playback stalled and the position must not run away */
+	if (elapsed < 0.0) {
+		elapsed = 0.0;
+	} else if (elapsed > MAXEXTRAPOLATE) {
+		elapsed = MAXEXTRAPOLATE;
+	}
+	speed = 1.0;
+	if (PROPCACHE (mpvData, PROP_SPEED).valid) {
+		speed = PROPCACHE (mpvData, PROP_SPEED).cache.d;
+	}
+	pos += elapsed * speed;
+	if (PROPCACHE (mpvData, PROP_DURATION).valid &&
+			PROPCACHE (mpvData, PROP_DURATION).cache.d > 0.0 &&
+			pos > PROPCACHE (mpvData, PROP_DURATION).cache.d) {
+		pos = PROPCACHE (mpvData, PROP_DURATION).cache.d;
+	}
+	return pos;
+}
+
+/*
+* Appends an entry to the event journal, overwriting the oldest
+* entry when the ring buffer is full.
+*/
+void
+mpvJournalAdd (
+	mpvData_t		*mpvData,
+	mpv_event_id	event,
+	struct timespec	*tstamp
+	)
+{
+	journalEntry_t	*entry;
+
+	mpvData->journalSeq++;
+	entry = &mpvData->journal[mpvData->journalSeq % JOURNALSIZE];
+	entry->seq = mpvData->journalSeq;
+	entry->event = event;
+	entry->state = mpvData->state;
+	entry->tstamp = *tstamp;
+	entry->reason = 0;
+	entry->error = 0;
+	if (event == MPV_EVENT_END_FILE) {
+		entry->reason = mpvData->end_file.reason;
+		entry->error = mpvData->end_file.error;
+	}
+}
+
+/*
+* Appends a record to the trace ring. A position is claimed with an
+* atomic increment and the record is marked complete by storing its
+* sequence number last, so adding never takes a lock. Formatting is
+* left to mpvTraceDrain. Records are only added on the thread owning
+* the player: the flush to the channel is scheduled with
+* Tcl_DoWhenIdle, which runs in the calling thread.
+*/
+void
+mpvTraceAdd (
+	mpvData_t		*mpvData,
+	int				level,
+	tracekind		kind,
+	int				a,
+	int				b,
+	int64_t			w,
+	double			d,
+	const char		*text
+	)
+{
+	mpvTrace_t		*trace = &mpvData->trace;
+	traceRecord_t	*rec;
+	struct timespec	tstamp;
+	uint64_t		pos;
+
+	if (trace->ring == NULL) {
+		return;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &tstamp);
+	pos = __atomic_fetch_add (&trace->head, 1, __ATOMIC_RELAXED);
+	rec = &trace->ring[pos & (TRACESIZE - 1)];
+	__atomic_store_n (&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	rec->nsec = (uint64_t) tstamp.tv_sec * 1000000000 + (uint64_t) tstamp.tv_nsec;
+	rec->kind = (uint16_t) kind;
+	rec->level = (uint16_t) level;
+	rec->a = a;
+	rec->b = b;
+	rec->w = w;
+	rec->d = d;
+	rec->text[0] = '\0';
+	if (text != NULL) {
+		strncpy (rec->text, text, TRACETEXT - 1);
+		rec->text[TRACETEXT - 1] = '\0';
+	}
+	__atomic_store_n (&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* with a channel the records are written out once the interp is idle */
+	if (trace->channel != NULL && ! trace->idleQueued) {
+		trace->idleQueued = 1;
+		Tcl_DoWhenIdle (mpvTraceIdle, (ClientData) mpvData);
+	}
+}
+
+/*
+* Formats a record as one line:
+*	seconds.microseconds level text
+*/
+void
+mpvTraceFormat (
+	traceRecord_t	*rec,
+	Tcl_DString		*line
+	)
+{
+	char			buff [200];
+	const char		*level;
+
+	level = rec->level < TL_TRACE + 1 ? traceLevelNames[rec->level] : "?";
+	snprintf (buff, sizeof (buff), "%llu.%06llu %-5s ",
+		(unsigned long long) (rec->nsec / 1000000000),
+		(unsigned long long) (rec->nsec % 1000000000 / 1000), level);
+	Tcl_DStringAppend (line, buff, -1);
+
+	switch (rec->kind) {
+		case TR_HANDLER: {
+			snprintf (buff, sizeof (buff), "handler drained %d events", rec->a);
+			break;
+		}
+		case TR_EVENT: {
+			snprintf (buff, sizeof (buff), "event %s", mpv_event_name ((mpv_event_id) rec->a));
+			if (rec->b < 0) {
+				Tcl_DStringAppend (line, buff, -1);
+				snprintf (buff, sizeof (buff), " error %s", mpv_error_string (rec->b));
+			}
+			break;
+		}
+		case TR_END_FILE: {
+			snprintf (buff, sizeof (buff), "end-file reason %s error %s entry %lld",
+				mpv_efr_string ((mpv_end_file_reason) rec->a), mpv_error_string (rec->b),
+				(long long) rec->w);
+			break;
+		}
+		case TR_PROPERTY: {
+			switch (rec->a) {
+				case MPV_FORMAT_DOUBLE: {
+					snprintf (buff, sizeof (buff), "property %s %.3f", rec->text, rec->d);
+					break;
+				}
+				case MPV_FORMAT_FLAG: {
+					snprintf (buff, sizeof (buff), "property %s %s", rec->text, rec->w ? "yes" : "no");
+					break;
+				}
+				case MPV_FORMAT_INT64: {
+					snprintf (buff, sizeof (buff), "property %s %lld", rec->text, (long long) rec->w);
+					break;
+				}
+				case MPV_FORMAT_NONE: {
+					snprintf (buff, sizeof (buff), "property %s unavailable", rec->text);
+					break;
+				}
+				default: {
+					snprintf (buff, sizeof (buff), "property %s changed", rec->text);
+					break;
+				}
+			}
+			break;
+		}
+		case TR_STATE: {
+			snprintf (buff, sizeof (buff), "state %s -> %s",
+				stateToStr ((playstate) rec->b), stateToStr ((playstate) rec->a));
+			break;
+		}
+		case TR_COMMAND: {
+			if (rec->d != 0.0) {
+				snprintf (buff, sizeof (buff), "command %s %.2f: %s", rec->text, rec->d,
+					mpv_error_string (rec->b));
+			} else if (rec->a) {
+				snprintf (buff, sizeof (buff), "command %s async %lld: %s", rec->text,
+					(long long) rec->w, mpv_error_string (rec->b));
+			} else {
+				snprintf (buff, sizeof (buff), "command %s: %s", rec->text,
+					mpv_error_string (rec->b));
+			}
+			break;
+		}
+		case TR_MPVLOG: {
+			snprintf (buff, sizeof (buff), "mpv %s", rec->text);
+			break;
+		}
+		default: {
+			snprintf (buff, sizeof (buff), "kind %d", rec->kind);
+			break;
+		}
+	}
+	Tcl_DStringAppend (line, buff, -1);
+}
+
+/*
+* Formats the records which were not drained yet and appends them to
+* list, or writes them to the trace channel when list is NULL. A record
+* which was overwritten while it was copied is counted as dropped.
+*/
+void
+mpvTraceDrain (
+	mpvData_t		*mpvData,
+	Tcl_Obj			*list
+	)
+{
+	mpvTrace_t		*trace = &mpvData->trace;
+	traceRecord_t	*rec;
+	traceRecord_t	copy;
+	Tcl_Channel		chan;
+	Tcl_DString		line;
+	uint64_t		head;
+	uint64_t		seq;
+
+	if (trace->ring == NULL) {
+		return;
+	}
+	chan = NULL;
+	if (list == NULL) {
+		if (trace->channel == NULL) {
+			return;
+		}
+		chan = Tcl_GetChannel (mpvData->interp, trace->channel, NULL);
+		if (chan == NULL) {
+			/* the channel was closed, keep the records for trace drain */
+			Tcl_ResetResult (mpvData->interp);
+			ckfree (trace->channel);
+			trace->channel = NULL;
+			return;
+		}
+	}
+
+	head = __atomic_load_n (&trace->head, __ATOMIC_ACQUIRE);
+	if (head - trace->tail > TRACESIZE) {
+		trace->dropped += head - TRACESIZE - trace->tail;
+		trace->tail = head - TRACESIZE;
+	}
+	Tcl_DStringInit (&line);
+	while (trace->tail < head) {
+		rec = &trace->ring[trace->tail & (TRACESIZE - 1)];
+		seq = __atomic_load_n (&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq <= trace->tail) {
+			/* still being written, picked up by the next drain */
+			break;
+		}
+		memcpy (&copy, rec, sizeof (copy));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (seq != trace->tail + 1 ||
+				__atomic_load_n (&rec->seq, __ATOMIC_RELAXED) != seq) {
+			trace->dropped++;
+			trace->tail++;
+			continue;
+		}
+		trace->tail++;
+		copy.text[TRACETEXT - 1] = '\0';
+		Tcl_DStringSetLength (&line, 0);
+		mpvTraceFormat (&copy, &line);
+		if (chan != NULL) {
+			Tcl_DStringAppend (&line, "\n", 1);
+			Tcl_WriteChars (chan, Tcl_DStringValue (&line), Tcl_DStringLength (&line));
+		} else {
+			Tcl_ListObjAppendElement (NULL, list,
+				Tcl_NewStringObj (Tcl_DStringValue (&line), Tcl_DStringLength (&line)));
+		}
+	}
+	Tcl_DStringFree (&line);
+	if (chan != NULL) {
+		Tcl_Flush (chan);
+	}
+}
+
+void
+mpvTraceIdle (
+	ClientData	cd
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+
+	mpvData->trace.idleQueued = 0;
+	mpvTraceDrain (mpvData, NULL);
+}
+
+/*
+* mpv only sends log messages while tracing is on, at the trace level.
+*/
+void
+mpvTraceLogLevel (
+	mpvData_t	*mpvData
+	)
+{
+	if (mpvData->inst == NULL) {
+		return;
+	}
+	mpv_request_log_messages (mpvData->inst,
+		mpvData->trace.enabled ? traceLevelNames[mpvData->trace.level] : "no");
+}
+
+void
+mpvTraceLogMessage (
+	mpvData_t				*mpvData,
+	mpv_event_log_message	*msg
+	)
+{
+	char	text [TRACETEXT];
+	size_t	len;
+	int		level;
+
+	level = msg->log_level / 10;
+	if (level < TL_FATAL || level > TL_TRACE) {
+		level = TL_TRACE;
+	}
+	snprintf (text, sizeof (text), "%s: %s", msg->prefix, msg->text);
+	len = strlen (text);
+	while (len > 0 && text[len - 1] == '\n') {
+		text[--len] = '\0';
+	}
+	TRACE (mpvData, level, TR_MPVLOG, 0, 0, 0, 0.0, text);
+}
+
+void
+mpvTraceFree (
+	mpvData_t	*mpvData
+	)
+{
+	if (mpvData->trace.idleQueued) {
+		Tcl_CancelIdleCall (mpvTraceIdle, (ClientData) mpvData);
+		mpvData->trace.idleQueued = 0;
+	}
+	mpvData->trace.enabled = 0;
+	if (mpvData->trace.ring != NULL) {
+		ckfree ((char *) mpvData->trace.ring);
+		mpvData->trace.ring = NULL;
+	}
+	if (mpvData->trace.channel != NULL) {
+		ckfree (mpvData->trace.channel);
+		mpvData->trace.channel = NULL;
+	}
+}
+
+/* monotonic time in nanoseconds */
+uint64_t
+mpvStatsNow (
+	void
+	)
+{
+	struct timespec	tstamp;
+
+	clock_gettime (CLOCK_MONOTONIC, &tstamp);
+	return (uint64_t) tstamp.tv_sec * 1000000000 + (uint64_t) tstamp.tv_nsec;
+}
+
+void
+mpvStatsAdd (
+	statsHist_t	*hist,
+	uint64_t	value
+	)
+{
+	int			bucket;
+
+	bucket = value == 0 ? 0 : 64 - __builtin_clzll (value);
+	if (bucket >= STATSBUCKETS) {
+		bucket = STATSBUCKETS - 1;
+	}
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+/*
+* Returns the round trip histogram of the command prefix name, e.g.
+* "loadfile" or "set speed", created on first use.
+*/
+statsHist_t *
+mpvStatsCommandHist (
+	mpvData_t	*mpvData,
+	const char	*prefix,
+	const char	*name
+	)
+{
+	Tcl_HashEntry	*hPtr;
+	Tcl_DString		key;
+	statsHist_t		*hist;
+	int				isNew;
+
+	Tcl_DStringInit (&key);
+	if (prefix != NULL) {
+		Tcl_DStringAppend (&key, prefix, -1);
+	}
+	Tcl_DStringAppend (&key, name, -1);
+	hPtr = Tcl_CreateHashEntry (&mpvData->stats.commands, Tcl_DStringValue (&key), &isNew);
+	Tcl_DStringFree (&key);
+	if (isNew) {
+		hist = (statsHist_t *) ckalloc (sizeof (statsHist_t));
+		memset (hist, 0, sizeof (statsHist_t));
+		Tcl_SetHashValue (hPtr, hist);
+	}
+	return (statsHist_t *) Tcl_GetHashValue (hPtr);
+}
+
+/* a synchronous command started at start has returned status */
+void
+mpvStatsCommand (
+	mpvData_t	*mpvData,
+	const char	*prefix,
+	const char	*name,
+	uint64_t	start,
+	int			status
+	)
+{
+	mpvStatsAdd (mpvStatsCommandHist (mpvData, prefix, name), (mpvStatsNow () - start) / 1000);
+	mpvStatsError (mpvData, status);
+}
+
+void
+mpvStatsError (
+	mpvData_t	*mpvData,
+	int			status
+	)
+{
+	if (status >= 0) {
+		return;
+	}
+	if (-status >= STATSERRORS) {
+		status = MPV_ERROR_GENERIC;
+	}
+	mpvData->stats.errors[-status]++;
+}
+
+/* count, mean, max and the buckets with their upper bound as key */
+Tcl_Obj *
+mpvStatsHistObj (
+	statsHist_t	*hist
+	)
+{
+	Tcl_Obj		*result;
+	Tcl_Obj		*buckets;
+	int			i;
+
+	buckets = Tcl_NewDictObj ();
+	for (i = 0; i < STATSBUCKETS; ++i) {
+		Tcl_DictObjPut (NULL, buckets,
+			i == STATSBUCKETS - 1 ? Tcl_NewStringObj ("inf", -1) :
+			Tcl_NewWideIntObj ((Tcl_WideInt) 1 << i),
+			Tcl_NewWideIntObj ((Tcl_WideInt) hist->buckets[i]));
+	}
+	result = Tcl_NewDictObj ();
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("count", -1),
+		Tcl_NewWideIntObj ((Tcl_WideInt) hist->count));
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("mean", -1),
+		Tcl_NewDoubleObj (hist->count == 0 ? 0.0 : (double) hist->sum / (double) hist->count));
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("max", -1),
+		Tcl_NewWideIntObj ((Tcl_WideInt) hist->max));
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("buckets", -1), buckets);
+	return result;
+}
+
+/*
+* Clears the counters. The command histograms are kept, pending
+* asynchronous requests point to them.
+*/
+void
+mpvStatsReset (
+	mpvData_t	*mpvData
+	)
+{
+	mpvStats_t		*stats = &mpvData->stats;
+	Tcl_HashEntry	*hPtr;
+	Tcl_HashSearch	search;
+
+	memset (stats->events, 0, sizeof (stats->events));
+	memset (stats->errors, 0, sizeof (stats->errors));
+	stats->handlerCalls = 0;
+	memset (&stats->drained, 0, sizeof (statsHist_t));
+	memset (&stats->runtime, 0, sizeof (statsHist_t));
+	memset (&stats->wakeup, 0, sizeof (statsHist_t));
+	for (hPtr = Tcl_FirstHashEntry (&stats->commands, &search); hPtr != NULL;
+			hPtr = Tcl_NextHashEntry (&search)) {
+		memset (Tcl_GetHashValue (hPtr), 0, sizeof (statsHist_t));
+	}
+}
+
+void
+mpvStatsFree (
+	mpvData_t	*mpvData
+	)
+{
+	Tcl_HashEntry	*hPtr;
+	Tcl_HashSearch	search;
+
+	for (hPtr = Tcl_FirstHashEntry (&mpvData->stats.commands, &search); hPtr != NULL;
+			hPtr = Tcl_NextHashEntry (&search)) {
+		ckfree ((char *) Tcl_GetHashValue (hPtr));
+	}
+	Tcl_DeleteHashTable (&mpvData->stats.commands);
+}
+
+void
+mpvEventHandler (
+  ClientData cd
+  )
+{
+	mpvData_t   *mpvData = (mpvData_t *) cd;
+	mpv_event	*event;
+	playstate   stateflag;
+	playstate	prevstate;
+	struct		timespec curtime;
+	cbevent		ev;
+	Tcl_Obj		*details;
+	mpvObserved_t	*obs;
+	mpv_event_hook	*hook;
+	int			drained;
+	uint64_t	woken;
+	uint64_t	start;
+
+	if (mpvData->inst == NULL) {
+		return;
+	}
+	/* a callback entering the event loop, e.g. with update, must not
+	 * drain the queue: mpv_wait_event would overwrite the event the
+	 * outer call has not handled yet. The outer call drains it. */
+	if (mpvData->inHandler) {
+		mpvData->rewake = 1;
+		return;
+	}
+	mpvData->inHandler = 1;
+
+	woken = __atomic_exchange_n (&mpvData->stats.wakeupNsec, 0, __ATOMIC_ACQ_REL);
+	start = mpvStatsNow ();
+	if (woken != 0 && woken <= start) {
+		mpvStatsAdd (&mpvData->stats.wakeup, (start - woken) / 1000);
+	}
+	drained = 0;
+	event = mpv_wait_event (mpvData->inst, 0.0);
+	stateflag = stateMap[(int) mpvData->stateMapIdx[event->event_id]].stateflag;
+	clock_gettime (CLOCK_MONOTONIC, &curtime);
+
+	while (event->event_id != MPV_EVENT_NONE) {
+		/* property callbacks run before those of the next other event */
+		if (event->event_id != MPV_EVENT_PROPERTY_CHANGE && mpvData->dirtyHead != 0) {
+			mpvObservedFlush (mpvData);
+			if (mpvData->inst == NULL) {
+				break;
+			}
+		}
+		prevstate = mpvData->state;
+		obs = NULL;
+		++drained;
+		mpvData->stats.events[event->event_id]++;
+		mpvStatsError (mpvData, event->error);
+
+		/* log messages are only requested while tracing */
+		if (event->event_id == MPV_EVENT_LOG_MESSAGE) {
+			mpvTraceLogMessage (mpvData, (mpv_event_log_message *) event->data);
+		} else {
+			TRACE (mpvData, TL_V, TR_EVENT, event->event_id, event->error, 0, 0.0, NULL);
+		}
+
+		if (event->event_id == MPV_EVENT_END_FILE ) {
+			mpv_event_end_file *end_file = (mpv_event_end_file *) event->data;
+			mpvData->end_file = (mpv_event_end_file) {.reason = end_file->reason, .error = end_file->error};
+			eofEntry_t *eof = &mpvData->eofHistory[mpvData->eofCount++ % EOFHISTORYSIZE];
+#if MPV_CLIENT_GT_1108
+			eof->entryId = end_file->playlist_entry_id;
+#else
+			eof->entryId = 0;
+#endif
+			eof->reason = end_file->reason;
+			eof->error = end_file->error;
+			mpvStatsError (mpvData, end_file->error);
+			TRACE (mpvData, TL_INFO, TR_END_FILE, end_file->reason, end_file->error,
+				(int64_t) eof->entryId, 0.0, NULL);
+		}
+
+		if (event->event_id == MPV_EVENT_PROPERTY_CHANGE) {
+
+			/************ start event == property change  ***************/
+			mpv_event_property *prop = (mpv_event_property *) event->data;
+
+
+			obs = NULL;
+			if (event->reply_userdata > 0 &&
+					event->reply_userdata <= (uint64_t) mpvData->observedCount) {
+				obs = &mpvData->observed[event->reply_userdata - 1];
+			}
+			/* changes below -mindelta are dropped, the callbacks of the
+			 * others run once per drain pass, from mpvObservedFlush */
+			if (obs != NULL && (obs->name == NULL || ! mpvObservedAccept (obs, prop))) {
+				obs = NULL;
+			}
+			if (obs != NULL) {
+				if (event->reply_userdata == PROP_PAUSE || event->reply_userdata == PROP_SPEED) {
+					/* extrapolation continues from here with the new rate */
+					mpvAnchorPosition (mpvData, mpvPrecisePosition (mpvData, &curtime), &curtime);
+				}
+				mpvCacheProperty (obs, prop);
+
+				switch (event->reply_userdata) {
+					case PROP_TIME_POS: {
+						// AFAIK when a time-pos event is received, the player is proceeding
+						if (mpvData->state == PS_BUFFERING) {
+							mpvData->state = PS_PLAYING;
+						}
+						mpvAnchorPosition (mpvData, obs->cache.d, &curtime);
+						break;
+					}
+					case PROP_DURATION: {
+						if (obs->valid) {
+							mpvData->durationSeen = 1;
+							mpvCacheLearn (mpvData, obs->cache.d);
+						}
+						break;
+					}
+					case PROP_IDLE_ACTIVE: {
+						if (obs->valid && obs->cache.flag) { 
+						// only use this to enter into idle state not to leave it
+							mpvData->state = PS_IDLE;
+						} 
+						break;
+					}
+					default: {
+						break;
+					}
+				}
+				mpvObservedMark (mpvData, (int) event->reply_userdata - 1);
+			}
+		/***********i END PROPERTY CHANGE ***************/
+		} else if (stateflag != PS_NONE) {
+				  mpvData->state = stateflag;
+		} /****** end stateflage != PS_NONE ********/
+		if (mpvData->state != prevstate) {
+			TRACE (mpvData, TL_INFO, TR_STATE, mpvData->state, prevstate, 0, 0.0, NULL);
+		}
+		/* a value reported by ::tclmpv::status has changed */
+		if (mpvData->state != prevstate || event->event_id == MPV_EVENT_END_FILE ||
+				(event->event_id == MPV_EVENT_PROPERTY_CHANGE && obs != NULL &&
+				event->reply_userdata < PROP_BUILTIN_MAX)) {
+			++mpvData->generation;
+		}
+
+		/* property changes are only journaled when they change the state,
+		 * replies to async requests are no state events */
+		if ((event->event_id != MPV_EVENT_PROPERTY_CHANGE ||
+				mpvData->state != prevstate) &&
+				event->event_id != MPV_EVENT_LOG_MESSAGE &&
+				event->event_id != MPV_EVENT_COMMAND_REPLY &&
+				event->event_id != MPV_EVENT_SET_PROPERTY_REPLY &&
+				event->event_id != MPV_EVENT_GET_PROPERTY_REPLY) {
+			mpvJournalAdd (mpvData, event->event_id, &curtime);
+		}
+
+		/* the path is needed by the metadata cache, it is requested
+		 * without waiting as the file may come from the playlist,
+		 * the gain is applied with the reply */
+		if (event->event_id == MPV_EVENT_START_FILE) {
+			mpvData->durationSeen = 0;
+		}
+		if (event->event_id == MPV_EVENT_START_FILE && mpvData->cache != NULL &&
+				mpvData->cache->header != NULL) {
+			mpv_get_property_async (mpvData->inst, REPLY_PATH, "path", MPV_FORMAT_STRING);
+		} else if (event->event_id == MPV_EVENT_START_FILE && mpvData->gainEnabled) {
+			mpvGainApply (mpvData);
+		}
+		/* mpv waits with loading the file until the hook is continued */
+		if (event->event_id == MPV_EVENT_HOOK && mpvData->inst != NULL) {
+			hook = (mpv_event_hook *) event->data;
+			if (mpvData->trimEnabled && strcmp (hook->name, "on_load") == 0) {
+				mpvCueHook (mpvData);
+			}
+			mpv_hook_continue (mpvData->inst, hook->id);
+		}
+
+		/* replies to asynchronous requests */
+		if (event->event_id == MPV_EVENT_GET_PROPERTY_REPLY &&
+				event->reply_userdata == REPLY_PATH) {
+			mpvPathReply (mpvData, event);
+		} else if ((event->event_id == MPV_EVENT_COMMAND_REPLY ||
+				event->event_id == MPV_EVENT_SET_PROPERTY_REPLY) &&
+				event->reply_userdata != 0) {
+			mpvAsyncReply (mpvData, event);
+		}
+
+		/* script callbacks registered with ::tclmpv::on */
+		ev = CB_MAX;
+		switch (event->event_id) {
+			case MPV_EVENT_START_FILE: { ev = CB_START_FILE; break; }
+			case MPV_EVENT_FILE_LOADED: { ev = CB_FILE_LOADED; break; }
+			case MPV_EVENT_END_FILE: { ev = CB_END_FILE; break; }
+			case MPV_EVENT_SEEK: { ev = CB_SEEK; break; }
+			case MPV_EVENT_PLAYBACK_RESTART: { ev = CB_PLAYBACK_RESTART; break; }
+			default: { break; }
+		}
+		if (ev != CB_MAX && HASCALLBACK (mpvData, ev) && mpvData->inst != NULL) {
+			details = mpvCallbackDetails (ev);
+			if (ev == CB_END_FILE) {
+				Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("reason", -1),
+					Tcl_NewStringObj (mpv_efr_string (mpvData->end_file.reason), -1));
+				Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("error", -1),
+					Tcl_NewStringObj (mpv_error_string (mpvData->end_file.error), -1));
+#if MPV_CLIENT_GT_1108
+				Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("entryid", -1),
+					Tcl_NewWideIntObj ((Tcl_WideInt) ((mpv_event_end_file *) event->data)->playlist_entry_id));
+#endif
+			} else if (ev == CB_PLAYBACK_RESTART) {
+				Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("position", -1),
+					Tcl_NewDoubleObj (PROPCACHE (mpvData, PROP_TIME_POS).cache.d));
+			}
+			mpvInvokeCallback (mpvData, ev, details);
+		}
+		if (mpvData->state == PS_IDLE && prevstate != PS_IDLE &&
+				HASCALLBACK (mpvData, CB_IDLE) && mpvData->inst != NULL) {
+			mpvInvokeCallback (mpvData, CB_IDLE, mpvCallbackDetails (CB_IDLE));
+		}
+
+		/* a callback may have closed the player */
+		if (mpvData->inst == NULL) {
+			break;
+		}
+
+		event = mpv_wait_event (mpvData->inst, 0.0);
+		stateflag = stateMap[(int) mpvData->stateMapIdx[event->event_id]].stateflag;
+		clock_gettime (CLOCK_MONOTONIC, &curtime);
+
+	} /******** end while event != 0 *********/
+	if (mpvData->dirtyHead != 0) {
+		mpvObservedFlush (mpvData);
+	}
+	/* variables set with ::tclmpv::bind */
+	if (drained > 0 && mpvData->inst != NULL) {
+		mpvBindUpdate (mpvData);
+	}
+	mpvData->stats.handlerCalls++;
+	mpvStatsAdd (&mpvData->stats.drained, (uint64_t) drained);
+	mpvStatsAdd (&mpvData->stats.runtime, (mpvStatsNow () - start) / 1000);
+	if (drained > 0) {
+		TRACE (mpvData, TL_TRACE, TR_HANDLER, drained, 0, 0, 0.0, NULL);
+	}
+	mpvData->inHandler = 0;
+	/* the wakeup consumed by a skipped nested call, events may have
+	 * arrived after the final mpv_wait_event */
+	if (mpvData->rewake) {
+		mpvData->rewake = 0;
+		if (mpvData->inst != NULL) {
+			mpvCallbackHandler (mpvData);
+		}
+	}
+}
+
+int
+mpvDurationCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  double            tm;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+	
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "");
+    return TCL_ERROR;
+  }
+
+    tm = PROPCACHE (mpvData, PROP_DURATION).cache.d;
+    Tcl_SetObjResult (interp, Tcl_NewDoubleObj (tm));
+	return TCL_OK;
+}
+
+int
+mpvEofInfoCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	Tcl_WideInt	entryId;
+	Tcl_WideInt	n;
+	eofEntry_t	*eof;
+	mpv_end_file_reason	reason;
+	int			error;
+	char		errmsg[256];
+	
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (objc != 1 && objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?entryid?");
+		return TCL_ERROR;
+	}
+
+	reason = mpvData->end_file.reason;
+	error = mpvData->end_file.error;
+	if (objc == 2) {
+		if (Tcl_GetWideIntFromObj (interp, objv[1], &entryId) != TCL_OK) {
+			return TCL_ERROR;
+		}
+#if ! MPV_CLIENT_GT_1108
+		Tcl_AddErrorInfo (interp, "error: playlist entry ids are not supported by this version of libmpv");
+		return TCL_ERROR;
+#else
+		/* search from the most recent end-file backwards */
+		eof = NULL;
+		for (n = mpvData->eofCount - 1;
+				n >= 0 && n >= mpvData->eofCount - EOFHISTORYSIZE; --n) {
+			if (mpvData->eofHistory[n % EOFHISTORYSIZE].entryId == (int64_t) entryId) {
+				eof = &mpvData->eofHistory[n % EOFHISTORYSIZE];
+				break;
+			}
+		}
+		if (eof == NULL) {
+			snprintf (errmsg, sizeof(errmsg), "error: no end-file information for playlist entry %"
+				TCL_LL_MODIFIER "d", entryId);
+			Tcl_AddErrorInfo (interp, errmsg);
+			return TCL_ERROR;
+		}
+		reason = eof->reason;
+		error = eof->error;
+#endif
+	}
+
+	Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+	Tcl_Obj *str = Tcl_NewStringObj(mpv_efr_string (reason), -1);
+	Tcl_ListObjAppendElement(interp, list, str);	
+	str = Tcl_NewStringObj(mpv_error_string (error), -1);
+	Tcl_ListObjAppendElement(interp, list, str);	
+	Tcl_SetObjResult (interp, list);
+	return TCL_OK;
+}
+
+int
+mpvEventsCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	journalEntry_t	*entry;
+	Tcl_Obj			*list;
+	Tcl_Obj			*eobj;
+	Tcl_Obj			*result;
+	Tcl_WideInt		since;
+	Tcl_WideInt		oldest;
+	Tcl_WideInt		lost;
+	Tcl_WideInt		seq;
+	int				max;
+	int				i;
+	int				idx;
+	static const char *options[] = { "-since", "-max", NULL };
+
+	/********
+	Call with: ::tclmpv::events ?-since seq? ?-max n?
+	Returns a dict with the keys
+		seq: sequence number of the last returned entry, pass it
+			to -since on the next call
+		lost: number of entries after -since which were overwritten
+			before they were read
+		events: list of entries, oldest first
+	********/
+	if ((objc % 2) != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-since seq? ?-max n?");
+		return TCL_ERROR;
+	}
+
+	since = 0;
+	max = JOURNALSIZE;
+	for (i = 1; i < objc; i += 2) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], options, "option", 0, &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (idx == 0) {
+			if (Tcl_GetWideIntFromObj (interp, objv[i+1], &since) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			if (since < 0) {
+				Tcl_AddErrorInfo (interp, "error: -since must not be negative");
+				return TCL_ERROR;
+			}
+		} else {
+			if (Tcl_GetIntFromObj (interp, objv[i+1], &max) != TCL_OK) {
+				return TCL_ERROR;
+			}
+		}
+	}
+
+	oldest = mpvData->journalSeq - JOURNALSIZE + 1;
+	if (oldest < 1) {
+		oldest = 1;
+	}
+	lost = 0;
+	if (since + 1 < oldest) {
+		lost = oldest - (since + 1);
+		since = oldest - 1;
+	}
+
+	list = Tcl_NewListObj (0, NULL);
+	for (seq = since + 1; seq <= mpvData->journalSeq && max > 0; ++seq, --max) {
+		entry = &mpvData->journal[seq % JOURNALSIZE];
+		eobj = Tcl_NewDictObj ();
+		Tcl_DictObjPut (NULL, eobj, Tcl_NewStringObj ("seq", -1),
+			Tcl_NewWideIntObj (entry->seq));
+		Tcl_DictObjPut (NULL, eobj, Tcl_NewStringObj ("time", -1),
+			Tcl_NewDoubleObj ((double) entry->tstamp.tv_sec + (double) entry->tstamp.tv_nsec / 1.0e9));
+		Tcl_DictObjPut (NULL, eobj, Tcl_NewStringObj ("event", -1),
+			Tcl_NewStringObj (mpv_event_name (entry->event), -1));
+		Tcl_DictObjPut (NULL, eobj, Tcl_NewStringObj ("state", -1),
+			Tcl_NewStringObj (stateToStr (entry->state), -1));
+		if (entry->event == MPV_EVENT_END_FILE) {
+			Tcl_DictObjPut (NULL, eobj, Tcl_NewStringObj ("reason", -1),
+				Tcl_NewStringObj (mpv_efr_string (entry->reason), -1));
+			Tcl_DictObjPut (NULL, eobj, Tcl_NewStringObj ("error", -1),
+				Tcl_NewStringObj (mpv_error_string (entry->error), -1));
+		}
+		Tcl_ListObjAppendElement (interp, list, eobj);
+		since = seq;
+	}
+
+	result = Tcl_NewDictObj ();
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("seq", -1), Tcl_NewWideIntObj (since));
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("lost", -1), Tcl_NewWideIntObj (lost));
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("events", -1), list);
+	Tcl_SetObjResult (interp, result);
+	return TCL_OK;
+}
+
+int
+mpvTraceCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	mpvTrace_t		*trace = &mpvData->trace;
+	Tcl_Obj			*result;
+	Tcl_Channel		chan;
+	const char		*chanName;
+	uint64_t		pending;
+	int				mode;
+	int				level;
+	int				idx;
+	int				i;
+	static const char *subcmds[] = { "on", "off", "drain", NULL };
+	static const char *options[] = { "-level", "-channel", NULL };
+
+	/********
+	Call with: ::tclmpv::trace ?on|off|drain? ?-level level? ?-channel chan?
+	Without arguments returns a dict with the keys
+		enabled, level, channel
+		pending: records not drained yet
+		dropped: records overwritten before they were drained
+	"trace drain" returns the pending records as a list of lines.
+	********/
+	if (objc == 1) {
+		result = Tcl_NewDictObj ();
+		Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("enabled", -1),
+			Tcl_NewBooleanObj (trace->enabled));
+		Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("level", -1),
+			Tcl_NewStringObj (traceLevelNames[trace->level], -1));
+		Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("channel", -1),
+			Tcl_NewStringObj (trace->channel == NULL ? "" : trace->channel, -1));
+		pending = 0;
+		if (trace->ring != NULL) {
+			pending = __atomic_load_n (&trace->head, __ATOMIC_ACQUIRE) - trace->tail;
+			if (pending > TRACESIZE) {
+				pending = TRACESIZE;
+			}
+		}
+		Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("pending", -1),
+			Tcl_NewWideIntObj ((Tcl_WideInt) pending));
+		Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("dropped", -1),
+			Tcl_NewWideIntObj ((Tcl_WideInt) trace->dropped));
+		Tcl_SetObjResult (interp, result);
+		return TCL_OK;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], subcmds, "subcommand", 0, &idx) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	if (idx == 2) {
+		if (objc != 2) {
+			Tcl_WrongNumArgs(interp, 2, objv, "");
+			return TCL_ERROR;
+		}
+		result = Tcl_NewListObj (0, NULL);
+		mpvTraceDrain (mpvData, result);
+		Tcl_SetObjResult (interp, result);
+		return TCL_OK;
+	}
+	if (idx == 1) {
+		if (objc != 2) {
+			Tcl_WrongNumArgs(interp, 2, objv, "");
+			return TCL_ERROR;
+		}
+		trace->enabled = 0;
+		mpvTraceLogLevel (mpvData);
+		mpvTraceDrain (mpvData, NULL);
+		return TCL_OK;
+	}
+
+	if ((objc % 2) != 0) {
+		Tcl_WrongNumArgs(interp, 2, objv, "?-level level? ?-channel chan?");
+		return TCL_ERROR;
+	}
+	level = trace->level;
+	chanName = NULL;
+	for (i = 2; i < objc; i += 2) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], options, "option", 0, &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (idx == 0) {
+			if (Tcl_GetIndexFromObj (interp, objv[i+1], traceLevelNames + 1, "level", 0, &level) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			level += 1;
+		} else {
+			chanName = Tcl_GetString (objv[i+1]);
+			if (*chanName != '\0') {
+				chan = Tcl_GetChannel (interp, chanName, &mode);
+				if (chan == NULL) {
+					return TCL_ERROR;
+				}
+				if ((mode & TCL_WRITABLE) == 0) {
+					Tcl_AddErrorInfo (interp, "error: trace channel is not writable");
+					return TCL_ERROR;
+				}
+			}
+		}
+	}
+
+	if (trace->ring == NULL) {
+		trace->ring = (traceRecord_t *) ckalloc (sizeof (traceRecord_t) * TRACESIZE);
+		memset (trace->ring, 0, sizeof (traceRecord_t) * TRACESIZE);
+		trace->head = 0;
+		trace->tail = 0;
+	}
+	if (chanName != NULL) {
+		/* records of the previous channel go there first */
+		mpvTraceDrain (mpvData, NULL);
+		if (trace->channel != NULL) {
+			ckfree (trace->channel);
+			trace->channel = NULL;
+		}
+		if (*chanName != '\0') {
+			trace->channel = ckalloc (strlen (chanName) + 1);
+			strcpy (trace->channel, chanName);
+		}
+	}
+	trace->level = level;
+	trace->enabled = 1;
+	mpvTraceLogLevel (mpvData);
+	return TCL_OK;
+}
+
+int
+mpvStatsCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	mpvStats_t		*stats = &mpvData->stats;
+	Tcl_HashEntry	*hPtr;
+	Tcl_HashSearch	search;
+	Tcl_Obj			*result;
+	Tcl_Obj			*dict;
+	int				i;
+
+	/********
+	Call with: ::tclmpv::stats ?-reset?
+	Returns a dict with the keys
+		events: count per mpv event name
+		handler: calls of the event handler, events drained per call
+			and the run time of a call
+		wakeup: time from the mpv wakeup callback to the event handler
+		commands: round trip time per mpv command, property writes
+			as "set name"
+		errors: count per mpv error string
+	Times are in microseconds. With -reset the counters are cleared
+	after they are returned.
+	********/
+	if (objc > 2 || (objc == 2 && strcmp (Tcl_GetString (objv[1]), "-reset") != 0)) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-reset?");
+		return TCL_ERROR;
+	}
+
+	result = Tcl_NewDictObj ();
+	dict = Tcl_NewDictObj ();
+	for (i = 0; i < stateMapIdxMax; ++i) {
+		if (stats->events[i] > 0) {
+			Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj (mpv_event_name ((mpv_event_id) i), -1),
+				Tcl_NewWideIntObj ((Tcl_WideInt) stats->events[i]));
+		}
+	}
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("events", -1), dict);
+
+	dict = Tcl_NewDictObj ();
+	Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("calls", -1),
+		Tcl_NewWideIntObj ((Tcl_WideInt) stats->handlerCalls));
+	Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("drained", -1),
+		mpvStatsHistObj (&stats->drained));
+	Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("runtime", -1),
+		mpvStatsHistObj (&stats->runtime));
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("handler", -1), dict);
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("wakeup", -1),
+		mpvStatsHistObj (&stats->wakeup));
+
+	dict = Tcl_NewDictObj ();
+	for (hPtr = Tcl_FirstHashEntry (&stats->commands, &search); hPtr != NULL;
+			hPtr = Tcl_NextHashEntry (&search)) {
+		if (((statsHist_t *) Tcl_GetHashValue (hPtr))->count > 0) {
+			Tcl_DictObjPut (NULL, dict,
+				Tcl_NewStringObj (Tcl_GetHashKey (&stats->commands, hPtr), -1),
+				mpvStatsHistObj ((statsHist_t *) Tcl_GetHashValue (hPtr)));
+		}
+	}
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("commands", -1), dict);
+
+	dict = Tcl_NewDictObj ();
+	for (i = 1; i < STATSERRORS; ++i) {
+		if (stats->errors[i] > 0) {
+			Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj (mpv_error_string (-i), -1),
+				Tcl_NewWideIntObj ((Tcl_WideInt) stats->errors[i]));
+		}
+	}
+	Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("errors", -1), dict);
+
+	if (objc == 2) {
+		mpvStatsReset (mpvData);
+	}
+	Tcl_SetObjResult (interp, result);
+	return TCL_OK;
+}
+
+int
+mpvGetCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	Tcl_Obj			*value;
+	int				status;
+	char			errmsg[256];
+
+	/********
+	Call with: ::tclmpv::get property
+	Returns the value of any mpv property, converted to the matching
+	Tcl type: dicts for maps, lists for arrays, numbers and strings.
+	********/
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "property");
+		return TCL_ERROR;
+	}
+
+	status = mpvGetProperty (mpvData, Tcl_GetString (objv[1]), &value);
+	if (status < 0) {
+		snprintf (errmsg, sizeof(errmsg), "error getting property %s: %s",
+			Tcl_GetString (objv[1]), mpv_error_string (status));
+		Tcl_AddErrorInfo (interp, errmsg);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult (interp, value);
+	return TCL_OK;
+}
+
+/*
+* Stores the value of property name in *value. Observed properties
+* are served from the registry cache, others are read from mpv.
+* Returns the mpv status.
+*/
+int
+mpvGetProperty (
+	mpvData_t		*mpvData,
+	const char		*name,
+	Tcl_Obj			**value
+	)
+{
+	mpvObserved_t	*obs;
+	mpv_node		node;
+	int				status;
+
+	obs = mpvFindObserved (mpvData, name);
+	if (obs != NULL && obs->valid) {
+		*value = mpvCachedObj (obs);
+		return 0;
+	}
+
+	status = mpv_get_property (mpvData->inst, name, MPV_FORMAT_NODE, &node);
+	if (status < 0) {
+		return status;
+	}
+	*value = mpvNodeToObj (&node);
+	mpv_free_node_contents (&node);
+	return 0;
+}
+
+/*
+* ::tclmpv::batch {{cmd ?arg ...?} ...}
+* Runs a list of mpv commands in one call. Each item is an mpv command
+* passed with mpv_command_node, except "get property", which is served
+* like ::tclmpv::get. No events are processed between the items.
+* Returns a list with {ok result} or {error message} per item.
+*/
+int
+mpvBatchCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	Tcl_Obj			**items;
+	Tcl_Obj			**words;
+	Tcl_Obj			*results;
+	Tcl_Obj			*pair[2];
+	Tcl_Obj			*value;
+	mpv_node		args;
+	mpv_node		result;
+	int				itemCount;
+	int				wordCount;
+	int				status;
+	int				i;
+	int				j;
+
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "commandlist");
+		return TCL_ERROR;
+	}
+	if (Tcl_ListObjGetElements (interp, objv[1], &itemCount, &items) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	results = Tcl_NewListObj (0, NULL);
+	for (i = 0; i < itemCount; ++i) {
+		if (Tcl_ListObjGetElements (NULL, items[i], &wordCount, &words) != TCL_OK ||
+				wordCount == 0) {
+			pair[0] = Tcl_NewStringObj ("error", -1);
+			pair[1] = Tcl_NewStringObj ("invalid command list", -1);
+			Tcl_ListObjAppendElement (NULL, results, Tcl_NewListObj (2, pair));
+			continue;
+		}
+
+		value = NULL;
+		if (wordCount == 2 && strcmp (Tcl_GetString (words[0]), "get") == 0) {
+			status = mpvGetProperty (mpvData, Tcl_GetString (words[1]), &value);
+		} else {
+			/* a command may change the speed or the audio device */
+			mpvDirtyReset (mpvData);
+			/* all arguments are passed as strings and parsed by mpv */
+			args.format = MPV_FORMAT_NODE_ARRAY;
+			args.u.list = (mpv_node_list *) ckalloc (sizeof (mpv_node_list));
+			args.u.list->num = wordCount;
+			args.u.list->keys = NULL;
+			args.u.list->values = (mpv_node *) ckalloc (sizeof (mpv_node) * (size_t) wordCount);
+			for (j = 0; j < wordCount; ++j) {
+				args.u.list->values[j].format = MPV_FORMAT_STRING;
+				args.u.list->values[j].u.string = Tcl_GetString (words[j]);
+			}
+			status = mpv_command_node (mpvData->inst, &args, &result);
+			mpvFreeNode (&args);
+			if (status >= 0) {
+				value = mpvNodeToObj (&result);
+				mpv_free_node_contents (&result);
+			}
+		}
+
+		if (status < 0) {
+			pair[0] = Tcl_NewStringObj ("error", -1);
+			pair[1] = Tcl_NewStringObj (mpv_error_string (status), -1);
+		} else {
+			pair[0] = Tcl_NewStringObj ("ok", -1);
+			pair[1] = value;
+		}
+		Tcl_ListObjAppendElement (NULL, results, Tcl_NewListObj (2, pair));
+	}
+	Tcl_SetObjResult (interp, results);
+	return TCL_OK;
+}
+
+int
+mpvGetTimeCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  double    tm;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+  struct    timespec now;
+
+  if (objc > 2 || (objc == 2 && strcmp (Tcl_GetString (objv[1]), "-precise") != 0)) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-precise?");
+    return TCL_ERROR;
+  }
+
+  rc = TCL_OK;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else if (objc == 2) {
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    tm = mpvPrecisePosition (mpvData, &now);
+    Tcl_SetObjResult (interp, Tcl_NewDoubleObj (tm));
+  } else {
+    tm = PROPCACHE (mpvData, PROP_TIME_POS).cache.d;
+    Tcl_SetObjResult (interp, Tcl_NewDoubleObj (tm));
+  }
+  return rc;
+}
+
+int
+mpvIsPlayCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  int       rval;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "");
+    return TCL_ERROR;
+  }
+
+  rc = TCL_OK;
+  rval = 0;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    /*
+     * In order to match the implementation of VLC's internal
+     * isplaying command, return true if the player is paused
+     * If the telnet VLC interface is ever dropped, this interface
+     * could be enhanced.
+     */
+    if (mpvData->state ==  PS_OPENING ||
+        mpvData->state ==  PS_PLAYING ||
+        mpvData->state ==  PS_PAUSED) {
+      rval = 1;
+    }
+    Tcl_SetObjResult (interp, Tcl_NewIntObj (rval));
+  }
+  return rc;
+}
+
+int
+mpvObserveCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	mpvObserved_t	*obs;
+	Tcl_Obj			*script;
+	const char		*name;
+	uint64_t		id;
+	double			d;
+	double			mindelta;
+	double			maxrate;
+	int				i;
+	int				idx;
+	int				status;
+	char			errmsg[256];
+	static const char *options[] = { "-mindelta", "-maxrate", NULL };
+
+	/********
+	Call with: ::tclmpv::observe property ?-mindelta delta? ?-maxrate hz? ?script?
+	The script is called with the same dict as the property-change
+	callback each time the property changes. An empty script stops
+	observing the property, without script the current script is
+	returned. Observers are kept when the player is closed and are
+	registered again by init.
+	The properties the extension observes itself stay observed,
+	only their script is set or removed.
+	-mindelta drops numeric changes smaller than delta, -maxrate
+	limits the callbacks to hz per second. Changes within one drain
+	pass are always coalesced to the last value.
+	********/
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "property ?-mindelta delta? ?-maxrate hz? ?script?");
+		return TCL_ERROR;
+	}
+	mindelta = -1.0;
+	maxrate = -1.0;
+	for (i = 2; i + 1 < objc; i += 2) {
+		if (Tcl_GetIndexFromObj (NULL, objv[i], options, "option", 0, &idx) != TCL_OK) {
+			break;
+		}
+		if (Tcl_GetDoubleFromObj (interp, objv[i+1], &d) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (d < 0.0) {
+			snprintf (errmsg, sizeof(errmsg), "error: %s must not be negative", options[idx]);
+			Tcl_AddErrorInfo (interp, errmsg);
+			return TCL_ERROR;
+		}
+		if (idx == 0) {
+			mindelta = d;
+		} else {
+			maxrate = d;
+		}
+	}
+	if (objc - i > 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "property ?-mindelta delta? ?-maxrate hz? ?script?");
+		return TCL_ERROR;
+	}
+	script = i < objc ? objv[i] : NULL;
+
+	name = Tcl_GetString (objv[1]);
+	obs = mpvFindObserved (mpvData, name);
+
+	if (script == NULL) {
+		if (mindelta < 0.0 && maxrate < 0.0) {
+			if (obs != NULL && obs->script != NULL) {
+				Tcl_SetObjResult (interp, obs->script);
+			}
+			return TCL_OK;
+		}
+		if (obs == NULL) {
+			snprintf (errmsg, sizeof(errmsg), "error: property %s is not observed", name);
+			Tcl_AddErrorInfo (interp, errmsg);
+			return TCL_ERROR;
+		}
+		obs->mindelta = mindelta >= 0.0 ? mindelta : obs->mindelta;
+		obs->maxrate = maxrate >= 0.0 ? maxrate : obs->maxrate;
+		return TCL_OK;
+	}
+
+	if (obs != NULL) {
+		id = (uint64_t) (obs - mpvData->observed) + 1;
+		if (obs->script != NULL) {
+			Tcl_DecrRefCount (obs->script);
+			obs->script = NULL;
+		}
+		if (Tcl_GetCharLength (script) > 0) {
+			obs->script = script;
+			Tcl_IncrRefCount (obs->script);
+			obs->mindelta = mindelta >= 0.0 ? mindelta : obs->mindelta;
+			obs->maxrate = maxrate >= 0.0 ? maxrate : obs->maxrate;
+			return TCL_OK;
+		}
+		if (id >= PROP_BUILTIN_MAX) {
+			if (mpvData->inst != NULL) {
+				mpv_unobserve_property (mpvData->inst, id);
+			}
+			mpvObservedUnmark (mpvData, (int) id - 1);
+			if (obs->value != NULL) {
+				Tcl_DecrRefCount (obs->value);
+				obs->value = NULL;
+			}
+			ckfree (obs->name);
+			obs->name = NULL;
+		}
+		return TCL_OK;
+	}
+	if (Tcl_GetCharLength (script) == 0) {
+		return TCL_OK;
+	}
+
+	/* reuse a free slot, or add one */
+	for (i = PROP_BUILTIN_MAX - 1; i < mpvData->observedCount; ++i) {
+		if (mpvData->observed[i].name == NULL) {
+			obs = &mpvData->observed[i];
+			break;
+		}
+	}
+	if (obs == NULL) {
+		mpvData->observed = (mpvObserved_t *) ckrealloc ((char *) mpvData->observed,
+			sizeof (mpvObserved_t) * (size_t) (mpvData->observedCount + 1));
+		obs = &mpvData->observed[mpvData->observedCount++];
+		obs->dirty = 0;
+		obs->nextDirty = 0;
+	}
+	/* a reused slot may still be queued or held for the old property */
+	id = (uint64_t) (obs - mpvData->observed) + 1;
+	mpvObservedUnmark (mpvData, (int) id - 1);
+	obs->name = ckalloc (strlen (name) + 1);
+	strcpy (obs->name, name);
+	obs->format = MPV_FORMAT_NODE;
+	obs->script = script;
+	Tcl_IncrRefCount (obs->script);
+	obs->valid = 0;
+	obs->value = NULL;
+	mpvObservedInit (obs);
+	obs->mindelta = mindelta >= 0.0 ? mindelta : 0.0;
+	obs->maxrate = maxrate >= 0.0 ? maxrate : 0.0;
+
+	if (mpvData->inst != NULL) {
+		status = mpv_observe_property (mpvData->inst, id, obs->name, obs->format);
+		if (status < 0) {
+			snprintf (errmsg, sizeof(errmsg), "error observing property %s: %s",
+				name, mpv_error_string (status));
+			Tcl_AddErrorInfo (interp, errmsg);
+			/* free the slot again, its id is not registered with mpv */
+			Tcl_DecrRefCount (obs->script);
+			obs->script = NULL;
+			ckfree (obs->name);
+			obs->name = NULL;
+			return TCL_ERROR;
+		}
+	}
+	return TCL_OK;
+}
+
+int
+mpvOnCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	int			ev;
+
+	/********
+	Call with: ::tclmpv::on event ?script?
+	Without script the current script is returned, an empty script
+	removes the callback. Callbacks may be set before ::tclmpv::init
+	and remain registered when the player is closed.
+	********/
+	if (objc != 2 && objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "event ?script?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], cbEventNames, "event", 0, &ev) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (objc == 3) {
+		if (mpvData->callbacks[ev] != NULL) {
+			Tcl_DecrRefCount (mpvData->callbacks[ev]);
+			mpvData->callbacks[ev] = NULL;
+		}
+		if (Tcl_GetCharLength (objv[2]) > 0) {
+			mpvData->callbacks[ev] = objv[2];
+			Tcl_IncrRefCount (mpvData->callbacks[ev]);
+		}
+	}
+
+	if (mpvData->callbacks[ev] != NULL) {
+		Tcl_SetObjResult (interp, mpvData->callbacks[ev]);
+	}
+	return TCL_OK;
+}
+
+int
+mpvMediaCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+	int			status;
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	char		*fn;
+	struct stat	statinfo;
+	char		errmsg[256];
+	int			first;
+	int			async;
+	Tcl_Obj		*callback;
+	uint64_t	id;
+	mpv_node	result;
+
+	/*
+	* This function can only be used to load media files which can be found on the
+	* file system. No http streams etc.
+	* When the file does not exist the function returns an error.
+	* The rquested file is loaded and replaces the currently playing file. No other
+	* options can be passed, except -async ?-command script?.
+	*/
+
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (mpvAsyncOptions (interp, objc, objv, &first, &async, &callback) != TCL_OK ||
+			objc - first < 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-async? ?-command script? media");
+		return TCL_ERROR;
+	}
+	objc -= first - 1;
+	objv += first - 1;
+
+	fn = Tcl_GetString(objv[1]);
+    if (stat (fn, &statinfo) != 0) {
+		snprintf (errmsg, sizeof(errmsg), "mediafile %s does not exist", fn); 
+		Tcl_AddErrorInfo (interp, errmsg);
+		return  TCL_ERROR;
+    }
+
+	/* the audio device and speed are set ahead of the loadfile command */
+	if (mpvDirtyApply (mpvData, interp) < 0) {
+		return TCL_ERROR;
+	}
+
+      /* reset the duration and time */
+    PROPCACHE (mpvData, PROP_DURATION).cache.d = 0.0;
+    PROPCACHE (mpvData, PROP_TIME_POS).cache.d = 0.0;
+    ++mpvData->generation;
+    mpvCacheApply (mpvData, fn);
+    /* like many players, mpv will start playing when the 'loadfile'
+     * command is executed.
+     */
+    const char *cmd[] = {"loadfile", fn, "replace", NULL};
+	id = mpvAsyncRegister (mpvData, async, callback, NULL, "loadfile");
+    status = mpvCommand (mpvData, async, id, cmd, &result);
+	if (status) {
+		mpvAsyncCancel (mpvData, id);
+		Tcl_AddErrorInfo (interp, "error executing mpv loadfile command");
+		return TCL_ERROR;	
+	}
+	Tcl_SetObjResult (interp, mpvEntryIdObj (&result));
+
+	return TCL_OK;
+}
+
+int
+mpvLoadFileCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	int				rc;
+	int				status;
+	int				validflag;
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	char			*fn;
+	char			*arg2;
+	char			errmsg[256];
+	int				first;
+	int				async;
+	Tcl_Obj			*callback;
+	uint64_t		id;
+	mpv_node		result;
+
+	/********
+	Call with: ::tcl::tclmpv::loadfile ?-async? ?-command script? filename ?flags? ?options?
+	flags: replace | append | append-play
+	options: option1=foo,option2=bar
+	There must be no spaces in the options arguments
+	With -async the command returns immediately, the result of loadfile
+	is passed to the -command script.
+	********/
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (mpvAsyncOptions (interp, objc, objv, &first, &async, &callback) != TCL_OK ||
+			objc - first < 1 || objc - first > 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-async? ?-command script? URL ?flags? ?options?");
+		return TCL_ERROR;
+	}
+	/* from here on objv[1] is the URL */
+	objc -= first - 1;
+	objv += first - 1;
+
+	rc = TCL_OK;
+
+    fn = Tcl_GetString(objv[1]);
+	/*******
+	* There is no check whether this is a valid file name. Even if it
+	* does not exist the mpv loadfile command does not return an error
+	* but play state returns to stopped as result of end-of-file.
+	* This is not unlike the command line clients of mpv
+	*******/
+
+	/* the audio device and speed are set ahead of the loadfile command */
+	if (mpvDirtyApply (mpvData, interp) < 0) {
+		return TCL_ERROR;
+	}
+
+	validflag = 1;
+	status = 0;
+	id = mpvAsyncRegister (mpvData, async, callback, NULL, "loadfile");
+	// If the objc is 3 or 4, the 2nd argument can be a flag
+	if (objc > 2) {
+		arg2 = Tcl_GetString(objv[2]);
+		if (strcmp (arg2, "replace") &&
+			strcmp (arg2, "append") &&
+			strcmp (arg2, "append-play")) {
+		//None of the values did match, so we don't have a flag
+		validflag = 0;
+		}
+		// If objc is 3 and arg2 is not a valid flag it is an option
+		// if it is a valid flag then a flag was passed and not an option
+		// If objc is 4 arg2 must be a valid flag. If not it is an error
+		if (objc == 3) {
+			if (validflag) {
+				const char* cmd[] = {"loadfile", fn, arg2, NULL};
+				status = mpvCommand (mpvData, async, id, cmd, &result);
+			} else { 
+			/* Not a valid flag so it must be an option */
+				if (mpvData->loadfileIndex) {
+					const char* cmd[] = {"loadfile", fn, "replace", "-1", arg2, NULL};
+					status = mpvCommand (mpvData, async, id, cmd, &result);
+				} else {
+					const char* cmd[] = {"loadfile", fn, "replace",  arg2, NULL};
+					status = mpvCommand (mpvData, async, id, cmd, &result);
+				}
+			}
+		} else {
+			/* Number of parameters > 2, < 5 and not 3 so must be 4 */
+			if (validflag) {
+				if (mpvData->loadfileIndex) {
+					const char* cmd[] = {"loadfile", fn,  arg2, "-1", Tcl_GetString(objv[3]), NULL};
+					status = mpvCommand (mpvData, async, id, cmd, &result);
+				} else {
+					const char* cmd[] = {"loadfile", fn,  arg2, Tcl_GetString(objv[3]), NULL};
+					status = mpvCommand (mpvData, async, id, cmd, &result);
+				}
+			} else {
+				rc = TCL_ERROR;
+			}
+		}
+    } else {
+		/* no flags, no options */
+		const char* cmd[] = {"loadfile", fn, "replace", NULL};
+		status = mpvCommand (mpvData, async, id, cmd, &result);
+	} 
+
+
+
+	if (rc || status) {
+		mpvAsyncCancel (mpvData, id);
+	}
+	if (rc) {
+		Tcl_AddErrorInfo (interp, "invalid flag specified, must be \"replace\", \"append\" or \"append-play\"");
+		return rc;
+	}
+	if (status) {
+		snprintf (errmsg, sizeof(errmsg), "error loading file into mpv: %s", mpv_error_string(status)); 
+		Tcl_AddErrorInfo (interp, errmsg);
+		return TCL_ERROR;
+	}
+	(void)status;
+
+	/* reset the duration and time */
+	PROPCACHE (mpvData, PROP_DURATION).cache.d = 0.0;
+	PROPCACHE (mpvData, PROP_TIME_POS).cache.d = 0.0;
+	++mpvData->generation;
+	if (objc == 2 || ! validflag || strcmp (arg2, "replace") == 0) {
+		mpvCacheApply (mpvData, fn);
+	}
+
+	Tcl_SetObjResult (interp, mpvEntryIdObj (&result));
+	return TCL_OK;
+}
+
+int
+mpvPauseCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  int       status, ppause, result;
+  uint64_t  start;
+  struct timespec now;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+
+
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "");
+    return TCL_ERROR;
+  }
+
+  rc = TCL_OK;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    if (mpvData->state != PS_PLAYING && mpvData->state != PS_PAUSED) {
+      ;
+    } else if (mpvData->state ==  PS_PLAYING &&
+        mpvData->paused == 0) {
+      int val = 1;
+      /* the anchor moves to now while the state is still the old one */
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      mpvAnchorPosition (mpvData, mpvPrecisePosition (mpvData, &now), &now);
+      start = mpvStatsNow ();
+      status = mpv_set_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &val);
+      mpvStatsCommand (mpvData, "set ", "pause", start, status);
+      TRACE (mpvData, TL_V, TR_COMMAND, 0, status, val, 0.0, "pause");
+	  result = mpv_get_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &ppause);
+      mpvData->paused = 1;
+      mpvData->state = PS_PAUSED;
+    } else if (mpvData->state == PS_PAUSED &&
+        mpvData->paused == 1) {
+      int val = 0;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      mpvAnchorPosition (mpvData, mpvPrecisePosition (mpvData, &now), &now);
+      start = mpvStatsNow ();
+      status = mpv_set_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &val);
+      mpvStatsCommand (mpvData, "set ", "pause", start, status);
+      TRACE (mpvData, TL_V, TR_COMMAND, 0, status, val, 0.0, "pause");
+	  result = mpv_get_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &ppause);
+      mpvData->paused = 0;
+      mpvData->state = PS_PLAYING;
+    }
+  }
+  (void)result;
+  (void)status;
+  return rc;
+}
+
+int
+mpvPlayCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  int       status;
+  uint64_t  start;
+  struct timespec now;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+
+  if (objc != 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "");
+    return TCL_ERROR;
+  }
+
+  rc = TCL_OK;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    if (mpvData->state == PS_PAUSED &&
+        mpvData->paused == 1) {
+      int val = 0;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      mpvAnchorPosition (mpvData, mpvPrecisePosition (mpvData, &now), &now);
+      start = mpvStatsNow ();
+      status = mpv_set_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &val);
+      mpvStatsCommand (mpvData, "set ", "pause", start, status);
+      TRACE (mpvData, TL_V, TR_COMMAND, 0, status, val, 0.0, "pause");
+      mpvData->paused = 0;
+      mpvData->state = PS_PLAYING;
+    }
+  }
+  (void)status;
+  return rc;
+}
+
+/*
+* ::tclmpv::playlist list|move|remove|clear|next|prev
+* Thin wrappers around the mpv playlist commands. Entries are addressed
+* by their current index, which ::tclmpv::playlist list reports together
+* with the entry id returned by loadfile.
+*/
+int
+mpvPlaylistCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	int			sub;
+	int			status;
+	int			idx;
+	mpv_node	node;
+	char		errmsg[256];
+	static const char *subCmds[] = {
+		"clear", "list", "move", "next", "prev", "remove", NULL
+	};
+	enum { PL_CLEAR, PL_LIST, PL_MOVE, PL_NEXT, PL_PREV, PL_REMOVE };
+	static const int subArgs[] = { 0, 0, 2, 1, 1, 1 };
+
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "list|move|remove|clear|next|prev ?arg ...?");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObj (interp, objv[1], subCmds, "subcommand", 0, &sub) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	/* next and prev take an optional weak|force, the others exact arguments */
+	if (objc - 2 > subArgs[sub] ||
+			((sub != PL_NEXT && sub != PL_PREV) && objc - 2 != subArgs[sub])) {
+		switch (sub) {
+			case PL_MOVE: { Tcl_WrongNumArgs(interp, 2, objv, "index1 index2"); break; }
+			case PL_REMOVE: { Tcl_WrongNumArgs(interp, 2, objv, "index|current"); break; }
+			case PL_NEXT:
+			case PL_PREV: { Tcl_WrongNumArgs(interp, 2, objv, "?weak|force?"); break; }
+			default: { Tcl_WrongNumArgs(interp, 2, objv, ""); break; }
+		}
+		return TCL_ERROR;
+	}
+	/* indices are checked here, mpv only reports a generic error */
+	if (sub == PL_MOVE || (sub == PL_REMOVE && strcmp (Tcl_GetString (objv[2]), "current") != 0)) {
+		if (Tcl_GetIntFromObj (interp, objv[2], &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (sub == PL_MOVE && Tcl_GetIntFromObj (interp, objv[3], &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+	}
+
+	switch (sub) {
+		case PL_LIST: {
+			status = mpv_get_property (mpvData->inst, "playlist", MPV_FORMAT_NODE, &node);
+			if (status >= 0) {
+				Tcl_SetObjResult (interp, mpvNodeToObj (&node));
+				mpv_free_node_contents (&node);
+			}
+			break;
+		}
+		case PL_CLEAR: {
+			const char *cmd[] = { "playlist-clear", NULL };
+			status = mpvCommand (mpvData, 0, 0, cmd, NULL);
+			break;
+		}
+		case PL_MOVE: {
+			const char *cmd[] = { "playlist-move", Tcl_GetString (objv[2]),
+				Tcl_GetString (objv[3]), NULL };
+			status = mpvCommand (mpvData, 0, 0, cmd, NULL);
+			break;
+		}
+		case PL_REMOVE: {
+			const char *cmd[] = { "playlist-remove", Tcl_GetString (objv[2]), NULL };
+			status = mpvCommand (mpvData, 0, 0, cmd, NULL);
+			break;
+		}
+		default: {
+			const char *cmd[] = { sub == PL_NEXT ? "playlist-next" : "playlist-prev",
+				objc == 3 ? Tcl_GetString (objv[2]) : NULL, NULL };
+			status = mpvCommand (mpvData, 0, 0, cmd, NULL);
+			break;
+		}
+	}
+	if (status < 0) {
+		snprintf (errmsg, sizeof(errmsg), "error: playlist %s: %s",
+			subCmds[sub], mpv_error_string (status));
+		Tcl_AddErrorInfo (interp, errmsg);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+int
+mpvRateCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  int       status;
+  uint64_t  start;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+  double    rate;
+  double    d;
+  int       first;
+  int       async;
+  Tcl_Obj   *callback;
+  uint64_t  id;
+
+
+  if (mpvAsyncOptions (interp, objc, objv, &first, &async, &callback) != TCL_OK ||
+      objc - first > 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, "?-async? ?-command script? ?rate?");
+    return TCL_ERROR;
+  }
+  objc -= first - 1;
+  objv += first - 1;
+
+  rc = TCL_OK;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    if (objc == 2 && mpvData->state == PS_PLAYING) {
+      rc = Tcl_GetDoubleFromObj (interp, objv[1], &d);
+      if (rc == TCL_OK) {
+        rate = d;
+        mpvData->appliedSpeed = -1.0;
+        if (async) {
+          id = mpvAsyncRegister (mpvData, async, callback, "set ", "speed");
+          status = mpv_set_property_async (mpvData->inst, id, "speed", MPV_FORMAT_DOUBLE, &rate);
+          if (status < 0) {
+            mpvAsyncCancel (mpvData, id);
+          }
+          /* the property is not updated yet, report the requested rate */
+          Tcl_SetObjResult (interp, Tcl_NewDoubleObj (rate));
+          return TCL_OK;
+        }
+        start = mpvStatsNow ();
+        status = mpv_set_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &rate);
+        mpvStatsCommand (mpvData, "set ", "speed", start, status);
+        TRACE (mpvData, TL_V, TR_COMMAND, 0, status, 0, rate, "speed");
+      }
+    }
+
+    status = mpv_get_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &rate);
+    Tcl_SetObjResult (interp, Tcl_NewDoubleObj ((double) rate));
+  }
+  (void)status;
+  return rc;
+}
+
+int
+mpvSeekCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  //double    tm;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+  double    pos;
+  double    d;
+  char      spos [40];
+  int       first;
+  int       async;
+  Tcl_Obj   *callback;
+  uint64_t  id;
+
+	/*
+	TODO: Add support for flags as defined in mpv.io
+	*/
+	if (mpvAsyncOptions (interp, objc, objv, &first, &async, &callback) != TCL_OK ||
+			objc - first != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-async? ?-command script? position");
+		return TCL_ERROR;
+	}
+	objc -= first - 1;
+	objv += first - 1;
+
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (mpvData->state == PS_PLAYING) {
+		rc = Tcl_GetDoubleFromObj (interp, objv[1], &d);
+		if ( rc != TCL_OK) {
+			Tcl_AddErrorInfo (interp, "error: seek time in seconds must be a decimal number");	
+			return TCL_ERROR;
+		}
+		pos = (double) d;
+		sprintf (spos, "%.1f", pos);
+		const char *cmd[] = { "seek", spos, "absolute", NULL };
+		id = mpvAsyncRegister (mpvData, async, callback, NULL, "seek");
+		rc = mpvCommand (mpvData, async, id, cmd, NULL);
+		if (rc < 0) {
+			mpvAsyncCancel (mpvData, id);
+		}
+	}
+	/* The statement below was in the original code.
+	*	However it is useless because mpvData->tm is only
+	*	set after mpv raises an event AND the event is catched
+	*	in the event handler.
+		tm = mpvData->tm;
+		Tcl_SetObjResult (interp, Tcl_NewDoubleObj ((double) tm));
+	*/
+	return TCL_OK;
+}
+
+int
+mpvSetCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	mpv_node	node;
+	const char	*name;
+	int			status;
+	int			flag;
+	char		errmsg[256];
+	int			first;
+	int			async;
+	Tcl_Obj		*callback;
+	uint64_t	id;
+	uint64_t	start;
+	const char	*str;
+
+	/********
+	Call with: ::tclmpv::set ?-async? ?-command script? property value
+	Lists, dicts and numbers are passed to mpv as nodes of the
+	matching type, other values as strings which mpv parses.
+	********/
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (mpvAsyncOptions (interp, objc, objv, &first, &async, &callback) != TCL_OK ||
+			objc - first != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-async? ?-command script? property value");
+		return TCL_ERROR;
+	}
+	objc -= first - 1;
+	objv += first - 1;
+
+	name = Tcl_GetString (objv[1]);
+	if (strcmp (name, "speed") == 0 || strcmp (name, "audio-device") == 0) {
+		mpvDirtyReset (mpvData);
+	}
+	mpvObjToNode (objv[2], &node);
+	if (async) {
+		/* there is no second attempt for an asynchronous request, so
+		 * only real numbers and containers are sent as nodes */
+		id = mpvAsyncRegister (mpvData, async, callback, "set ", name);
+		if (node.format == MPV_FORMAT_DOUBLE || node.format == MPV_FORMAT_NODE_MAP ||
+				node.format == MPV_FORMAT_NODE_ARRAY) {
+			status = mpv_set_property_async (mpvData->inst, id, name, MPV_FORMAT_NODE, &node);
+		} else {
+			str = Tcl_GetString (objv[2]);
+			status = mpv_set_property_async (mpvData->inst, id, name, MPV_FORMAT_STRING, &str);
+		}
+		mpvFreeNode (&node);
+		if (status < 0) {
+			mpvAsyncCancel (mpvData, id);
+			snprintf (errmsg, sizeof(errmsg), "error setting property %s: %s",
+				name, mpv_error_string (status));
+			Tcl_AddErrorInfo (interp, errmsg);
+			return TCL_ERROR;
+		}
+		return TCL_OK;
+	}
+	start = mpvStatsNow ();
+	status = mpv_set_property (mpvData->inst, name, MPV_FORMAT_NODE, &node);
+	if (status == MPV_ERROR_PROPERTY_FORMAT && node.format == MPV_FORMAT_INT64 &&
+			(node.u.int64 == 0 || node.u.int64 == 1)) {
+		/* numeric values of flags arrive as integers */
+		flag = (int) node.u.int64;
+		mpvFreeNode (&node);
+		node.format = MPV_FORMAT_FLAG;
+		node.u.flag = flag;
+		status = mpv_set_property (mpvData->inst, name, MPV_FORMAT_NODE, &node);
+	}
+	if (status == MPV_ERROR_PROPERTY_FORMAT && node.format != MPV_FORMAT_STRING) {
+		/* let mpv parse the value, e.g. a number for a string property */
+		status = mpv_set_property_string (mpvData->inst, name, Tcl_GetString (objv[2]));
+	}
+	mpvFreeNode (&node);
+	mpvStatsCommand (mpvData, "set ", name, start, status);
+	if (status < 0) {
+		snprintf (errmsg, sizeof(errmsg), "error setting property %s: %s",
+			name, mpv_error_string (status));
+		Tcl_AddErrorInfo (interp, errmsg);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+int
+mpvStateCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int               rc;
+  playstate         plstate;
+  mpvData_t         *mpvData = (mpvData_t *) cd;
+
+  rc = TCL_OK;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    plstate = mpvData->state;
+    Tcl_SetObjResult (interp, mpvData->stateObjs[plstate]);
+  }
+  return rc;
+}
+
+int
+mpvStatusCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	mpvObserved_t	*obs;
+	Tcl_Obj			**fields;
+	Tcl_Obj			*result;
+	Tcl_Obj			*value;
+	unsigned int	mask;
+	int				fieldCount;
+	int				idx;
+	int				i;
+
+	/********
+	Call with: ::tclmpv::status ?fields?
+	Returns a dict of the cached player status, restricted to the
+	keys in the list fields. The generation is always included, it
+	changes whenever one of the values changes.
+	********/
+	RETURN_IF_NOT_INIT (mpvData->inst);
+
+	if (objc > 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?fields?");
+		return TCL_ERROR;
+	}
+	mask = (1u << SF_MAX) - 1;
+	if (objc == 2) {
+		if (Tcl_ListObjGetElements (interp, objv[1], &fieldCount, &fields) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		mask = 1u << SF_GENERATION;
+		for (i = 0; i < fieldCount; ++i) {
+			if (Tcl_GetIndexFromObj (interp, fields[i], statusFieldNames, "field", 0, &idx) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			mask |= 1u << idx;
+		}
+	}
+
+	result = Tcl_NewDictObj ();
+	for (i = 0; i < SF_MAX; ++i) {
+		if ((mask & (1u << i)) == 0) {
+			continue;
+		}
+		switch ((statusfield) i) {
+			case SF_STATE: {
+				value = mpvData->stateObjs[mpvData->state];
+				break;
+			}
+			case SF_PLAYING: {
+				/* the same as ::tclmpv::isplay */
+				value = Tcl_NewIntObj (mpvData->state == PS_OPENING ||
+					mpvData->state == PS_PLAYING || mpvData->state == PS_PAUSED);
+				break;
+			}
+			case SF_PAUSED: {
+				obs = &PROPCACHE (mpvData, PROP_PAUSE);
+				value = Tcl_NewIntObj (obs->valid && obs->cache.flag);
+				break;
+			}
+			case SF_TIME: {
+				value = Tcl_NewDoubleObj (PROPCACHE (mpvData, PROP_TIME_POS).cache.d);
+				break;
+			}
+			case SF_DURATION: {
+				value = Tcl_NewDoubleObj (PROPCACHE (mpvData, PROP_DURATION).cache.d);
+				break;
+			}
+			case SF_RATE: {
+				obs = &PROPCACHE (mpvData, PROP_SPEED);
+				value = Tcl_NewDoubleObj (obs->valid ? obs->cache.d : 1.0);
+				break;
+			}
+			case SF_FILENAME: {
+				value = mpvCachedObj (&PROPCACHE (mpvData, PROP_FILENAME));
+				break;
+			}
+			case SF_EOFREASON: {
+				value = Tcl_NewStringObj (mpv_efr_string (mpvData->end_file.reason), -1);
+				break;
+			}
+			case SF_EOFERROR: {
+				value = Tcl_NewStringObj (mpv_error_string (mpvData->end_file.error), -1);
+				break;
+			}
+			default: {
+				value = Tcl_NewWideIntObj (mpvData->generation);
+				break;
+			}
+		}
+		Tcl_DictObjPut (NULL, result, mpvData->statusKeys[i], value);
+	}
+	Tcl_SetObjResult (interp, result);
+	return TCL_OK;
+}
+
+/*
+* Writes the bound variables whose value differs from the one last
+* written. With dryrun only counts them. Returns the number of
+* variables which changed.
+*/
+int
+mpvBindWrite (
+	mpvData_t	*mpvData,
+	int			dryrun
+	)
+{
+	mpvBind_t		*bind = &mpvData->bind;
+	Tcl_Interp		*interp = mpvData->interp;
+	Tcl_InterpState	istate;
+	Tcl_Obj			*value;
+	double			position;
+	double			duration;
+	int				changed;
+	int				i;
+
+	position = PROPCACHE (mpvData, PROP_TIME_POS).cache.d;
+	duration = PROPCACHE (mpvData, PROP_DURATION).cache.d;
+	changed = 0;
+	for (i = 0; i < BV_MAX; ++i) {
+		if (bind->vars[i] == NULL) {
+			continue;
+		}
+		if (bind->written & (1u << i)) {
+			if ((i == BV_POSITION && position == bind->position) ||
+					(i == BV_STATE && mpvData->state == bind->state) ||
+					(i == BV_DURATION && duration == bind->duration)) {
+				continue;
+			}
+		}
+		++changed;
+		if (dryrun) {
+			continue;
+		}
+		switch ((bindvar) i) {
+			case BV_POSITION: {
+				bind->position = position;
+				value = Tcl_NewDoubleObj (position);
+				break;
+			}
+			case BV_STATE: {
+				bind->state = mpvData->state;
+				value = mpvData->stateObjs[mpvData->state];
+				break;
+			}
+			default: {
+				bind->duration = duration;
+				value = Tcl_NewDoubleObj (duration);
+				break;
+			}
+		}
+		bind->written |= 1u << i;
+		/* traces on the variable, e.g. of Tk widgets, run here */
+		Tcl_Preserve (interp);
+		istate = Tcl_SaveInterpState (interp, TCL_OK);
+		if (Tcl_ObjSetVar2 (interp, bind->vars[i], NULL, value,
+				TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+			Tcl_AddErrorInfo (interp, "\n    (tclmpv bound variable)");
+			Tcl_BackgroundError (interp);
+		}
+		Tcl_RestoreInterpState (interp, istate);
+		Tcl_Release (interp);
+	}
+	return changed;
+}
+
+/*
+* Called by the event handler: writes the changed variables, or
+* defers them to the end of the interval when the last write was
+* more recent.
+*/
+void
+mpvBindUpdate (
+	mpvData_t	*mpvData
+	)
+{
+	mpvBind_t	*bind = &mpvData->bind;
+	uint64_t	now;
+	uint64_t	due;
+
+	if (bind->timer != NULL) {
+		return;
+	}
+	now = mpvStatsNow ();
+	due = bind->lastWrite + (uint64_t) bind->interval * 1000000;
+	if (bind->lastWrite != 0 && now < due) {
+		if (mpvBindWrite (mpvData, 1) > 0) {
+			bind->timer = Tcl_CreateTimerHandler ((int) ((due - now) / 1000000) + 1,
+				mpvBindTimer, (ClientData) mpvData);
+		}
+		return;
+	}
+	if (mpvBindWrite (mpvData, 0) > 0) {
+		bind->lastWrite = now;
+	}
+}
+
+void
+mpvBindTimer (
+	ClientData	cd
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+
+	mpvData->bind.timer = NULL;
+	Tcl_Preserve (mpvData);
+	if (mpvData->inst != NULL && mpvBindWrite (mpvData, 0) > 0) {
+		mpvData->bind.lastWrite = mpvStatsNow ();
+	}
+	Tcl_Release (mpvData);
+}
+
+void
+mpvBindFree (
+	mpvData_t	*mpvData
+	)
+{
+	int			i;
+
+	if (mpvData->bind.timer != NULL) {
+		Tcl_DeleteTimerHandler (mpvData->bind.timer);
+		mpvData->bind.timer = NULL;
+	}
+	for (i = 0; i < BV_MAX; ++i) {
+		if (mpvData->bind.vars[i] != NULL) {
+			Tcl_DecrRefCount (mpvData->bind.vars[i]);
+			mpvData->bind.vars[i] = NULL;
+		}
+	}
+}
+
+int
+mpvBindCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	mpvBind_t		*bind = &mpvData->bind;
+	Tcl_Obj			*result;
+	int				interval;
+	int				idx;
+	int				i;
+
+	/********
+	Call with: ::tclmpv::bind ?-position varName? ?-state varName? ?-duration varName? ?-interval ms?
+	The event handler writes the global variables when the value
+	changes, at most once per interval. An empty varName removes the
+	binding. Returns the bindings and the interval.
+	********/
+	if (objc % 2 != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-position varName? ?-state varName? ?-duration varName? ?-interval ms?");
+		return TCL_ERROR;
+	}
+	/* check all arguments before anything is changed */
+	for (i = 1; i < objc; i += 2) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], bindOptionNames, "option", 0, &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (idx == BV_MAX) {
+			if (Tcl_GetIntFromObj (interp, objv[i+1], &interval) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			if (interval < 0) {
+				Tcl_AddErrorInfo (interp, "error: the interval must not be negative");
+				return TCL_ERROR;
+			}
+		}
+	}
+	for (i = 1; i < objc; i += 2) {
+		Tcl_GetIndexFromObj (NULL, objv[i], bindOptionNames, "option", 0, &idx);
+		if (idx == BV_MAX) {
+			Tcl_GetIntFromObj (NULL, objv[i+1], &bind->interval);
+			continue;
+		}
+		if (bind->vars[idx] != NULL) {
+			Tcl_DecrRefCount (bind->vars[idx]);
+			bind->vars[idx] = NULL;
+		}
+		/* a new variable is written with the next event */
+		bind->written &= ~(1u << idx);
+		if (Tcl_GetCharLength (objv[i+1]) > 0) {
+			bind->vars[idx] = objv[i+1];
+			Tcl_IncrRefCount (bind->vars[idx]);
+		}
+	}
+	if (objc > 1 && mpvData->inst != NULL) {
+		mpvBindUpdate (mpvData);
+	}
+
+	result = Tcl_NewListObj (0, NULL);
+	for (i = 0; i < BV_MAX; ++i) {
+		if (bind->vars[i] != NULL) {
+			Tcl_ListObjAppendElement (NULL, result, Tcl_NewStringObj (bindOptionNames[i], -1));
+			Tcl_ListObjAppendElement (NULL, result, bind->vars[i]);
+		}
+	}
+	Tcl_ListObjAppendElement (NULL, result, Tcl_NewStringObj (bindOptionNames[BV_MAX], -1));
+	Tcl_ListObjAppendElement (NULL, result, Tcl_NewIntObj (bind->interval));
+	Tcl_SetObjResult (interp, result);
+	return TCL_OK;
+}
+
+int
+mpvStopCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  int       status;
+  mpvData_t *mpvData = (mpvData_t *) cd;
+
+  rc = TCL_OK;
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    /* stop: stops playback and clears playlist */
+    /* difference: vlc's stop command does not clear the playlist */
+    const char *cmd[] = {"stop", NULL};
+    status = mpvCommand (mpvData, 0, 0, cmd, NULL);
+  }
+  (void)status;
+  return rc;
+}
+
+int
+mpvQuitCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+  int       status;
+  mpvData_t *mpvData = (mpvData_t *) cd;
 
   rc = TCL_OK;
   if (mpvData->inst == NULL) {
     rc = TCL_ERROR;
   } else {
-    if (mpvData->state != PS_PLAYING && mpvData->state != PS_PAUSED) {
-      ;
-    } else if (mpvData->state ==  PS_PLAYING &&
-        mpvData->paused == 0) {
-      int val = 1;
-      status = mpv_set_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &val);
-	  result = mpv_get_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &ppause);
-	  #if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "pause-%d:status:%d %s\n", val, status, mpv_error_string(status));
-        fprintf (mpvData->debugfh, "(pause) retrieved ppause:%d, error: %d %s\n", ppause, result, mpv_error_string(status));
-		fflush (mpvData->debugfh);
-      }
-	  #endif
-      mpvData->paused = 1;
-      mpvData->state = PS_PAUSED;
-    } else if (mpvData->state == PS_PAUSED &&
-        mpvData->paused == 1) {
-      int val = 0;
-      status = mpv_set_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &val);
-	  result = mpv_get_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &ppause);
-	#if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "unpause-%d:status:%d %s\n", val, status, mpv_error_string(status));
-        fprintf (mpvData->debugfh, "(unpause) retrieved ppause:%d, error: %d %s\n", ppause, result, mpv_error_string(status));
-		fflush (mpvData->debugfh);
+    /* quits the player */
+    const char *cmd[] = {"quit", 0,  NULL};
+    status = mpvCommand (mpvData, 0, 0, cmd, NULL);
+  }
+  (void)status;
+  return rc;
+}
+
+int
+mpvHaveAudioDevListCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int       rc;
+
+  rc = 1;
+  Tcl_SetObjResult (interp, Tcl_NewBooleanObj (rc));
+  return TCL_OK;
+}
+
+int
+mpvVersionCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+
+  Tcl_SetObjResult (interp, Tcl_NewStringObj (mpvData->version, -1));
+  return TCL_OK;
+}
+
+void
+mpvFreeArgv (
+	mpvData_t		*mpvData
+	)
+{
+	int				i;
+
+	if (mpvData->argv != NULL) {
+		for (i = 0; i < mpvData->argc; ++i) {
+			ckfree ((char *) mpvData->argv[i]);
+		}
+		ckfree ((char *) mpvData->argv);
+		mpvData->argv = NULL;
+	}
+	mpvData->argc = 0;
+}
+
+void
+mpvClose (
+	mpvData_t		 *mpvData
+	)
+{
+	/*
+	* Internal function, not to be exposed to TCL
+	*/
+	Tcl_HashEntry	*hPtr;
+	Tcl_HashSearch	search;
+
+	if (mpvData->inst != NULL) {
+		mpv_terminate_destroy (mpvData->inst);
+		mpvData->inst = NULL;
+	}
+	mpvData->trimHook = 0;
+	mpvWakeupClose (mpvData);
+	mpvObservedReset (mpvData);
+
+	/* replies to pending asynchronous requests will not arrive anymore */
+	for (hPtr = Tcl_FirstHashEntry (&mpvData->pending, &search); hPtr != NULL;
+			hPtr = Tcl_NextHashEntry (&search)) {
+		mpvAsyncFree ((mpvRequest_t *) Tcl_GetHashValue (hPtr));
+		Tcl_DeleteHashEntry (hPtr);
+	}
+
+	mpvFreeArgv (mpvData);
+
+	if (mpvData->device != NULL) {
+		free ((void *) mpvData->device);
+		mpvData->device = NULL;
+	}
+	mpvDirtyReset (mpvData);
+	mpvPathSet (mpvData, NULL);
+
+	mpvData->state = PS_STOPPED;
+	++mpvData->generation;
+
+	/* the pending write of the bound variables, with the stopped state */
+	if (mpvData->bind.timer != NULL) {
+		Tcl_DeleteTimerHandler (mpvData->bind.timer);
+		mpvData->bind.timer = NULL;
+	}
+	if (! Tcl_InterpDeleted (mpvData->interp)) {
+		mpvBindWrite (mpvData, 0);
+	}
+}
+
+/*
+* Frees a player which is closed already. Called through
+* Tcl_EventuallyFree, the player may still be in use by the
+* event handler or a command.
+*/
+void
+mpvDataFree (
+	char	*cd
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	int			i;
+
+	for (i = 0; i < CB_MAX; ++i) {
+		if (mpvData->callbacks[i] != NULL) {
+			Tcl_DecrRefCount (mpvData->callbacks[i]);
+			mpvData->callbacks[i] = NULL;
+		}
+	}
+	for (i = 0; i < mpvData->observedCount; ++i) {
+		if (mpvData->observed[i].script != NULL) {
+			Tcl_DecrRefCount (mpvData->observed[i].script);
+		}
+		if (mpvData->observed[i].value != NULL) {
+			Tcl_DecrRefCount (mpvData->observed[i].value);
+		}
+		if (mpvData->observed[i].name != NULL && i >= PROP_BUILTIN_MAX - 1) {
+			ckfree (mpvData->observed[i].name);
+		}
+	}
+	if (mpvData->observed != NULL) {
+		ckfree ((char *) mpvData->observed);
+	}
+	mpvTraceFree (mpvData);
+	mpvStatsFree (mpvData);
+	mpvBindFree (mpvData);
+	for (i = 0; i < playStateMapMax; ++i) {
+		Tcl_DecrRefCount (mpvData->stateObjs[playStateMap[i].state]);
+	}
+	for (i = 0; i < SF_MAX; ++i) {
+		Tcl_DecrRefCount (mpvData->statusKeys[i]);
+	}
+	Tcl_DeleteHashTable (&mpvData->pending);
+	ckfree (cd);
+}
+
+void
+mpvExitHandler (
+  void *cd
+  )
+{
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+
+  Tcl_DeleteTimerHandler (mpvData->timerToken);
+  mpvShareRemove (mpvData);
+  mpvClose (mpvData);
+  Tcl_EventuallyFree (cd, mpvDataFree);
+}
+
+int
+mpvReleaseCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+
+  Tcl_DeleteTimerHandler (mpvData->timerToken);
+  mpvClose (mpvData);
+  return TCL_OK;
+}
+
+int
+mpvInitCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  const optionMap_t *profile;
+  const char    *name;
+  const char    *value;
+  char          *nptr;
+  char          errmsg[256];
+  int           rc;
+  int           i;
+  int           errors;
+  int           gstatus;
+  int           status;
+  int           idx;
+  int           pidx;
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+  static const char *wakeupNames[] = { "timer", "fd", "event", NULL };
+
+	/*
+	* -wakeup event (the default with threads) and fd drain mpv events as
+	* soon as the wakeup callback fires, -wakeup timer polls every
+	* CHKTIMER ms as a fallback. -profile and the other -option value
+	* pairs are set with mpv_set_option_string before mpv_initialize.
+	*/
+	if (objc % 2 != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-wakeup timer|fd|event? ?-profile lowlatency|lowmem|stream? ?-option value ...?");
+		return TCL_ERROR;
+	}
+	idx = WAKEUP_DEFAULT;
+	profile = NULL;
+	for (i = 1; i < objc; i += 2) {
+		name = Tcl_GetString (objv[i]);
+		if (name[0] != '-' || name[1] == '\0') {
+			Tcl_WrongNumArgs(interp, 1, objv, "?-wakeup timer|fd|event? ?-profile lowlatency|lowmem|stream? ?-option value ...?");
+			return TCL_ERROR;
+		}
+		if (strcmp (name, "-wakeup") == 0) {
+			if (Tcl_GetIndexFromObj (interp, objv[i+1], wakeupNames, "wakeup mode", 0, &idx) != TCL_OK) {
+				return TCL_ERROR;
+			}
+		} else if (strcmp (name, "-profile") == 0) {
+			if (Tcl_GetIndexFromObj (interp, objv[i+1], profileNames, "profile", 0, &pidx) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			profile = profileOptionMaps[pidx];
+		}
+	}
+
+	/* the options of a running player are changed with ::tclmpv::set */
+	if (mpvData->inst != NULL) {
+		if (objc > 1) {
+			Tcl_AddErrorInfo (interp, "error: player already initialized; close first");
+			return TCL_ERROR;
+		}
+		return TCL_OK;
+	}
+	mpvData->wakeupMode = (wakeupmode) idx;
+
+  /* the mpv options as name value pairs, a repeated init replaces them */
+  mpvFreeArgv (mpvData);
+  mpvData->argv = (const char **) ckalloc (sizeof(const char *) * (size_t) objc);
+  for (i = 1; i < objc; i += 2) {
+    name = Tcl_GetString (objv[i]);
+    if (strcmp (name, "-wakeup") == 0 || strcmp (name, "-profile") == 0) {
+      continue;
+    }
+    nptr = (char *) ckalloc (strlen (name));
+    strcpy (nptr, name + 1);
+    mpvData->argv[mpvData->argc++] = nptr;
+    value = Tcl_GetString (objv[i+1]);
+    nptr = (char *) ckalloc (strlen (value) + 1);
+    strcpy (nptr, value);
+    mpvData->argv[mpvData->argc++] = nptr;
+  }
+  mpvData->argv[mpvData->argc] = NULL;
+
+  rc = TCL_ERROR;
+  gstatus = 0;
+
+  mpvData->inst = mpv_create ();
+  if (mpvData->inst != NULL) {
+		mpv_set_option_string (mpvData->inst, "volume", "100");
+		if (profile != NULL) {
+			for (i = 0; profile[i].name != NULL; ++i) {
+				/* options unknown to this mpv version are not needed */
+				mpv_set_option_string (mpvData->inst, profile[i].name, profile[i].value);
+			}
+		}
+		errors = 0;
+		for (i = 0; i < mpvData->argc; i += 2) {
+			status = mpv_set_option_string (mpvData->inst, mpvData->argv[i], mpvData->argv[i+1]);
+			TRACE (mpvData, TL_V, TR_COMMAND, 0, status, 0, 0.0, mpvData->argv[i]);
+			if (status < 0) {
+				snprintf (errmsg, sizeof(errmsg), "%serror: option %s=%s: %s",
+					errors > 0 ? "\n" : "", mpvData->argv[i], mpvData->argv[i+1],
+					mpv_error_string (status));
+				Tcl_AddErrorInfo (interp, errmsg);
+				++errors;
+			}
+		}
+		if (errors > 0) {
+			mpv_terminate_destroy (mpvData->inst);
+			mpvData->inst = NULL;
+			return TCL_ERROR;
+		}
+
+		status = mpv_initialize (mpvData->inst);
+		if (status < 0) { gstatus = status; }
+		TRACE (mpvData, TL_INFO, TR_COMMAND, 0, status, 0, 0.0, "initialize");
+		mpvTraceLogLevel (mpvData);
+		/* the built-in properties and those set with ::tclmpv::observe */
+		for (i = 0; i < mpvData->observedCount; ++i) {
+			if (mpvData->observed[i].name != NULL) {
+				mpvData->observed[i].valid = 0;
+				mpv_observe_property(mpvData->inst, (uint64_t) i + 1,
+					mpvData->observed[i].name, mpvData->observed[i].format);
+			}
+		}
+		if (mpvData->trimEnabled) {
+			mpvData->trimHook = mpv_hook_add (mpvData->inst, 0, "on_load", 0) >= 0;
+		}
+
+		/*
+		* From now on, it is expected that events be handled.
+		* The wakeup pipe must exist before the callback can fire.
+		* Call the eventhandler once to drain what is already queued,
+		* in timer mode this schedules the next periodic call.
+		*/
+		if (mpvData->wakeupMode == WAKEUP_FD && mpvWakeupOpen (mpvData) != 0) {
+			mpvData->wakeupMode = WAKEUP_TIMER;
+		}
+		mpv_set_wakeup_callback (mpvData->inst, &mpvCallbackHandler, mpvData);
+		if (mpvData->wakeupMode == WAKEUP_TIMER) {
+			__atomic_store_n (&mpvData->hasEvent, 1, __ATOMIC_RELEASE);
+			mpvTimerHandler (mpvData);
+		} else {
+			mpvEventHandler (mpvData);
+		}
+  }
+  if (mpvData->inst != NULL && gstatus == 0) {
+    rc = TCL_OK;
+  }
+  return rc;
+}
+
+int
+mpvAudioDevSetCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+  int           rc;
+  char          *dev;
+
+  if (objc != 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, "deviceid");
+    return TCL_ERROR;
+  }
+
+  rc = TCL_OK;
+
+  if (mpvData->inst == NULL) {
+    rc = TCL_ERROR;
+  } else {
+    dev = Tcl_GetString(objv[1]);
+    if (mpvData->device != NULL) {
+      free ((void *) mpvData->device);
+    }
+    mpvData->device = NULL;
+    if (strlen (dev) > 0) {
+      mpvData->device = strdup (dev);
+    }
+  }
+
+  return rc;
+}
+
+int
+mpvAudioDevListCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  mpvData_t     *mpvData = (mpvData_t *) cd;
+  Tcl_Obj       *lobj;
+  Tcl_Obj       *sobj;
+  mpv_node      anodes;
+  mpv_node_list *infolist;
+  mpv_node_list *nodelist;
+  char          *nmptr = NULL;
+  char          *descptr = NULL;
+
+  if (mpvData->inst == NULL) {
+    return TCL_ERROR;
+  }
+
+  if (mpv_get_property (mpvData->inst, "audio-device-list", MPV_FORMAT_NODE, &anodes) < 0) {
+    return TCL_ERROR;
+  }
+  if (anodes.format != MPV_FORMAT_NODE_ARRAY) {
+    mpv_free_node_contents (&anodes);
+    return TCL_ERROR;
+  }
+
+  lobj = Tcl_NewListObj (0, NULL);
+  nodelist = anodes.u.list;
+  for (int i = 0; i < nodelist->num; ++i) {
+    if (nodelist->values[i].format != MPV_FORMAT_NODE_MAP) {
+      continue;
+    }
+    /* a device without description must not get the previous one */
+    nmptr = NULL;
+    descptr = NULL;
+    infolist = nodelist->values[i].u.list;
+    for (int j = 0; j < infolist->num; ++j) {
+      if (strcmp (infolist->keys[j], "name") == 0) {
+        nmptr = infolist->values[j].u.string;
+      } else if (strcmp (infolist->keys[j], "description") == 0) {
+        descptr = infolist->values[j].u.string;
       }
-	#endif
-      mpvData->paused = 0;
-      mpvData->state = PS_PLAYING;
     }
+	if (nmptr != NULL) {
+		sobj = Tcl_NewStringObj (nmptr, -1);
+		Tcl_ListObjAppendElement (interp, lobj, sobj);
+	}
+	if (descptr != NULL) {
+		sobj = Tcl_NewStringObj (descptr, -1);
+		Tcl_ListObjAppendElement (interp, lobj, sobj);
+	}
   }
-  (void)result;
-  (void)status;
-  return rc;
+  mpv_free_node_contents (&anodes);
+  Tcl_SetObjResult (interp, lobj);
+  return TCL_OK;
+}
+
+mpvData_t *
+mpvDataAlloc (
+	Tcl_Interp	*interp
+	)
+{
+	mpvData_t		*mpvData;
+	unsigned int	ivers;
+	int				i;
+
+  mpvData = (mpvData_t *) ckalloc (sizeof (mpvData_t));
+  mpvData->interp = interp;
+  mpvData->inst = NULL;
+  mpvData->argv = NULL;
+  mpvData->state = PS_NONE;
+  mpvData->device = NULL;
+  mpvData->appliedDevice = NULL;
+  mpvData->appliedSpeed = -1.0;
+  mpvData->paused = 0;
+  mpvData->hasEvent = 0;
+  mpvData->eventQueued = 0;
+  mpvData->owner = Tcl_GetCurrentThread ();
+  mpvData->share = NULL;
+  mpvData->wakeupMode = WAKEUP_DEFAULT;
+  mpvData->wakeupFd[0] = -1;
+  mpvData->wakeupFd[1] = -1;
+  mpvData->timerToken = NULL;
+  mpvData->trace.enabled = 0;
+  mpvData->trace.level = TL_INFO;
+  mpvData->trace.ring = NULL;
+  mpvData->trace.head = 0;
+  mpvData->trace.tail = 0;
+  mpvData->trace.dropped = 0;
+  mpvData->trace.channel = NULL;
+  mpvData->trace.idleQueued = 0;
+  mpvData->end_file = (mpv_event_end_file) {.reason = 0, .error = 0};
+  for (i = 0; i < CB_MAX; ++i) {
+    mpvData->callbacks[i] = NULL;
+  }
+  mpvData->observedCount = PROP_BUILTIN_MAX - 1;
+  mpvData->observed = (mpvObserved_t *) ckalloc (sizeof (mpvObserved_t) * (size_t) mpvData->observedCount);
+  for (i = 0; i < mpvData->observedCount; ++i) {
+    mpvData->observed[i].name = (char *) builtinPropMap[i + 1].name;
+    mpvData->observed[i].format = builtinPropMap[i + 1].format;
+    mpvData->observed[i].script = NULL;
+    mpvData->observed[i].valid = 0;
+    mpvData->observed[i].cache.d = 0.0;
+    mpvData->observed[i].value = NULL;
+    mpvObservedInit (&mpvData->observed[i]);
+    mpvData->observed[i].dirty = 0;
+    mpvData->observed[i].nextDirty = 0;
+  }
+  mpvData->dirtyHead = 0;
+  mpvData->dirtyTail = 0;
+  mpvData->holdTimer = NULL;
+  mpvData->holdDue = 0;
+  mpvData->inHandler = 0;
+  mpvData->rewake = 0;
+  Tcl_InitHashTable (&mpvData->pending, TCL_ONE_WORD_KEYS);
+  memset (&mpvData->stats, 0, sizeof (mpvStats_t));
+  Tcl_InitHashTable (&mpvData->stats.commands, TCL_STRING_KEYS);
+  mpvData->nextReplyId = 0;
+  mpvData->journalSeq = 0;
+  mpvData->posAnchor = 0.0;
+  mpvData->eofCount = 0;
+  mpvData->cache = NULL;
+  mpvData->path = NULL;
+  mpvData->durationSeen = 0;
+  mpvData->gainEnabled = 0;
+  mpvData->gainTarget = -23.0;
+  mpvData->trimEnabled = 0;
+  mpvData->trimHook = 0;
+  for (i = 0; i < stateMapIdxMax; ++i) {
+    mpvData->stateMapIdx[i] = 0;
+  }
+  for (i = 0; i < stateMapMax; ++i) {
+    mpvData->stateMapIdx[stateMap[i].state] = i;
+  }
+  /* shared by all results, the objects stay in the thread of the player */
+  for (i = 0; i < playStateMapMax; ++i) {
+    mpvData->stateObjs[playStateMap[i].state] = Tcl_NewStringObj (playStateMap[i].name, -1);
+    Tcl_IncrRefCount (mpvData->stateObjs[playStateMap[i].state]);
+  }
+  for (i = 0; i < SF_MAX; ++i) {
+    mpvData->statusKeys[i] = Tcl_NewStringObj (statusFieldNames[i], -1);
+    Tcl_IncrRefCount (mpvData->statusKeys[i]);
+  }
+  mpvData->generation = 0;
+  memset (&mpvData->bind, 0, sizeof (mpvBind_t));
+  mpvData->bind.interval = BINDINTERVAL;
+
+  ivers = mpv_client_api_version();
+  sprintf (mpvData->version, "%d.%d", ivers >> 16, ivers & 0xFF);
+  /*******
+  * Since mpv version 0.38 there is a change in the argument list
+  * to call loadfile.
+  * A third argument (insertion index) was added before the option
+  * list. This breaks all calls to loadfile which uses the option
+  * list. When loadfile is called with an option list, a third argument
+  * "-1" must be added.
+  * This is a change in mpv, not in the mpv API, which remains the same.
+  * Only the contents of the string passed to mpv changes, not the command
+  * itself.
+  * With mpv version 0.38, API version 2.3 was released. So we check
+  * for API version 2.3 or later and add this third parameter.
+  * Format of version number in /usr/include/mpv/client.h
+  *******/
+  mpvData->loadfileIndex = ivers >= MPV_MAKE_VERSION (2, 3);
+  return mpvData;
+}
+
+/*
+* Command procedure of a player created with ::tclmpv::create.
+* The subcommands are the same as those of the ::tclmpv ensemble.
+*/
+int
+mpvInstanceCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+		return TCL_ERROR;
+	}
+	return mpvDispatch (mpvData, interp, objc - 1, objv + 1);
+}
+
+/*
+* Runs a subcommand of a player, objv[0] is the subcommand. Used by
+* the player commands and for the commands of proxies.
+*/
+int
+mpvDispatch (
+	mpvData_t	*mpvData,
+	Tcl_Interp	*interp,
+	int			objc,
+	Tcl_Obj		* const objv[]
+	)
+{
+	int			idx;
+	int			rc;
+
+	if (Tcl_GetIndexFromObjStruct (interp, objv[0], mpvCmdMap,
+			sizeof(EnsembleData), "subcommand", 0, &idx) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	Tcl_Preserve (mpvData);
+	rc = mpvCmdMap[idx].proc ((ClientData) mpvData, interp, objc, objv);
+	Tcl_Release (mpvData);
+	return rc;
+}
+
+void
+mpvInstanceDeleteProc (
+	ClientData cd
+	)
+{
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+
+	Tcl_DeleteTimerHandler (mpvData->timerToken);
+	mpvShareRemove (mpvData);
+	mpvClose (mpvData);
+	Tcl_EventuallyFree (cd, mpvDataFree);
+}
+
+int
+mpvCreateCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvPkgData_t	*pkgData = (mpvPkgData_t *) cd;
+	mpvData_t		*mpvData;
+	Tcl_CmdInfo		cmdInfo;
+	Tcl_Obj			*nameObj;
+	Tcl_Obj			**initv;
+	Tcl_Command		token;
+	int				first;
+	int				i;
+	int				rc;
+
+	/********
+	Call with: ::tclmpv::create ?-command name? ?init options?
+	Creates and initializes a player with its own mpv instance and
+	returns the name of its command. Options other than -command
+	are passed to the init subcommand.
+	********/
+	first = 1;
+	if (objc >= 3 && strcmp (Tcl_GetString (objv[1]), "-command") == 0) {
+		nameObj = objv[2];
+		first = 3;
+		if (Tcl_GetCommandInfo (interp, Tcl_GetString (nameObj), &cmdInfo)) {
+			Tcl_AddErrorInfo (interp, "error: command already exists");
+			return TCL_ERROR;
+		}
+		Tcl_IncrRefCount (nameObj);
+	} else {
+		nameObj = NULL;
+		do {
+			if (nameObj != NULL) {
+				Tcl_DecrRefCount (nameObj);
+			}
+			nameObj = Tcl_ObjPrintf ("player%d", ++pkgData->instanceCount);
+			Tcl_IncrRefCount (nameObj);
+		} while (Tcl_GetCommandInfo (interp, Tcl_GetString (nameObj), &cmdInfo));
+	}
+
+	mpvData = mpvDataAlloc (interp);
+	mpvData->cache = pkgData->cache;
+	token = Tcl_CreateObjCommand (interp, Tcl_GetString (nameObj),
+		mpvInstanceCmd, (ClientData) mpvData, mpvInstanceDeleteProc);
+	Tcl_DecrRefCount (nameObj);
+
+	/* the init subcommand sees its own name as objv[0] */
+	initv = (Tcl_Obj **) ckalloc (sizeof(Tcl_Obj *) * (size_t) (objc - first + 1));
+	initv[0] = Tcl_NewStringObj ("init", -1);
+	Tcl_IncrRefCount (initv[0]);
+	for (i = first; i < objc; ++i) {
+		initv[i - first + 1] = objv[i];
+	}
+	Tcl_Preserve (mpvData);
+	rc = mpvInitCmd (mpvData, interp, objc - first + 1, initv);
+	Tcl_Release (mpvData);
+	Tcl_DecrRefCount (initv[0]);
+	ckfree ((char *) initv);
+
+	if (rc != TCL_OK) {
+		Tcl_DeleteCommandFromToken (interp, token);
+		return rc;
+	}
+
+	Tcl_SetObjResult (interp, Tcl_NewStringObj (Tcl_GetCommandName (interp, token), -1));
+	return TCL_OK;
+}
+
+/*
+* Registry of the players shared with ::tclmpv::share. The table and
+* the subscriber lists are only used with shareMutex held.
+*/
+TCL_DECLARE_MUTEX(shareMutex)
+static Tcl_HashTable	shareTable;
+static int				shareTableInit = 0;
+/* per thread: mpvShareThreadExit is registered */
+static Tcl_ThreadDataKey	shareExitKey;
+
+/* shareMutex must be held */
+mpvShare_t *
+mpvShareFind (
+	const char	*name
+	)
+{
+	Tcl_HashEntry	*hPtr;
+
+	if (! shareTableInit) {
+		Tcl_InitHashTable (&shareTable, TCL_STRING_KEYS);
+		shareTableInit = 1;
+	}
+	hPtr = Tcl_FindHashEntry (&shareTable, name);
+	if (hPtr == NULL) {
+		return NULL;
+	}
+	return (mpvShare_t *) Tcl_GetHashValue (hPtr);
+}
+
+/* shareMutex must be held */
+static void
+mpvShareFree (
+	mpvShare_t	*share
+	)
+{
+	mpvSubscriber_t	*sub;
+	Tcl_HashEntry	*hPtr;
+
+	hPtr = Tcl_FindHashEntry (&shareTable, share->name);
+	if (hPtr != NULL) {
+		Tcl_DeleteHashEntry (hPtr);
+	}
+	while (share->subscribers != NULL) {
+		sub = share->subscribers;
+		share->subscribers = sub->next;
+		ckfree (sub->script);
+		ckfree ((char *) sub);
+	}
+	ckfree (share->name);
+	ckfree ((char *) share);
+}
+
+/* called by the owner thread when the player is deleted */
+void
+mpvShareRemove (
+	mpvData_t	*mpvData
+	)
+{
+	if (mpvData->share == NULL) {
+		return;
+	}
+	Tcl_MutexLock (&shareMutex);
+	mpvShareFree (mpvData->share);
+	mpvData->share = NULL;
+	Tcl_MutexUnlock (&shareMutex);
+}
+
+/*
+* Thread exit handler of the threads which shared a player: their
+* players are withdrawn and the commands still queued to the thread
+* are answered with an error, so no caller waits for a thread which
+* is gone.
+*/
+void
+mpvShareThreadExit (
+	ClientData	cd
+	)
+{
+	Tcl_ThreadId	self = Tcl_GetCurrentThread ();
+	Tcl_HashEntry	*hPtr;
+	Tcl_HashSearch	search;
+	mpvShare_t		*share;
+
+	Tcl_MutexLock (&shareMutex);
+	if (shareTableInit) {
+		for (hPtr = Tcl_FirstHashEntry (&shareTable, &search); hPtr != NULL;
+				hPtr = Tcl_NextHashEntry (&search)) {
+			share = (mpvShare_t *) Tcl_GetHashValue (hPtr);
+			if (share->owner == self) {
+				share->mpvData->share = NULL;
+				mpvShareFree (share);
+			}
+		}
+	}
+	Tcl_MutexUnlock (&shareMutex);
+	Tcl_DeleteEvents (mpvRemoteEventFilter, NULL);
+}
+
+/* shareMutex must be held */
+void
+mpvShareMask (
+	mpvShare_t	*share
+	)
+{
+	mpvSubscriber_t	*sub;
+	unsigned int	mask;
+
+	mask = 0;
+	for (sub = share->subscribers; sub != NULL; sub = sub->next) {
+		mask |= 1u << sub->ev;
+	}
+	__atomic_store_n (&share->mask, mask, __ATOMIC_RELEASE);
+}
+
+/*
+* Queues the event to the threads of the proxies with an on script for
+* it. The script and the details travel as strings in the event.
+*/
+void
+mpvShareNotify (
+	mpvData_t	*mpvData,
+	cbevent		ev,
+	Tcl_Obj		*details
+	)
+{
+	mpvSubscriber_t	*sub;
+	mpvNotifyEvent_t	*evPtr;
+	const char		*str;
+	size_t			slen;
+	size_t			dlen;
+
+	if ((__atomic_load_n (&mpvData->share->mask, __ATOMIC_ACQUIRE) & (1u << ev)) == 0) {
+		return;
+	}
+	str = Tcl_GetString (details);
+	dlen = strlen (str);
+	Tcl_MutexLock (&shareMutex);
+	for (sub = mpvData->share->subscribers; sub != NULL; sub = sub->next) {
+		if (sub->ev != ev) {
+			continue;
+		}
+		/* one block, events removed with Tcl_DeleteEvents are freed by Tcl */
+		slen = strlen (sub->script);
+		evPtr = (mpvNotifyEvent_t *) ckalloc (sizeof (mpvNotifyEvent_t) + slen + dlen + 2);
+		evPtr->header.proc = mpvNotifyEventProc;
+		evPtr->proxy = sub->proxy;
+		evPtr->script = (char *) (evPtr + 1);
+		memcpy (evPtr->script, sub->script, slen + 1);
+		evPtr->details = evPtr->script + slen + 1;
+		memcpy (evPtr->details, str, dlen + 1);
+		Tcl_ThreadQueueEvent (sub->proxy->thread, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+		Tcl_ThreadAlert (sub->proxy->thread);
+	}
+	Tcl_MutexUnlock (&shareMutex);
+}
+
+int
+mpvShareCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvData_t		*mpvData = (mpvData_t *) cd;
+	mpvShare_t		*share;
+	Tcl_HashEntry	*hPtr;
+	const char		*name;
+	int				*exitRegistered;
+	int				isNew;
+
+	/********
+	Call with: ::tclmpv::share ?name?
+	Makes the player available to other threads as name, see
+	::tclmpv::attach. An empty name withdraws it. Returns the name
+	the player is shared as.
+	********/
+	if (objc > 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?name?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 2) {
+		name = Tcl_GetString (objv[1]);
+		exitRegistered = (int *) Tcl_GetThreadData (&shareExitKey, sizeof (int));
+		if (*name != '\0' && ! *exitRegistered) {
+			Tcl_CreateThreadExitHandler (mpvShareThreadExit, NULL);
+			*exitRegistered = 1;
+		}
+		Tcl_MutexLock (&shareMutex);
+		share = mpvShareFind (name);
+		if (*name != '\0' && share != NULL && share != mpvData->share) {
+			Tcl_MutexUnlock (&shareMutex);
+			Tcl_AddErrorInfo (interp, "error: another player is shared with this name");
+			return TCL_ERROR;
+		}
+		if (mpvData->share != NULL && strcmp (mpvData->share->name, name) != 0) {
+			mpvShareFree (mpvData->share);
+			mpvData->share = NULL;
+		}
+		if (*name != '\0' && mpvData->share == NULL) {
+			share = (mpvShare_t *) ckalloc (sizeof (mpvShare_t));
+			share->name = ckalloc (strlen (name) + 1);
+			strcpy (share->name, name);
+			share->owner = mpvData->owner;
+			share->mpvData = mpvData;
+			share->mask = 0;
+			share->subscribers = NULL;
+			hPtr = Tcl_CreateHashEntry (&shareTable, name, &isNew);
+			Tcl_SetHashValue (hPtr, share);
+			mpvData->share = share;
+		}
+		Tcl_MutexUnlock (&shareMutex);
+	}
+
+	if (mpvData->share != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (mpvData->share->name, -1));
+	}
+	return TCL_OK;
+}
+
+void
+mpvRemoteCallRelease (
+	mpvRemoteCall_t	*call
+	)
+{
+	int			last;
+	int			i;
+
+	Tcl_MutexLock (&shareMutex);
+	last = --call->refCount == 0;
+	Tcl_MutexUnlock (&shareMutex);
+	if (! last) {
+		return;
+	}
+	for (i = 0; i < call->argc; ++i) {
+		ckfree (call->argv[i]);
+	}
+	ckfree ((char *) call->argv);
+	ckfree (call->name);
+	if (call->result != NULL) {
+		ckfree (call->result);
+	}
+	if (call->errorInfo != NULL) {
+		ckfree (call->errorInfo);
+	}
+	Tcl_ConditionFinalize (&call->done);
+	ckfree ((char *) call);
+}
+
+void
+mpvRemoteCallError (
+	mpvRemoteCall_t	*call
+	)
+{
+	const char	*str = "error: the player is not shared anymore";
+
+	call->code = TCL_ERROR;
+	call->errorInfo = ckalloc (strlen (str) + 1);
+	strcpy (call->errorInfo, str);
+}
+
+/* wakes up the caller and drops the reference of the queued event */
+void
+mpvRemoteCallFinish (
+	mpvRemoteCall_t	*call
+	)
+{
+	Tcl_MutexLock (&shareMutex);
+	call->finished = 1;
+	Tcl_ConditionNotify (&call->done);
+	Tcl_MutexUnlock (&shareMutex);
+	mpvRemoteCallRelease (call);
+}
+
+/*
+* Runs the command of a proxy in the owner thread, with the interp of
+* the player, and wakes up the waiting caller.
+*/
+int
+mpvRemoteEventProc (
+	Tcl_Event	*evPtr,
+	int			flags
+	)
+{
+	mpvRemoteCall_t	*call = ((mpvRemoteEvent_t *) evPtr)->call;
+	mpvShare_t		*share;
+	mpvData_t		*mpvData;
+	Tcl_Interp		*interp;
+	Tcl_InterpState	istate;
+	Tcl_Obj			**objv;
+	Tcl_Obj			*options;
+	Tcl_Obj			*key;
+	Tcl_Obj			*info;
+	const char		*str;
+	int				i;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+
+	Tcl_MutexLock (&shareMutex);
+	mpvData = NULL;
+	share = mpvShareFind (call->name);
+	if (! call->abandoned && share != NULL && share->owner == Tcl_GetCurrentThread ()) {
+		mpvData = share->mpvData;
+	}
+	Tcl_MutexUnlock (&shareMutex);
+
+	if (mpvData == NULL) {
+		mpvRemoteCallError (call);
+	} else {
+		interp = mpvData->interp;
+		objv = (Tcl_Obj **) ckalloc (sizeof (Tcl_Obj *) * (size_t) call->argc);
+		for (i = 0; i < call->argc; ++i) {
+			objv[i] = Tcl_NewStringObj (call->argv[i], -1);
+			Tcl_IncrRefCount (objv[i]);
+		}
+		Tcl_Preserve (interp);
+		istate = Tcl_SaveInterpState (interp, TCL_OK);
+		Tcl_ResetResult (interp);
+		call->code = mpvDispatch (mpvData, interp, call->argc, objv);
+		str = Tcl_GetStringResult (interp);
+		call->result = ckalloc (strlen (str) + 1);
+		strcpy (call->result, str);
+		if (call->code == TCL_ERROR) {
+			options = Tcl_GetReturnOptions (interp, call->code);
+			Tcl_IncrRefCount (options);
+			key = Tcl_NewStringObj ("-errorinfo", -1);
+			Tcl_IncrRefCount (key);
+			if (Tcl_DictObjGet (NULL, options, key, &info) == TCL_OK && info != NULL) {
+				str = Tcl_GetString (info);
+				call->errorInfo = ckalloc (strlen (str) + 1);
+				strcpy (call->errorInfo, str);
+			}
+			Tcl_DecrRefCount (key);
+			Tcl_DecrRefCount (options);
+		}
+		Tcl_RestoreInterpState (interp, istate);
+		Tcl_Release (interp);
+		for (i = 0; i < call->argc; ++i) {
+			Tcl_DecrRefCount (objv[i]);
+		}
+		ckfree ((char *) objv);
+	}
+
+	mpvRemoteCallFinish (call);
+	return 1;
+}
+
+/*
+* Removes the queued commands of proxies when the owner thread exits,
+* their callers get an error.
+*/
+int
+mpvRemoteEventFilter (
+	Tcl_Event	*evPtr,
+	ClientData	cd
+	)
+{
+	mpvRemoteCall_t	*call;
+
+	if (evPtr->proc != mpvRemoteEventProc) {
+		return 0;
+	}
+	call = ((mpvRemoteEvent_t *) evPtr)->call;
+	mpvRemoteCallError (call);
+	mpvRemoteCallFinish (call);
+	return 1;
+}
+
+/*
+* Sends a command of a proxy to the thread owning the player and waits
+* for its result, like thread::send. objv[0] is the subcommand.
+*/
+int
+mpvRemoteCall (
+	Tcl_Interp	*interp,
+	mpvProxy_t	*proxy,
+	int			objc,
+	Tcl_Obj		* const objv[]
+	)
+{
+	mpvShare_t			*share;
+	mpvData_t			*mpvData;
+	mpvRemoteCall_t		*call;
+	mpvRemoteEvent_t	*evPtr;
+	Tcl_ThreadId		owner;
+#ifdef TCL_THREADS
+	Tcl_Time			wait;
+#endif
+	int					rc;
+	int					i;
+
+	Tcl_MutexLock (&shareMutex);
+	share = mpvShareFind (proxy->name);
+	if (share == NULL) {
+		Tcl_MutexUnlock (&shareMutex);
+		Tcl_AddErrorInfo (interp, "error: the player is not shared anymore");
+		return TCL_ERROR;
+	}
+	owner = share->owner;
+	if (owner == Tcl_GetCurrentThread ()) {
+		/* queueing to the own thread would wait forever */
+		mpvData = share->mpvData;
+		Tcl_MutexUnlock (&shareMutex);
+		return mpvDispatch (mpvData, interp, objc, objv);
+	}
+
+	call = (mpvRemoteCall_t *) ckalloc (sizeof (mpvRemoteCall_t));
+	memset (call, 0, sizeof (mpvRemoteCall_t));
+	call->name = ckalloc (strlen (proxy->name) + 1);
+	strcpy (call->name, proxy->name);
+	call->argc = objc;
+	call->argv = (char **) ckalloc (sizeof (char *) * (size_t) objc);
+	for (i = 0; i < objc; ++i) {
+		call->argv[i] = ckalloc (strlen (Tcl_GetString (objv[i])) + 1);
+		strcpy (call->argv[i], Tcl_GetString (objv[i]));
+	}
+	call->refCount = 2;
+	evPtr = (mpvRemoteEvent_t *) ckalloc (sizeof (mpvRemoteEvent_t));
+	evPtr->header.proc = mpvRemoteEventProc;
+	evPtr->call = call;
+	Tcl_ThreadQueueEvent (owner, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert (owner);
+
+	/* a player deleted with the command still queued never answers */
+	while (! call->finished) {
+#ifdef TCL_THREADS
+		wait.sec = 1;
+		wait.usec = 0;
+		Tcl_ConditionWait (&call->done, &shareMutex, &wait);
+#endif
+		if (! call->finished && mpvShareFind (proxy->name) == NULL) {
+			call->abandoned = 1;
+			break;
+		}
+	}
+	Tcl_MutexUnlock (&shareMutex);
+
+	if (call->finished) {
+		rc = call->code;
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (call->result == NULL ? "" : call->result, -1));
+		/* the commands leave the message in errorInfo with an empty result */
+		if (rc == TCL_ERROR && call->errorInfo != NULL &&
+				(call->result == NULL || *call->result == '\0')) {
+			Tcl_AddErrorInfo (interp, call->errorInfo);
+		}
+	} else {
+		rc = TCL_ERROR;
+		Tcl_AddErrorInfo (interp, "error: the player is not shared anymore");
+	}
+	mpvRemoteCallRelease (call);
+	return rc;
+}
+
+/*
+* Runs an on script of a proxy in the thread of the proxy.
+*/
+int
+mpvNotifyEventProc (
+	Tcl_Event	*evPtr,
+	int			flags
+	)
+{
+	mpvNotifyEvent_t	*notify = (mpvNotifyEvent_t *) evPtr;
+	Tcl_Obj				*script;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+	script = Tcl_NewStringObj (notify->script, -1);
+	Tcl_IncrRefCount (script);
+	mpvInvokeScript (notify->proxy->interp, script,
+		Tcl_NewStringObj (notify->details, -1));
+	Tcl_DecrRefCount (script);
+	return 1;
+}
+
+int
+mpvNotifyEventFilter (
+	Tcl_Event	*evPtr,
+	ClientData	cd
+	)
+{
+	return evPtr->proc == mpvNotifyEventProc &&
+		((mpvNotifyEvent_t *) evPtr)->proxy == (mpvProxy_t *) cd;
+}
+
+/*
+* "proxy on event ?script?": the script runs in the thread of the
+* proxy, independent of the script of the player itself.
+*/
+int
+mpvProxyOn (
+	Tcl_Interp	*interp,
+	mpvProxy_t	*proxy,
+	int			objc,
+	Tcl_Obj		* const objv[]
+	)
+{
+	mpvShare_t		*share;
+	mpvSubscriber_t	*sub;
+	mpvSubscriber_t	**prev;
+	const char		*script;
+	int				ev;
+
+	if (objc != 2 && objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "event ?script?");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObj (interp, objv[1], cbEventNames, "event", 0, &ev) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	Tcl_MutexLock (&shareMutex);
+	share = mpvShareFind (proxy->name);
+	if (share == NULL) {
+		Tcl_MutexUnlock (&shareMutex);
+		Tcl_AddErrorInfo (interp, "error: the player is not shared anymore");
+		return TCL_ERROR;
+	}
+	for (prev = &share->subscribers; *prev != NULL; prev = &(*prev)->next) {
+		if ((*prev)->proxy == proxy && (*prev)->ev == (cbevent) ev) {
+			break;
+		}
+	}
+	if (objc == 3) {
+		if (*prev != NULL) {
+			sub = *prev;
+			*prev = sub->next;
+			ckfree (sub->script);
+			ckfree ((char *) sub);
+		}
+		script = Tcl_GetString (objv[2]);
+		if (*script != '\0') {
+			sub = (mpvSubscriber_t *) ckalloc (sizeof (mpvSubscriber_t));
+			sub->proxy = proxy;
+			sub->ev = (cbevent) ev;
+			sub->script = ckalloc (strlen (script) + 1);
+			strcpy (sub->script, script);
+			sub->next = share->subscribers;
+			share->subscribers = sub;
+			prev = &share->subscribers;
+		}
+		mpvShareMask (share);
+	}
+	if (*prev != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ((*prev)->script, -1));
+	}
+	Tcl_MutexUnlock (&shareMutex);
+	return TCL_OK;
+}
+
+int
+mpvProxyCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvProxy_t	*proxy = (mpvProxy_t *) cd;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+		return TCL_ERROR;
+	}
+	if (strcmp (Tcl_GetString (objv[1]), "on") == 0) {
+		return mpvProxyOn (interp, proxy, objc - 1, objv + 1);
+	}
+	return mpvRemoteCall (interp, proxy, objc - 1, objv + 1);
+}
+
+void
+mpvProxyDeleteProc (
+	ClientData cd
+	)
+{
+	mpvProxy_t		*proxy = (mpvProxy_t *) cd;
+	mpvShare_t		*share;
+	mpvSubscriber_t	*sub;
+	mpvSubscriber_t	**prev;
+
+	Tcl_MutexLock (&shareMutex);
+	share = mpvShareFind (proxy->name);
+	if (share != NULL) {
+		prev = &share->subscribers;
+		while (*prev != NULL) {
+			sub = *prev;
+			if (sub->proxy == proxy) {
+				*prev = sub->next;
+				ckfree (sub->script);
+				ckfree ((char *) sub);
+			} else {
+				prev = &sub->next;
+			}
+		}
+		mpvShareMask (share);
+	}
+	Tcl_MutexUnlock (&shareMutex);
+	/* events queued before the subscriptions were removed */
+	Tcl_DeleteEvents (mpvNotifyEventFilter, (ClientData) proxy);
+	ckfree (proxy->name);
+	ckfree ((char *) proxy);
+}
+
+int
+mpvAttachCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvProxy_t		*proxy;
+	Tcl_CmdInfo		cmdInfo;
+	Tcl_HashEntry	*hPtr;
+	Tcl_HashSearch	search;
+	Tcl_Obj			*list;
+	const char		*name;
+	const char		*cmdName;
+	int				found;
+
+	/********
+	Call with: ::tclmpv::attach ?name? ?command?
+	Creates the command command, by default name, in this interp,
+	which runs the subcommands of the player shared as name in the
+	thread owning the player. Without arguments returns the names of
+	the shared players.
+	********/
+	if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?name? ?command?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 1) {
+		list = Tcl_NewListObj (0, NULL);
+		Tcl_MutexLock (&shareMutex);
+		mpvShareFind ("");
+		for (hPtr = Tcl_FirstHashEntry (&shareTable, &search); hPtr != NULL;
+				hPtr = Tcl_NextHashEntry (&search)) {
+			Tcl_ListObjAppendElement (NULL, list,
+				Tcl_NewStringObj (Tcl_GetHashKey (&shareTable, hPtr), -1));
+		}
+		Tcl_MutexUnlock (&shareMutex);
+		Tcl_SetObjResult (interp, list);
+		return TCL_OK;
+	}
+
+	name = Tcl_GetString (objv[1]);
+	cmdName = Tcl_GetString (objv[objc - 1]);
+	Tcl_MutexLock (&shareMutex);
+	found = mpvShareFind (name) != NULL;
+	Tcl_MutexUnlock (&shareMutex);
+	if (! found) {
+		Tcl_AddErrorInfo (interp, "error: no player is shared with this name");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetCommandInfo (interp, cmdName, &cmdInfo)) {
+		Tcl_AddErrorInfo (interp, "error: command already exists");
+		return TCL_ERROR;
+	}
+
+	proxy = (mpvProxy_t *) ckalloc (sizeof (mpvProxy_t));
+	proxy->name = ckalloc (strlen (name) + 1);
+	strcpy (proxy->name, name);
+	proxy->interp = interp;
+	proxy->thread = Tcl_GetCurrentThread ();
+	proxy->token = Tcl_CreateObjCommand (interp, cmdName, mpvProxyCmd,
+		(ClientData) proxy, mpvProxyDeleteProc);
+	Tcl_SetObjResult (interp, Tcl_NewStringObj (Tcl_GetCommandName (interp, proxy->token), -1));
+	return TCL_OK;
+}
+
+/*
+* Worker thread of ::tclmpv::scan. Creates a headless mpv handle and
+* scans files claimed from the job until there are none left or the
+* job is cancelled.
+*/
+Tcl_ThreadCreateType
+mpvScanThread (
+	ClientData	cd
+	)
+{
+	scanJob_t		*job = (scanJob_t *) cd;
+	mpv_handle		*handle;
+	scanResult_t	res;
+	int				file;
+	int				queue;
+	int				i;
+	int				pcmfd[2] = { -1, -1 };
+	char			pcmfile[40];
+
+	const optionMap_t	*options;
+
+	options = job->kind == SCAN_LOUDNESS ? loudnessOptionMap :
+		job->kind == SCAN_CUE || job->kind == SCAN_PEAKS ? pcmOptionMap : scanOptionMap;
+	handle = mpv_create ();
+	if (handle != NULL && options == pcmOptionMap) {
+		/* mpv opens the write end again for each file */
+		if (pipe (pcmfd) != 0) {
+			mpv_terminate_destroy (handle);
+			handle = NULL;
+		} else {
+			fcntl (pcmfd[0], F_SETFL, O_NONBLOCK);
+			fcntl (pcmfd[0], F_SETFD, FD_CLOEXEC);
+			/* opening /dev/fd/N does not inherit the flag */
+			fcntl (pcmfd[1], F_SETFD, FD_CLOEXEC);
+			snprintf (pcmfile, sizeof(pcmfile), "/dev/fd/%d", pcmfd[1]);
+			mpv_set_option_string (handle, "ao-pcm-file", pcmfile);
+		}
+	}
+	if (handle != NULL) {
+		for (i = 0; options[i].name != NULL; ++i) {
+			/* options unknown to this mpv version are not needed */
+			mpv_set_option_string (handle, options[i].name, options[i].value);
+		}
+		if (job->kind == SCAN_PEAKS) {
+			mpv_set_option_string (handle, "audio-samplerate", PEAKRATESTR);
+		}
+		if (mpv_initialize (handle) < 0) {
+			mpv_terminate_destroy (handle);
+			handle = NULL;
+		}
+	}
+	if (handle != NULL && job->kind == SCAN_LOUDNESS) {
+		mpv_observe_property (handle, LOUDNESS_EOF, "eof-reached", MPV_FORMAT_FLAG);
+		mpv_observe_property (handle, LOUDNESS_PROGRESS, "time-pos", MPV_FORMAT_DOUBLE);
+	}
+
+	for (;;) {
+		Tcl_MutexLock (&job->lock);
+		file = -1;
+		if (! job->cancel && job->nextFile < job->fileCount) {
+			file = job->nextFile++;
+		}
+		Tcl_MutexUnlock (&job->lock);
+		if (file < 0) {
+			break;
+		}
+
+		if (job->kind == SCAN_LOUDNESS) {
+			mpvAnalyzeFile (handle, job->files[file], &res);
+		} else if (job->kind == SCAN_CUE) {
+			mpvCueFile (handle, pcmfd[0], job->files[file], &job->params, &res);
+		} else if (job->kind == SCAN_PEAKS) {
+			mpvPeaksFile (handle, pcmfd[0], job->files[file], &job->params, &res);
+		} else {
+			mpvScanFile (handle, job->files[file], &res);
+		}
+		res.file = file;
+
+		Tcl_MutexLock (&job->lock);
+		job->results[job->completed++] = res;
+		queue = job->script != NULL && ! job->eventQueued &&
+			job->completed - job->delivered >= SCANBATCH;
+		if (queue) {
+			job->eventQueued = 1;
+		}
+		Tcl_MutexUnlock (&job->lock);
+		if (queue) {
+			mpvScanQueueEvent (job);
+		}
+	}
+
+	if (handle != NULL) {
+		mpv_terminate_destroy (handle);
+	}
+	if (pcmfd[0] >= 0) {
+		close (pcmfd[0]);
+		close (pcmfd[1]);
+	}
+
+	/* the last worker delivers the remaining results */
+	Tcl_MutexLock (&job->lock);
+	job->running--;
+	queue = job->script != NULL && job->running == 0 && ! job->eventQueued;
+	if (queue) {
+		job->eventQueued = 1;
+	}
+	Tcl_MutexUnlock (&job->lock);
+	if (queue) {
+		mpvScanQueueEvent (job);
+	}
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+* Loads path paused into the worker handle and reads duration, tags,
+* codec and audio parameters once playback would start.
+*/
+void
+mpvScanFile (
+	mpv_handle		*handle,
+	const char		*path,
+	scanResult_t	*res
+	)
+{
+	mpv_event			*event;
+	mpv_event_end_file	*end_file;
+	int					ended;
+	const char			*cmd[] = { "loadfile", path, "replace", NULL };
+	const char			*stop[] = { "stop", NULL };
+
+	res->status = 0;
+	res->hasDuration = 0;
+	res->duration = 0.0;
+	res->codec = NULL;
+	res->metadata.format = MPV_FORMAT_NONE;
+	res->audioParams.format = MPV_FORMAT_NONE;
+	res->hasLoudness = 0;
+	res->hasCue = 0;
+	res->peaks = NULL;
+	res->peakSize = 0;
+
+	if (handle == NULL) {
+		res->status = MPV_ERROR_UNINITIALIZED;
+		return;
+	}
+	res->status = mpv_command (handle, cmd);
+	if (res->status < 0) {
+		return;
+	}
+
+	/* with pause set, playback-restart follows as soon as the audio
+	 * chain is set up, so audio-params is known by then */
+	ended = 0;
+	for (;;) {
+		event = mpv_wait_event (handle, SCANTIMEOUT);
+		if (event->event_id == MPV_EVENT_NONE) {
+			res->status = MPV_ERROR_LOADING_FAILED;
+			break;
+		}
+		if (event->event_id == MPV_EVENT_END_FILE) {
+			end_file = (mpv_event_end_file *) event->data;
+			res->status = end_file->error < 0 ? end_file->error : MPV_ERROR_NOTHING_TO_PLAY;
+			ended = 1;
+			break;
+		}
+		if (event->event_id == MPV_EVENT_PLAYBACK_RESTART) {
+			break;
+		}
+	}
+
+	if (res->status == 0) {
+		if (mpv_get_property (handle, "duration", MPV_FORMAT_DOUBLE, &res->duration) >= 0) {
+			res->hasDuration = 1;
+		}
+		if (mpv_get_property (handle, "audio-codec-name", MPV_FORMAT_STRING, &res->codec) < 0) {
+			res->codec = NULL;
+		}
+		if (mpv_get_property (handle, "metadata", MPV_FORMAT_NODE, &res->metadata) < 0) {
+			res->metadata.format = MPV_FORMAT_NONE;
+		}
+		if (mpv_get_property (handle, "audio-params", MPV_FORMAT_NODE, &res->audioParams) < 0) {
+			res->audioParams.format = MPV_FORMAT_NONE;
+		}
+	}
+
+	/* unload the file so its end-file is not taken for the next one */
+	if (! ended && mpv_command (handle, stop) >= 0) {
+		do {
+			event = mpv_wait_event (handle, SCANTIMEOUT);
+		} while (event->event_id != MPV_EVENT_END_FILE &&
+			event->event_id != MPV_EVENT_NONE);
+	}
+}
+
+/*
+* Decodes path untimed through the ebur128 filter of the worker handle.
+* With keep-open mpv stays at the end of the file, where the metadata
+* of the last frame holds the values for the whole file.
+*/
+void
+mpvAnalyzeFile (
+	mpv_handle		*handle,
+	const char		*path,
+	scanResult_t	*res
+	)
+{
+	mpv_event			*event;
+	mpv_event_end_file	*end_file;
+	mpv_event_property	*prop;
+	mpv_node			meta;
+	mpv_node			*value;
+	const char			*key;
+	double				d;
+	double				peak;
+	int					ended;
+	int					found;
+	int					i;
+	const char			*cmd[] = { "loadfile", path, "replace", NULL };
+	const char			*stop[] = { "stop", NULL };
+
+	res->status = 0;
+	res->hasDuration = 0;
+	res->duration = 0.0;
+	res->codec = NULL;
+	res->metadata.format = MPV_FORMAT_NONE;
+	res->audioParams.format = MPV_FORMAT_NONE;
+	res->hasLoudness = 0;
+	res->hasCue = 0;
+	res->peaks = NULL;
+	res->peakSize = 0;
+
+	if (handle == NULL) {
+		res->status = MPV_ERROR_UNINITIALIZED;
+		return;
+	}
+	res->status = mpv_command (handle, cmd);
+	if (res->status < 0) {
+		return;
+	}
+
+	/* time-pos changes while decoding, the timeout only catches a hang */
+	ended = 0;
+	for (;;) {
+		event = mpv_wait_event (handle, SCANTIMEOUT);
+		if (event->event_id == MPV_EVENT_NONE) {
+			res->status = MPV_ERROR_LOADING_FAILED;
+			break;
+		}
+		if (event->event_id == MPV_EVENT_END_FILE) {
+			end_file = (mpv_event_end_file *) event->data;
+			res->status = end_file->error < 0 ? end_file->error : MPV_ERROR_NOTHING_TO_PLAY;
+			ended = 1;
+			break;
+		}
+		if (event->event_id == MPV_EVENT_PROPERTY_CHANGE &&
+				event->reply_userdata == LOUDNESS_EOF) {
+			prop = (mpv_event_property *) event->data;
+			if (prop->format == MPV_FORMAT_FLAG && * (int *) prop->data) {
+				break;
+			}
+		}
+	}
+
+	if (res->status == 0) {
+		if (mpv_get_property (handle, "duration", MPV_FORMAT_DOUBLE, &res->duration) >= 0) {
+			res->hasDuration = 1;
+		}
+		if (mpv_get_property (handle, "af-metadata/" LOUDNESSLABEL, MPV_FORMAT_NODE, &meta) < 0) {
+			meta.format = MPV_FORMAT_NONE;
+		}
+		/* the values are strings: lavfi.r128.I, lavfi.r128.LRA and
+		 * lavfi.r128.true_peaks_chN for each channel, the peaks are
+		 * linear amplitudes */
+		found = 0;
+		peak = 0.0;
+		res->peak = 0.0;
+		if (meta.format == MPV_FORMAT_NODE_MAP) {
+			for (i = 0; i < meta.u.list->num; ++i) {
+				key = meta.u.list->keys[i];
+				value = &meta.u.list->values[i];
+				if (value->format != MPV_FORMAT_STRING) {
+					continue;
+				}
+				d = strtod (value->u.string, NULL);
+				if (strcmp (key, "lavfi.r128.I") == 0) {
+					res->loudness = d;
+					found |= 1;
+				} else if (strcmp (key, "lavfi.r128.LRA") == 0) {
+					res->range = d;
+					found |= 2;
+				} else if (strncmp (key, "lavfi.r128.true_peaks_ch", 24) == 0 &&
+						(! (found & 4) || d > peak)) {
+					peak = d;
+					found |= 4;
+				}
+			}
+			mpv_free_node_contents (&meta);
+		}
+		if (found & 4) {
+			res->peak = peak > 0.0 ? 20.0 * log10 (peak) : PEAKFLOOR;
+		}
+		if ((found & 3) == 3) {
+			res->hasLoudness = 1;
+		} else {
+			/* mpv or its libavfilter lacks ebur128 */
+			res->status = MPV_ERROR_UNSUPPORTED;
+		}
+	}
+
+	if (! ended && mpv_command (handle, stop) >= 0) {
+		do {
+			event = mpv_wait_event (handle, SCANTIMEOUT);
+		} while (event->event_id != MPV_EVENT_END_FILE &&
+			event->event_id != MPV_EVENT_NONE);
+	}
+}
+
+/*
+* Loads path into a worker handle with the pcm audio output and passes
+* the samples read from fd, the read end of the pipe named in
+* ao-pcm-file, to proc until the file has ended.
+* Returns 0 or an mpv error code.
+*/
+int
+mpvPcmDecode (
+	mpv_handle		*handle,
+	int				fd,
+	const char		*path,
+	pcmProc_t		*proc,
+	void			*cd
+	)
+{
+	mpv_event			*event;
+	mpv_event_end_file	*end_file;
+	struct pollfd		pfd;
+	Tcl_Time			now;
+	double				last;
+	ssize_t				rc;
+	size_t				have;
+	int					status;
+	int					ended;
+	int16_t				buff [4096];
+	const char			*cmd[] = { "loadfile", path, "replace", NULL };
+	const char			*stop[] = { "stop", NULL };
+
+	if (handle == NULL || fd < 0) {
+		return MPV_ERROR_UNINITIALIZED;
+	}
+	status = mpv_command (handle, cmd);
+	if (status < 0) {
+		return status;
+	}
+
+	/* the pipe is read while waiting for events, mpv blocks when it is full */
+	have = 0;
+	ended = 0;
+	Tcl_GetTime (&now);
+	last = (double) now.sec + (double) now.usec / 1000000.0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (! ended) {
+		poll (&pfd, 1, 50);
+		Tcl_GetTime (&now);
+		while ((rc = read (fd, (char *) buff + have, sizeof (buff) - have)) > 0) {
+			have += (size_t) rc;
+			proc (buff, have / sizeof (int16_t), cd);
+			/* an odd byte is kept for the next read */
+			if (have % sizeof (int16_t)) {
+				((char *) buff) [0] = ((char *) buff) [have - 1];
+			}
+			have %= sizeof (int16_t);
+			last = (double) now.sec + (double) now.usec / 1000000.0;
+		}
+		while ((event = mpv_wait_event (handle, 0.0))->event_id != MPV_EVENT_NONE) {
+			last = (double) now.sec + (double) now.usec / 1000000.0;
+			if (event->event_id == MPV_EVENT_END_FILE) {
+				end_file = (mpv_event_end_file *) event->data;
+				if (end_file->reason == MPV_END_FILE_REASON_ERROR) {
+					status = end_file->error < 0 ? end_file->error : MPV_ERROR_NOTHING_TO_PLAY;
+				}
+				ended = 1;
+				break;
+			}
+		}
+		if (! ended && (double) now.sec + (double) now.usec / 1000000.0 - last > SCANTIMEOUT) {
+			status = MPV_ERROR_LOADING_FAILED;
+			if (mpv_command (handle, stop) >= 0) {
+				do {
+					event = mpv_wait_event (handle, SCANTIMEOUT);
+				} while (event->event_id != MPV_EVENT_END_FILE &&
+					event->event_id != MPV_EVENT_NONE);
+			}
+			ended = 1;
+		}
+	}
+
+	/* the audio output is closed before the end of the file is reported */
+	while ((rc = read (fd, (char *) buff + have, sizeof (buff) - have)) > 0) {
+		have += (size_t) rc;
+		proc (buff, have / sizeof (int16_t), cd);
+		if (have % sizeof (int16_t)) {
+			((char *) buff) [0] = ((char *) buff) [have - 1];
+		}
+		have %= sizeof (int16_t);
+	}
+	return status;
+}
+
+/*
+* Feeds samples to the cue point scanner. A block of CUEBLOCK samples
+* is loud when its peak reaches the level.
+*/
+void
+mpvCueSamples (
+	const int16_t	*samples,
+	size_t			count,
+	void			*cd
+	)
+{
+	cueScan_t	*cue = (cueScan_t *) cd;
+	size_t		i;
+	int			v;
+
+	for (i = 0; i < count; ++i) {
+		v = samples[i] < 0 ? - (int) samples[i] : (int) samples[i];
+		if (v > cue->blockPeak) {
+			cue->blockPeak = v;
+		}
+		cue->count++;
+		if (++cue->blockFill < CUEBLOCK) {
+			continue;
+		}
+		if (cue->blockPeak >= cue->silence) {
+			if (cue->first < 0) {
+				cue->first = cue->blockStart;
+			}
+			cue->last = cue->count;
+		}
+		if (cue->blockPeak >= cue->segue) {
+			cue->segueEnd = cue->count;
+		}
+		cue->blockStart = cue->count;
+		cue->blockPeak = 0;
+		cue->blockFill = 0;
+	}
+}
+
+/*
+* Finds the cue points of path: cue-in at the start of the first block
+* above the silence level, cue-out at the end of the last one and the
+* segue point at the end of the last block above the segue level.
+*/
+void
+mpvCueFile (
+	mpv_handle			*handle,
+	int					fd,
+	const char			*path,
+	const scanParams_t	*params,
+	scanResult_t		*res
+	)
+{
+	cueScan_t	cue;
+
+	res->status = 0;
+	res->hasDuration = 0;
+	res->duration = 0.0;
+	res->codec = NULL;
+	res->metadata.format = MPV_FORMAT_NONE;
+	res->audioParams.format = MPV_FORMAT_NONE;
+	res->hasLoudness = 0;
+	res->hasCue = 0;
+	res->peaks = NULL;
+	res->peakSize = 0;
+
+	memset (&cue, 0, sizeof (cue));
+	cue.silence = (int) (32768.0 * pow (10.0, params->silence / 20.0));
+	cue.segue = (int) (32768.0 * pow (10.0, params->segue / 20.0));
+	cue.first = -1;
+	res->status = mpvPcmDecode (handle, fd, path, mpvCueSamples, &cue);
+	if (res->status < 0) {
+		return;
+	}
+	/* the last partial block */
+	if (cue.blockFill > 0) {
+		if (cue.blockPeak >= cue.silence) {
+			if (cue.first < 0) {
+				cue.first = cue.blockStart;
+			}
+			cue.last = cue.count;
+		}
+		if (cue.blockPeak >= cue.segue) {
+			cue.segueEnd = cue.count;
+		}
+	}
+	if (cue.count == 0) {
+		res->status = MPV_ERROR_NOTHING_TO_PLAY;
+		return;
+	}
+	res->hasDuration = 1;
+	res->duration = (double) cue.count / PCMRATE;
+	res->hasCue = 1;
+	if (cue.first < 0) {
+		/* silent file */
+		cue.first = 0;
+		cue.last = cue.count;
+	}
+	if (cue.segueEnd < cue.first) {
+		cue.segueEnd = cue.last;
+	}
+	res->cueIn = (double) cue.first / PCMRATE;
+	res->cueOut = (double) cue.last / PCMRATE;
+	res->segue = (double) cue.segueEnd / PCMRATE;
+}
+
+/*
+* Feeds samples to the peak overview: each pair holds the minimum and
+* the maximum of PEAKRATE / resolution samples.
+*/
+void
+mpvPeaksSamples (
+	const int16_t	*samples,
+	size_t			count,
+	void			*cd
+	)
+{
+	peakScan_t	*peak = (peakScan_t *) cd;
+	size_t		i;
+	int			v;
+
+	for (i = 0; i < count; ++i) {
+		v = samples[i];
+		if (v < peak->min) {
+			peak->min = v;
+		}
+		if (v > peak->max) {
+			peak->max = v;
+		}
+		if (++peak->count >= peak->next) {
+			mpvPeaksPush (peak);
+		}
+	}
+}
+
+void
+mpvPeaksPush (
+	peakScan_t	*peak
+	)
+{
+	if (peak->pairCount == peak->pairAlloc) {
+		peak->pairAlloc = peak->pairAlloc == 0 ? 1024 : peak->pairAlloc * 2;
+		peak->pairs = (int16_t *) ckrealloc ((char *) peak->pairs,
+			sizeof (int16_t) * 2 * (size_t) peak->pairAlloc);
+	}
+	peak->pairs[peak->pairCount * 2] = (int16_t) peak->min;
+	peak->pairs[peak->pairCount * 2 + 1] = (int16_t) peak->max;
+	peak->pairCount++;
+	peak->next = (peak->pairCount + 1) * PEAKRATE / peak->resolution;
+	peak->min = 32767;
+	peak->max = -32768;
+}
+
+/*
+* Makes the min/max peak overview of path, encoded as signed little
+* endian values of params->bits. With params->output the overview is
+* written to that file instead of being returned.
+*/
+void
+mpvPeaksFile (
+	mpv_handle			*handle,
+	int					fd,
+	const char			*path,
+	const scanParams_t	*params,
+	scanResult_t		*res
+	)
+{
+	peakScan_t		peak;
+	unsigned char	*p;
+	int64_t			i;
+	int				v;
+
+	res->status = 0;
+	res->hasDuration = 0;
+	res->duration = 0.0;
+	res->codec = NULL;
+	res->metadata.format = MPV_FORMAT_NONE;
+	res->audioParams.format = MPV_FORMAT_NONE;
+	res->hasLoudness = 0;
+	res->hasCue = 0;
+	res->peaks = NULL;
+	res->peakSize = 0;
+
+	memset (&peak, 0, sizeof (peak));
+	peak.resolution = params->resolution;
+	peak.next = PEAKRATE / peak.resolution;
+	peak.min = 32767;
+	peak.max = -32768;
+	res->status = mpvPcmDecode (handle, fd, path, mpvPeaksSamples, &peak);
+	if (res->status == 0 && peak.count == 0) {
+		res->status = MPV_ERROR_NOTHING_TO_PLAY;
+	}
+	if (res->status < 0) {
+		if (peak.pairs != NULL) {
+			ckfree ((char *) peak.pairs);
+		}
+		return;
+	}
+	/* the last partial pair */
+	if (peak.min <= peak.max) {
+		mpvPeaksPush (&peak);
+	}
+	res->hasDuration = 1;
+	res->duration = (double) peak.count / PEAKRATE;
+
+	res->peakSize = (int) (peak.pairCount * 2 * (params->bits / 8));
+	res->peaks = (unsigned char *) ckalloc ((size_t) res->peakSize + 1);
+	p = res->peaks;
+	for (i = 0; i < peak.pairCount * 2; ++i) {
+		v = peak.pairs[i];
+		if (params->bits == 8) {
+			*p++ = (unsigned char) (signed char) ((v + 32768) / 256 - 128);
+		} else {
+			*p++ = (unsigned char) (v & 0xFF);
+			*p++ = (unsigned char) ((v >> 8) & 0xFF);
+		}
+	}
+	if (peak.pairs != NULL) {
+		ckfree ((char *) peak.pairs);
+	}
+
+	if (params->output != NULL) {
+		if (mpvPeaksWrite (params->output, params, res) != 0) {
+			res->status = MPV_ERROR_GENERIC;
+		}
+		ckfree ((char *) res->peaks);
+		res->peaks = NULL;
+		res->peakSize = 0;
+	}
 }
 
+/*
+* Writes the peak overview of res to path as a TMPVPEAK file.
+* Returns 0 or -1 with errno set.
+*/
 int
-mpvPlayCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvPeaksWrite (
+	const char			*path,
+	const scanParams_t	*params,
+	scanResult_t		*res
+	)
 {
-  int       rc;
-  int       status;
-  mpvData_t *mpvData = (mpvData_t *) cd;
+	unsigned char	header [PEAKHEADERSIZE];
+	uint64_t		pairs;
+	uint32_t		fields [4];
+	FILE			*fh;
+	int				rc;
+	int				i;
+	int				j;
 
-  if (objc != 1) {
-    Tcl_WrongNumArgs(interp, 1, objv, "");
-    return TCL_ERROR;
-  }
+	memset (header, 0, sizeof (header));
+	memcpy (header, PEAKMAGIC, 8);
+	fields[0] = PEAKVERSION;
+	fields[1] = (uint32_t) params->bits;
+	fields[2] = (uint32_t) params->resolution;
+	fields[3] = PEAKRATE;
+	for (i = 0; i < 4; ++i) {
+		for (j = 0; j < 4; ++j) {
+			header[8 + i * 4 + j] = (unsigned char) (fields[i] >> (j * 8));
+		}
+	}
+	pairs = (uint64_t) res->peakSize / 2 / (uint64_t) (params->bits / 8);
+	for (j = 0; j < 8; ++j) {
+		header[24 + j] = (unsigned char) (pairs >> (j * 8));
+	}
 
-  rc = TCL_OK;
-  if (mpvData->inst == NULL) {
-#if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "error: mpvData->inst == NULL \n");
-		fflush (mpvData->debugfh);
-      }
-#endif
-    rc = TCL_ERROR;
-  } else {
-    if (mpvData->state == PS_PAUSED &&
-        mpvData->paused == 1) {
-      int val = 0;
-      status = mpv_set_property (mpvData->inst, "pause", MPV_FORMAT_FLAG, &val);
-#if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "play:status:%d %s\n", status, mpv_error_string(status));
-		fflush (mpvData->debugfh);
-      }
-#endif
-      mpvData->paused = 0;
-      mpvData->state = PS_PLAYING;
-    }
-  }
-  (void)status;
-  return rc;
+	fh = fopen (path, "wb");
+	if (fh == NULL) {
+		return -1;
+	}
+	rc = 0;
+	if (fwrite (header, 1, sizeof (header), fh) != sizeof (header) ||
+			fwrite (res->peaks, 1, (size_t) res->peakSize, fh) != (size_t) res->peakSize) {
+		rc = -1;
+	}
+	if (fclose (fh) != 0) {
+		rc = -1;
+	}
+	return rc;
+}
+
+/*
+* Converts a scan result to a dict and releases the mpv data it holds.
+*/
+Tcl_Obj *
+mpvScanResultObj (
+	scanJob_t		*job,
+	scanResult_t	*res
+	)
+{
+	Tcl_Obj		*dict;
+
+	dict = Tcl_NewDictObj ();
+	Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("file", -1),
+		Tcl_NewStringObj (job->files[res->file], -1));
+	Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("status", -1),
+		Tcl_NewStringObj (res->status < 0 ? "error" : "ok", -1));
+	Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("error", -1),
+		Tcl_NewStringObj (mpv_error_string (res->status), -1));
+	if (res->hasDuration) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("duration", -1),
+			Tcl_NewDoubleObj (res->duration));
+	}
+	if (res->codec != NULL) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("codec", -1),
+			Tcl_NewStringObj (res->codec, -1));
+		mpv_free (res->codec);
+		res->codec = NULL;
+	}
+	if (res->metadata.format != MPV_FORMAT_NONE) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("metadata", -1),
+			mpvNodeToObj (&res->metadata));
+		mpv_free_node_contents (&res->metadata);
+		res->metadata.format = MPV_FORMAT_NONE;
+	}
+	if (res->audioParams.format != MPV_FORMAT_NONE) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("audio-params", -1),
+			mpvNodeToObj (&res->audioParams));
+		mpv_free_node_contents (&res->audioParams);
+		res->audioParams.format = MPV_FORMAT_NONE;
+	}
+	if (res->hasLoudness) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("loudness", -1),
+			Tcl_NewDoubleObj (res->loudness));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("range", -1),
+			Tcl_NewDoubleObj (res->range));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("peak", -1),
+			Tcl_NewDoubleObj (res->peak));
+	}
+	if (res->hasCue) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("cuein", -1),
+			Tcl_NewDoubleObj (res->cueIn));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("cueout", -1),
+			Tcl_NewDoubleObj (res->cueOut));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("segue", -1),
+			Tcl_NewDoubleObj (res->segue));
+	}
+	if (job->kind == SCAN_PEAKS && res->status >= 0) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("resolution", -1),
+			Tcl_NewIntObj (job->params.resolution));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("bits", -1),
+			Tcl_NewIntObj (job->params.bits));
+		if (job->params.output != NULL) {
+			Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("output", -1),
+				Tcl_NewStringObj (job->params.output, -1));
+		}
+	}
+	if (res->peaks != NULL) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("peaks", -1),
+			Tcl_NewByteArrayObj (res->peaks, res->peakSize));
+		ckfree ((char *) res->peaks);
+		res->peaks = NULL;
+	}
+	return dict;
+}
+
+/*
+* Called from a worker thread: wakes up the Tcl thread that started
+* the job to deliver results.
+*/
+void
+mpvScanQueueEvent (
+	scanJob_t	*job
+	)
+{
+	scanEvent_t	*evPtr;
+
+	evPtr = (scanEvent_t *) ckalloc (sizeof (scanEvent_t));
+	evPtr->header.proc = mpvScanEventProc;
+	evPtr->job = job;
+	Tcl_ThreadQueueEvent (job->owner, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert (job->owner);
 }
 
+/*
+* Delivers the results completed since the last event to the -command
+* script. The job is released with the last delivery.
+*/
 int
-mpvRateCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvScanEventProc (
+	Tcl_Event	*evPtr,
+	int			flags
+	)
 {
-  int       rc;
-  int       status;
-  mpvData_t *mpvData = (mpvData_t *) cd;
-  double    rate;
-  double    d;
+	scanJob_t	*job = ((scanEvent_t *) evPtr)->job;
+	Tcl_Obj		*list;
+	Tcl_Obj		*result;
+	Tcl_Obj		*details;
+	int			first;
+	int			last;
+	int			done;
+	int			i;
 
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
 
-  if (objc != 1 && objc != 2) {
-    Tcl_WrongNumArgs(interp, 1, objv, "?rate?");
-    return TCL_ERROR;
-  }
+	Tcl_MutexLock (&job->lock);
+	first = job->delivered;
+	last = job->completed;
+	job->delivered = last;
+	job->eventQueued = 0;
+	done = job->running == 0;
+	if (Tcl_InterpDeleted (job->interp)) {
+		job->cancel = 1;
+	}
+	Tcl_MutexUnlock (&job->lock);
 
-  rc = TCL_OK;
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    if (objc == 2 && mpvData->state == PS_PLAYING) {
-      rc = Tcl_GetDoubleFromObj (interp, objv[1], &d);
-      if (rc == TCL_OK) {
-        rate = d;
-        status = mpv_set_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &rate);
-#if MPVDEBUG
-        if (mpvData->debugfh != NULL) {
-          fprintf (mpvData->debugfh, "speed-%.2f:status:%d %s\n", rate, status, mpv_error_string(status));
-        }
-#endif
-      }
-    }
+	/* cached results go with the first delivery */
+	list = job->cached;
+	job->cached = Tcl_NewListObj (0, NULL);
+	Tcl_IncrRefCount (job->cached);
+	for (i = first; i < last; ++i) {
+		result = mpvScanResultObj (job, &job->results[i]);
+		mpvCacheScanResult (job->cache, result);
+		Tcl_ListObjAppendElement (NULL, list, result);
+	}
+	if (! Tcl_InterpDeleted (job->interp)) {
+		details = Tcl_NewDictObj ();
+		Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("event", -1),
+			Tcl_NewStringObj (job->kind == SCAN_METADATA ? "scan" :
+				job->kind == SCAN_PEAKS ? "peaks" : "analyze", -1));
+		Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("results", -1), list);
+		Tcl_DictObjPut (NULL, details, Tcl_NewStringObj ("done", -1),
+			Tcl_NewBooleanObj (done));
+		mpvInvokeScript (job->interp, job->script, details);
+	}
+	Tcl_DecrRefCount (list);
 
-    status = mpv_get_property (mpvData->inst, "speed", MPV_FORMAT_DOUBLE, &rate);
-#if MPVDEBUG
-    if (mpvData->debugfh != NULL) {
-      fprintf (mpvData->debugfh, "speed-get:status:%d %s\n", status, mpv_error_string(status));
-    }
-#endif
-    Tcl_SetObjResult (interp, Tcl_NewDoubleObj ((double) rate));
-  }
-  (void)status;
-  return rc;
+	if (done) {
+		for (i = 0; i < job->threadCount; ++i) {
+			Tcl_JoinThread (job->threads[i], NULL);
+		}
+		mpvScanJobFree (job);
+	}
+	return 1;
+}
+
+void
+mpvScanJobFree (
+	scanJob_t	*job
+	)
+{
+	int		i;
+
+	for (i = 0; i < job->fileCount; ++i) {
+		ckfree (job->files[i]);
+	}
+	ckfree ((char *) job->files);
+	ckfree ((char *) job->results);
+	ckfree ((char *) job->threads);
+	if (job->params.output != NULL) {
+		ckfree (job->params.output);
+	}
+	Tcl_DecrRefCount (job->cached);
+	Tcl_MutexFinalize (&job->lock);
+	if (job->script != NULL) {
+		Tcl_DecrRefCount (job->script);
+		Tcl_Release (job->interp);
+	}
+	ckfree ((char *) job);
+}
+
+/*
+* Parses ?-threads n? ?-command script? of scan and analyze. With params
+* the levels of analyze cue are accepted as well.
+*/
+int
+mpvScanOptions (
+	Tcl_Interp		*interp,
+	int				objc,
+	Tcl_Obj * const	objv[],
+	int				*threads,
+	Tcl_Obj			**script,
+	scanParams_t	*params
+	)
+{
+	int			opt;
+	int			i;
+	static const char *scanOpts[] = { "-command", "-threads", NULL };
+	static const char *cueOpts[] = { "-command", "-threads", "-segue", "-silence", NULL };
+
+	*threads = SCANTHREADS;
+	*script = NULL;
+	for (i = 0; i < objc; i += 2) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], params != NULL ? cueOpts : scanOpts,
+				"option", 0, &opt) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (opt == 0) {
+			*script = objv[i + 1];
+		} else if (opt == 1) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], threads) != TCL_OK) {
+				return TCL_ERROR;
+			}
+		} else if (Tcl_GetDoubleFromObj (interp, objv[i + 1],
+				opt == 2 ? &params->segue : &params->silence) != TCL_OK) {
+			return TCL_ERROR;
+		}
+	}
+	if (*threads < 1 || *threads > SCANMAXTHREADS) {
+		Tcl_AddErrorInfo (interp, "error: number of threads must be 1 - 64");
+		return TCL_ERROR;
+	}
+	if (*script != NULL && Tcl_GetCharLength (*script) == 0) {
+		*script = NULL;
+	}
+	return TCL_OK;
+}
+
+/*
+* Starts a pool of worker threads on the list files. Files with the
+* wanted values in the cache are not processed again. Without script
+* the workers are joined and the list of results is returned.
+*/
+int
+mpvScanStart (
+	Tcl_Interp	*interp,
+	mpvCache_t	*cache,
+	scankind	kind,
+	const scanParams_t	*params,
+	Tcl_Obj		*files,
+	int			threads,
+	Tcl_Obj		*script
+	)
+{
+	scanJob_t	*job;
+	cacheRecord_t	*rec;
+	struct stat	statinfo;
+	Tcl_Obj		**elems;
+	Tcl_Obj		*list;
+	Tcl_Obj		*result;
+	const char	*path;
+	uint32_t	wanted;
+	int			count;
+	int			started;
+	int			queue;
+	int			i;
+
+	if (Tcl_ListObjGetElements (interp, files, &count, &elems) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	if (count == 0) {
+		return TCL_OK;
+	}
+	/* peak overviews are not cached, their files are always scanned */
+	wanted = kind == SCAN_LOUDNESS ? CACHE_LOUDNESS :
+		kind == SCAN_CUE ? CACHE_CUE :
+		kind == SCAN_PEAKS ? 0 : CACHE_DURATION;
+
+	job = (scanJob_t *) ckalloc (sizeof (scanJob_t));
+	memset (job, 0, sizeof (scanJob_t));
+	job->kind = kind;
+	if (params != NULL) {
+		job->params = *params;
+		if (params->output != NULL) {
+			job->params.output = ckalloc (strlen (params->output) + 1);
+			strcpy (job->params.output, params->output);
+		}
+	}
+	job->interp = interp;
+	job->cache = cache;
+	job->owner = Tcl_GetCurrentThread ();
+	job->cached = Tcl_NewListObj (0, NULL);
+	Tcl_IncrRefCount (job->cached);
+	job->files = (char **) ckalloc (sizeof (char *) * (size_t) count);
+	for (i = 0; i < count; ++i) {
+		path = Tcl_GetString (elems[i]);
+		/* files with valid cached values are not scanned again */
+		if (wanted != 0 && stat (path, &statinfo) == 0 &&
+				(rec = mpvCacheLookup (job->cache, path, &statinfo)) != NULL &&
+				(rec->flags & wanted)) {
+			result = mpvCacheRecordObj (job->cache, rec);
+			Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("file", -1), elems[i]);
+			Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("status", -1),
+				Tcl_NewStringObj ("ok", -1));
+			Tcl_DictObjPut (NULL, result, Tcl_NewStringObj ("error", -1),
+				Tcl_NewStringObj (mpv_error_string (0), -1));
+			Tcl_ListObjAppendElement (NULL, job->cached, result);
+			continue;
+		}
+		job->files[job->fileCount] = ckalloc (strlen (path) + 1);
+		strcpy (job->files[job->fileCount], path);
+		job->fileCount++;
+	}
+	if (threads > job->fileCount) {
+		threads = job->fileCount;
+	}
+	job->results = (scanResult_t *) ckalloc (sizeof (scanResult_t) * (size_t) (job->fileCount + 1));
+	job->threads = (Tcl_ThreadId *) ckalloc (sizeof (Tcl_ThreadId) * (size_t) (threads + 1));
+	if (script != NULL) {
+		job->script = script;
+		Tcl_IncrRefCount (job->script);
+		Tcl_Preserve (job->interp);
+	}
+
+	job->running = threads;
+	for (started = 0; started < threads; ++started) {
+		if (Tcl_CreateThread (&job->threads[started], mpvScanThread, (ClientData) job,
+				TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+			break;
+		}
+	}
+	job->threadCount = started;
+	if (started == 0 && threads > 0) {
+		mpvScanJobFree (job);
+		Tcl_AddErrorInfo (interp, "error: cannot create scanner threads");
+		return TCL_ERROR;
+	}
+	if (started < threads || threads == 0) {
+		/* continue with the workers that were started, if all files
+		 * were cached there are none and the results are delivered now */
+		Tcl_MutexLock (&job->lock);
+		job->running -= threads - started;
+		queue = job->script != NULL && job->running == 0 && ! job->eventQueued;
+		if (queue) {
+			job->eventQueued = 1;
+		}
+		Tcl_MutexUnlock (&job->lock);
+		if (queue) {
+			mpvScanQueueEvent (job);
+		}
+	}
+
+	if (job->script != NULL) {
+		return TCL_OK;
+	}
+
+	for (i = 0; i < job->threadCount; ++i) {
+		Tcl_JoinThread (job->threads[i], NULL);
+	}
+	list = Tcl_DuplicateObj (job->cached);
+	for (i = 0; i < job->completed; ++i) {
+		result = mpvScanResultObj (job, &job->results[i]);
+		mpvCacheScanResult (job->cache, result);
+		Tcl_ListObjAppendElement (NULL, list, result);
+	}
+	mpvScanJobFree (job);
+	Tcl_SetObjResult (interp, list);
+	return TCL_OK;
+}
+
+/*
+* ::tclmpv::scan files ?-threads n? ?-command script?
+* Reads duration, tags, codec and audio parameters of files with a pool
+* of headless mpv handles. Without -command the scan waits for all files
+* and returns a list of dicts. With -command the results are passed to
+* script in batches while the event loop runs.
+*/
+int
+mpvScanCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvPkgData_t	*pkgData = (mpvPkgData_t *) cd;
+	Tcl_Obj		*script;
+	int			threads;
+
+	if (objc < 2 || (objc % 2) != 0) {
+		Tcl_WrongNumArgs(interp, 1, objv, "files ?-threads n? ?-command script?");
+		return TCL_ERROR;
+	}
+	if (mpvScanOptions (interp, objc - 2, objv + 2, &threads, &script, NULL) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	return mpvScanStart (interp, pkgData->cache, SCAN_METADATA, NULL, objv[1], threads, script);
+}
+
+/*
+* ::tclmpv::peaks file ?-resolution n? ?-bits 8|16? ?-output path? ?-command script?
+* Returns the min/max peak overview of file as a byte array, or writes
+* it to a TMPVPEAK file. With -command the overview is made in the
+* background and passed to script.
+*/
+int
+mpvPeaksCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
+{
+	mpvPkgData_t	*pkgData = (mpvPkgData_t *) cd;
+	scanParams_t	params;
+	Tcl_Obj		*script;
+	Tcl_Obj		*files;
+	Tcl_Obj		*result;
+	Tcl_Obj		*value;
+	char		errmsg[256];
+	int			opt;
+	int			rc;
+	int			i;
+	static const char *peakOpts[] = { "-bits", "-command", "-output", "-resolution", NULL };
+	enum { PO_BITS, PO_COMMAND, PO_OUTPUT, PO_RESOLUTION };
+
+	if (objc < 2 || (objc % 2) != 0) {
+		Tcl_WrongNumArgs(interp, 1, objv,
+			"file ?-resolution n? ?-bits 8|16? ?-output path? ?-command script?");
+		return TCL_ERROR;
+	}
+	memset (&params, 0, sizeof (params));
+	params.resolution = PEAKRESOLUTION;
+	params.bits = 16;
+	script = NULL;
+	for (i = 2; i < objc; i += 2) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], peakOpts, "option", 0, &opt) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (opt == PO_BITS) {
+			if (Tcl_GetIntFromObj (interp, objv[i + 1], &params.bits) != TCL_OK) {
+				return TCL_ERROR;
+			}
+		} else if (opt == PO_COMMAND) {
+			script = Tcl_GetCharLength (objv[i + 1]) > 0 ? objv[i + 1] : NULL;
+		} else if (opt == PO_OUTPUT) {
+			params.output = Tcl_GetString (objv[i + 1]);
+		} else if (Tcl_GetIntFromObj (interp, objv[i + 1], &params.resolution) != TCL_OK) {
+			return TCL_ERROR;
+		}
+	}
+	if (params.bits != 8 && params.bits != 16) {
+		Tcl_AddErrorInfo (interp, "error: bits must be 8 or 16");
+		return TCL_ERROR;
+	}
+	if (params.resolution < 1 || params.resolution > PEAKMAXRESOLUTION) {
+		Tcl_AddErrorInfo (interp, "error: resolution must be 1 - 1000");
+		return TCL_ERROR;
+	}
+
+	files = Tcl_NewListObj (1, &objv[1]);
+	Tcl_IncrRefCount (files);
+	rc = mpvScanStart (interp, pkgData->cache, SCAN_PEAKS, &params, files, 1, script);
+	Tcl_DecrRefCount (files);
+	if (rc != TCL_OK || script != NULL) {
+		return rc;
+	}
+
+	if (Tcl_ListObjIndex (interp, Tcl_GetObjResult (interp), 0, &result) != TCL_OK ||
+			result == NULL) {
+		return TCL_ERROR;
+	}
+	value = mpvDictGet (result, "status");
+	if (value == NULL || strcmp (Tcl_GetString (value), "ok") != 0) {
+		value = mpvDictGet (result, "error");
+		snprintf (errmsg, sizeof(errmsg), "error: peaks of %s: %s", Tcl_GetString (objv[1]),
+			params.output != NULL && value != NULL && strcmp (Tcl_GetString (value),
+			mpv_error_string (MPV_ERROR_GENERIC)) == 0 ? "cannot write output file" :
+			value != NULL ? Tcl_GetString (value) : "failed");
+		Tcl_ResetResult (interp);
+		Tcl_AddErrorInfo (interp, errmsg);
+		return TCL_ERROR;
+	}
+	value = mpvDictGet (result, "peaks");
+	if (value != NULL) {
+		Tcl_SetObjResult (interp, value);
+	} else {
+		Tcl_ResetResult (interp);
+	}
+	return TCL_OK;
+}
+
+/*
+* FNV-1a hash of a path. 0 marks a free record, so it is never returned.
+*/
+uint64_t
+mpvCacheHash (
+	const char	*path,
+	size_t		len
+	)
+{
+	uint64_t	hash = 14695981039346656037ULL;
+	size_t		i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char) path[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash == 0 ? 1 : hash;
 }
 
+/*
+* Maps the open cache file and checks its header.
+* Returns 0, or -1 when the file is not a usable cache file.
+*/
 int
-mpvSeekCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvCacheMap (
+	mpvCache_t	*cache
+	)
 {
-  int       rc;
-  //double    tm;
-  mpvData_t *mpvData = (mpvData_t *) cd;
-  double    pos;
-  double    d;
-  char      spos [40];
+	struct stat		statinfo;
+	cacheHeader_t	*header;
+	void			*map;
 
-#if MPVDEBUG
-        if (mpvData->debugfh != NULL) {
-          fprintf (mpvData->debugfh, "seek entered: objc: %d, mpvData->state: %d \n", objc, mpvData->state);
-			fflush (mpvData->debugfh );
-        }
-#endif
-	/*
-	TODO: Add support for flags as defined in mpv.io
-	*/
-	if (objc != 2) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?position?");
-		return TCL_ERROR;
+	if (fstat (cache->fd, &statinfo) != 0 ||
+			(size_t) statinfo.st_size < sizeof (cacheHeader_t)) {
+		return -1;
+	}
+	map = mmap (NULL, (size_t) statinfo.st_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	header = (cacheHeader_t *) map;
+	if (memcmp (header->magic, CACHEMAGIC, sizeof (header->magic)) != 0 ||
+			header->version != CACHEVERSION ||
+			header->recordSize != sizeof (cacheRecord_t) ||
+			header->slotCount == 0 ||
+			(header->slotCount & (header->slotCount - 1)) != 0 ||
+			(size_t) statinfo.st_size != sizeof (cacheHeader_t) +
+				header->slotCount * sizeof (cacheRecord_t) + header->heapSize ||
+			header->heapUsed > header->heapSize) {
+		munmap (map, (size_t) statinfo.st_size);
+		return -1;
 	}
+	cache->mapSize = (size_t) statinfo.st_size;
+	cache->header = header;
+	cache->records = (cacheRecord_t *) (header + 1);
+	cache->heap = (char *) (cache->records + header->slotCount);
+	return 0;
+}
 
-	RETURN_IF_NOT_INIT (mpvData->inst);
+/*
+* Opens the cache file path, creating an empty cache when the file
+* does not exist or is empty. Returns 0 or -1 with errno set.
+*/
+int
+mpvCacheOpen (
+	mpvCache_t	*cache,
+	const char	*path
+	)
+{
+	struct stat		statinfo;
+	cacheHeader_t	header;
 
-	if (mpvData->state == PS_PLAYING) {
-		rc = Tcl_GetDoubleFromObj (interp, objv[1], &d);
-		if ( rc != TCL_OK) {
-			Tcl_AddErrorInfo (interp, "error: seek time in seconds must be a decimal number");	
-			return TCL_ERROR;
+	mpvCacheClose (cache);
+	cache->fd = open (path, O_RDWR | O_CREAT, 0644);
+	if (cache->fd < 0) {
+		return -1;
+	}
+	if (fstat (cache->fd, &statinfo) == 0 && statinfo.st_size == 0) {
+		memset (&header, 0, sizeof (header));
+		memcpy (header.magic, CACHEMAGIC, sizeof (header.magic));
+		header.version = CACHEVERSION;
+		header.recordSize = sizeof (cacheRecord_t);
+		header.slotCount = CACHESLOTS;
+		header.heapSize = CACHEHEAP;
+		if (ftruncate (cache->fd, (off_t) (sizeof (header) +
+				CACHESLOTS * sizeof (cacheRecord_t) + CACHEHEAP)) != 0 ||
+				write (cache->fd, &header, sizeof (header)) != (ssize_t) sizeof (header)) {
+			close (cache->fd);
+			cache->fd = -1;
+			return -1;
 		}
-		pos = (double) d;
-		sprintf (spos, "%.1f", pos);
-		const char *cmd[] = { "seek", spos, "absolute", NULL };
-		rc = mpv_command (mpvData->inst, cmd);
-#if MPVDEBUG
-		fprintf (mpvData->debugfh, "seek-%s:status:%d %s\n", spos, rc, mpv_error_string(rc));
-		fflush (mpvData->debugfh );
-#endif
 	}
-	/* The statement below was in the original code.
-	*	However it is useless because mpvData->tm is only
-	*	set after mpv raises an event AND the event is catched
-	*	in the event handler.
-		tm = mpvData->tm;
-		Tcl_SetObjResult (interp, Tcl_NewDoubleObj ((double) tm));
-	*/
-	return TCL_OK;
+	if (mpvCacheMap (cache) != 0) {
+		close (cache->fd);
+		cache->fd = -1;
+		errno = EINVAL;
+		return -1;
+	}
+	cache->path = ckalloc (strlen (path) + 1);
+	strcpy (cache->path, path);
+	return 0;
 }
 
-int
-mpvStateCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+void
+mpvCacheClose (
+	mpvCache_t	*cache
+	)
 {
-  int               rc;
-  mpv_event_id      plstate;
-  mpvData_t         *mpvData = (mpvData_t *) cd;
+	if (cache->header != NULL) {
+		munmap ((void *) cache->header, cache->mapSize);
+		cache->header = NULL;
+		cache->records = NULL;
+		cache->heap = NULL;
+	}
+	if (cache->fd >= 0) {
+		close (cache->fd);
+		cache->fd = -1;
+	}
+	if (cache->path != NULL) {
+		ckfree (cache->path);
+		cache->path = NULL;
+	}
+}
 
-  rc = TCL_OK;
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    plstate = mpvData->state;
-    Tcl_SetObjResult (interp, Tcl_NewStringObj (stateToStr(plstate), -1));
-  }
-  return rc;
+void
+mpvCacheExitHandler (
+	ClientData	cd
+	)
+{
+	mpvCacheClose ((mpvCache_t *) cd);
 }
 
+/*
+* Rewrites the cache with room for slotCount records and heapSize bytes
+* of strings. Strings no longer referred to are dropped. The new file
+* replaces the old one with a rename, so a reader never sees a partly
+* written cache.
+*/
 int
-mpvStopCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvCacheResize (
+	mpvCache_t	*cache,
+	uint32_t	slotCount,
+	uint32_t	heapSize
+	)
 {
-  int       rc;
-  int       status;
-  mpvData_t *mpvData = (mpvData_t *) cd;
+	cacheHeader_t	*header;
+	cacheRecord_t	*records;
+	cacheRecord_t	*old;
+	cacheRecord_t	*rec;
+	char			*heap;
+	char			*tmpPath;
+	char			*path;
+	size_t			size;
+	void			*map;
+	uint32_t		i;
+	uint32_t		idx;
+	int				fd;
 
-  rc = TCL_OK;
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    /* stop: stops playback and clears playlist */
-    /* difference: vlc's stop command does not clear the playlist */
-    const char *cmd[] = {"stop", NULL};
-    status = mpv_command (mpvData->inst, cmd);
-	#if MPVDEBUG
-    if (mpvData->debugfh != NULL) {
-      fprintf (mpvData->debugfh, "stop:status:%d %s\n", status, mpv_error_string(status));
-    }
-	#endif
-  }
-  (void)status;
-  return rc;
+	size = sizeof (cacheHeader_t) + slotCount * sizeof (cacheRecord_t) + heapSize;
+	tmpPath = ckalloc (strlen (cache->path) + 5);
+	sprintf (tmpPath, "%s.tmp", cache->path);
+	fd = open (tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ckfree (tmpPath);
+		return -1;
+	}
+	map = MAP_FAILED;
+	if (ftruncate (fd, (off_t) size) == 0) {
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		close (fd);
+		unlink (tmpPath);
+		ckfree (tmpPath);
+		return -1;
+	}
+
+	header = (cacheHeader_t *) map;
+	records = (cacheRecord_t *) (header + 1);
+	heap = (char *) (records + slotCount);
+	memcpy (header->magic, CACHEMAGIC, sizeof (header->magic));
+	header->version = CACHEVERSION;
+	header->recordSize = sizeof (cacheRecord_t);
+	header->slotCount = slotCount;
+	header->heapSize = heapSize;
+	for (i = 0; i < cache->header->slotCount; ++i) {
+		old = &cache->records[i];
+		if (old->hash == 0) {
+			continue;
+		}
+		idx = (uint32_t) old->hash & (slotCount - 1);
+		while (records[idx].hash != 0) {
+			idx = (idx + 1) & (slotCount - 1);
+		}
+		rec = &records[idx];
+		*rec = *old;
+		rec->pathOff = header->heapUsed;
+		memcpy (heap + header->heapUsed, cache->heap + old->pathOff, old->pathLen + 1);
+		header->heapUsed += old->pathLen + 1;
+		if (old->flags & CACHE_DATA) {
+			rec->dataOff = header->heapUsed;
+			memcpy (heap + header->heapUsed, cache->heap + old->dataOff, old->dataLen + 1);
+			header->heapUsed += old->dataLen + 1;
+		}
+		header->used++;
+	}
+	munmap (map, size);
+	close (fd);
+
+	path = cache->path;
+	cache->path = NULL;
+	if (rename (tmpPath, path) != 0) {
+		unlink (tmpPath);
+		ckfree (tmpPath);
+		cache->path = path;
+		return -1;
+	}
+	ckfree (tmpPath);
+	/* the old mapping still refers to the replaced file */
+	mpvCacheOpen (cache, path);
+	ckfree (path);
+	return cache->header == NULL ? -1 : 0;
 }
 
-int
-mpvQuitCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+/*
+* Returns the record for path, or the free record where it belongs.
+*/
+cacheRecord_t *
+mpvCacheFind (
+	mpvCache_t	*cache,
+	const char	*path,
+	size_t		len,
+	uint64_t	hash
+	)
 {
-  int       rc;
-  int       status;
-  mpvData_t *mpvData = (mpvData_t *) cd;
+	cacheRecord_t	*rec;
+	uint32_t		mask = cache->header->slotCount - 1;
+	uint32_t		idx;
 
-  rc = TCL_OK;
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    /* quits the player */
-    const char *cmd[] = {"quit", 0,  NULL};
-    status = mpv_command (mpvData->inst, cmd);
-	#if MPVDEBUG
-      fprintf (mpvData->debugfh, "quit:status:%d %s\n", status, mpv_error_string(status));
-		fflush (mpvData->debugfh);
-	#endif
-  }
-  (void)status;
-  return rc;
+	idx = (uint32_t) hash & mask;
+	for (;;) {
+		rec = &cache->records[idx];
+		if (rec->hash == 0 ||
+				(rec->hash == hash && rec->pathLen == len &&
+				memcmp (cache->heap + rec->pathOff, path, len) == 0)) {
+			return rec;
+		}
+		idx = (idx + 1) & mask;
+	}
 }
 
-int
-mpvHaveAudioDevListCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+/*
+* Returns the record for path when it is still valid for the file
+* described by st, NULL otherwise.
+*/
+cacheRecord_t *
+mpvCacheLookup (
+	mpvCache_t	*cache,
+	const char	*path,
+	struct stat	*st
+	)
 {
-  int       rc;
+	cacheRecord_t	*rec;
+	size_t			len;
 
-  rc = 1;
-  Tcl_SetObjResult (interp, Tcl_NewBooleanObj (rc));
-  return TCL_OK;
+	if (cache == NULL || cache->header == NULL) {
+		return NULL;
+	}
+	len = strlen (path);
+	rec = mpvCacheFind (cache, path, len, mpvCacheHash (path, len));
+	if (rec->hash == 0 || rec->size != (int64_t) st->st_size ||
+			rec->mtime != (int64_t) st->st_mtime) {
+		return NULL;
+	}
+	return rec;
 }
 
+/*
+* Stores the values flagged in values->flags and, when not NULL, data
+* for path. Values of an outdated record are dropped first.
+* Returns 0 or -1 when the cache could not be grown.
+*/
 int
-mpvVersionCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvCachePut (
+	mpvCache_t		*cache,
+	const char		*path,
+	struct stat		*st,
+	cacheRecord_t	*values,
+	Tcl_Obj			*data
+	)
 {
-  mpvData_t     *mpvData = (mpvData_t *) cd;
+	cacheRecord_t	*rec;
+	const char		*dataStr;
+	size_t			len;
+	size_t			need;
+	uint64_t		hash;
+	uint32_t		slotCount;
+	uint32_t		heapSize;
+	int				dataLen;
+	int				grow;
 
-  Tcl_SetObjResult (interp, Tcl_NewStringObj (mpvData->version, -1));
-  return TCL_OK;
+	if (cache == NULL || cache->header == NULL) {
+		return -1;
+	}
+	dataStr = NULL;
+	dataLen = 0;
+	if (data != NULL) {
+		dataStr = Tcl_GetStringFromObj (data, &dataLen);
+	}
+	len = strlen (path);
+	hash = mpvCacheHash (path, len);
+	rec = mpvCacheFind (cache, path, len, hash);
+
+	need = (rec->hash == 0 ? len + 1 : 0) + (dataStr != NULL ? (size_t) dataLen + 1 : 0);
+	grow = rec->hash == 0 && cache->header->used + 1 > cache->header->slotCount / 4 * 3;
+	if (grow || cache->header->heapUsed + need > cache->header->heapSize) {
+		slotCount = cache->header->slotCount * (grow ? 2 : 1);
+		heapSize = cache->header->heapSize;
+		while (heapSize < cache->header->heapUsed + need) {
+			heapSize *= 2;
+		}
+		if (mpvCacheResize (cache, slotCount, heapSize) != 0) {
+			return -1;
+		}
+		rec = mpvCacheFind (cache, path, len, hash);
+	}
+
+	if (rec->hash == 0) {
+		rec->hash = hash;
+		rec->pathOff = cache->header->heapUsed;
+		rec->pathLen = (uint32_t) len;
+		memcpy (cache->heap + rec->pathOff, path, len + 1);
+		cache->header->heapUsed += (uint32_t) len + 1;
+		cache->header->used++;
+		rec->flags = 0;
+	} else if (rec->size != (int64_t) st->st_size || rec->mtime != (int64_t) st->st_mtime) {
+		rec->flags = 0;
+	}
+	rec->size = (int64_t) st->st_size;
+	rec->mtime = (int64_t) st->st_mtime;
+
+	if (values->flags & CACHE_DURATION) {
+		rec->duration = values->duration;
+	}
+	if (values->flags & CACHE_LOUDNESS) {
+		rec->loudness = values->loudness;
+		rec->range = values->range;
+		rec->peak = values->peak;
+	}
+	if (values->flags & CACHE_CUE) {
+		rec->cueIn = values->cueIn;
+		rec->cueOut = values->cueOut;
+		rec->segue = values->segue;
+	}
+	rec->flags |= values->flags & (uint32_t) ~CACHE_DATA;
+	if (dataStr != NULL) {
+		rec->dataOff = cache->header->heapUsed;
+		rec->dataLen = (uint32_t) dataLen;
+		memcpy (cache->heap + rec->dataOff, dataStr, (size_t) dataLen + 1);
+		cache->header->heapUsed += (uint32_t) dataLen + 1;
+		rec->flags |= CACHE_DATA;
+	}
+	return 0;
+}
+
+/*
+* Returns the values of a record as a dict.
+*/
+Tcl_Obj *
+mpvCacheRecordObj (
+	mpvCache_t		*cache,
+	cacheRecord_t	*rec
+	)
+{
+	Tcl_Obj			*dict;
+	Tcl_Obj			*data;
+	Tcl_Obj			*key;
+	Tcl_Obj			*value;
+	Tcl_DictSearch	search;
+	int				done;
+
+	dict = Tcl_NewDictObj ();
+	if (rec->flags & CACHE_DURATION) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("duration", -1),
+			Tcl_NewDoubleObj (rec->duration));
+	}
+	if (rec->flags & CACHE_LOUDNESS) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("loudness", -1),
+			Tcl_NewDoubleObj (rec->loudness));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("range", -1),
+			Tcl_NewDoubleObj (rec->range));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("peak", -1),
+			Tcl_NewDoubleObj (rec->peak));
+	}
+	if (rec->flags & CACHE_CUE) {
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("cuein", -1),
+			Tcl_NewDoubleObj (rec->cueIn));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("cueout", -1),
+			Tcl_NewDoubleObj (rec->cueOut));
+		Tcl_DictObjPut (NULL, dict, Tcl_NewStringObj ("segue", -1),
+			Tcl_NewDoubleObj (rec->segue));
+	}
+	if (rec->flags & CACHE_DATA) {
+		data = Tcl_NewStringObj (cache->heap + rec->dataOff, (int) rec->dataLen);
+		Tcl_IncrRefCount (data);
+		if (Tcl_DictObjFirst (NULL, data, &search, &key, &value, &done) == TCL_OK) {
+			for ( ; ! done; Tcl_DictObjNext (&search, &key, &value, &done)) {
+				Tcl_DictObjPut (NULL, dict, key, value);
+			}
+			Tcl_DictObjDone (&search);
+		}
+		Tcl_DecrRefCount (data);
+	}
+	return dict;
+}
+
+/*
+* Returns the value of key in dict, NULL when it is not present.
+*/
+Tcl_Obj *
+mpvDictGet (
+	Tcl_Obj		*dict,
+	const char	*key
+	)
+{
+	Tcl_Obj		*keyObj;
+	Tcl_Obj		*value;
+
+	keyObj = Tcl_NewStringObj (key, -1);
+	Tcl_IncrRefCount (keyObj);
+	if (Tcl_DictObjGet (NULL, dict, keyObj, &value) != TCL_OK) {
+		value = NULL;
+	}
+	Tcl_DecrRefCount (keyObj);
+	return value;
 }
 
+/*
+* Stores a successful result of ::tclmpv::scan or analyze loudness
+* in the cache.
+*/
 void
-mpvClose (
-	mpvData_t		 *mpvData
+mpvCacheScanResult (
+	mpvCache_t	*cache,
+	Tcl_Obj		*result
 	)
 {
-	/*
-	* Internal function, not to be exposed to TCL
-	*/
-	int	 i;
+	static const char	*dataKeys[] = { "metadata", "codec", "audio-params", NULL };
+	cacheRecord_t		values;
+	struct stat			statinfo;
+	Tcl_Obj				*value;
+	Tcl_Obj				*file;
+	Tcl_Obj				*data;
+	int					size;
+	int					i;
 
-	if (mpvData->inst != NULL) {
-		mpv_terminate_destroy (mpvData->inst);
-		mpvData->inst = NULL;
+	if (cache == NULL || cache->header == NULL) {
+		return;
 	}
-	if (mpvData->argv != NULL) {
-		for (i = 0; i < mpvData->argc; ++i) {
-			ckfree (mpvData->argv[i]);
+	value = mpvDictGet (result, "status");
+	file = mpvDictGet (result, "file");
+	if (value == NULL || strcmp (Tcl_GetString (value), "ok") != 0 ||
+			file == NULL || stat (Tcl_GetString (file), &statinfo) != 0) {
+		return;
+	}
+
+	values.flags = 0;
+	value = mpvDictGet (result, "duration");
+	if (value != NULL && Tcl_GetDoubleFromObj (NULL, value, &values.duration) == TCL_OK) {
+		values.flags |= CACHE_DURATION;
+	}
+	value = mpvDictGet (result, "loudness");
+	if (value != NULL && Tcl_GetDoubleFromObj (NULL, value, &values.loudness) == TCL_OK) {
+		values.flags |= CACHE_LOUDNESS;
+		values.range = 0.0;
+		values.peak = 0.0;
+		value = mpvDictGet (result, "range");
+		if (value != NULL) {
+			Tcl_GetDoubleFromObj (NULL, value, &values.range);
+		}
+		value = mpvDictGet (result, "peak");
+		if (value != NULL) {
+			Tcl_GetDoubleFromObj (NULL, value, &values.peak);
+		}
+	}
+	value = mpvDictGet (result, "cuein");
+	if (value != NULL && Tcl_GetDoubleFromObj (NULL, value, &values.cueIn) == TCL_OK) {
+		values.flags |= CACHE_CUE;
+		values.cueOut = values.cueIn;
+		value = mpvDictGet (result, "cueout");
+		if (value != NULL) {
+			Tcl_GetDoubleFromObj (NULL, value, &values.cueOut);
+		}
+		values.segue = values.cueOut;
+		value = mpvDictGet (result, "segue");
+		if (value != NULL) {
+			Tcl_GetDoubleFromObj (NULL, value, &values.segue);
 		}
-		ckfree (mpvData->argv);
-		mpvData->argv = NULL;
 	}
+	data = Tcl_NewDictObj ();
+	Tcl_IncrRefCount (data);
+	for (i = 0; dataKeys[i] != NULL; ++i) {
+		value = mpvDictGet (result, dataKeys[i]);
+		if (value != NULL) {
+			Tcl_DictObjPut (NULL, data, Tcl_NewStringObj (dataKeys[i], -1), value);
+		}
+	}
+	/* a loudness result has no data, the stored data is kept */
+	Tcl_DictObjSize (NULL, data, &size);
+	mpvCachePut (cache, Tcl_GetString (file), &statinfo, &values, size > 0 ? data : NULL);
+	Tcl_DecrRefCount (data);
+}
 
-	if (mpvData->device != NULL) {
-		free ((void *) mpvData->device);
-		mpvData->device = NULL;
+/*
+* Called when path replaces the current file, or when mpv reports the
+* path of a file started from the playlist: the path is remembered and
+* the duration is taken from the cache until mpv reports it.
+*/
+void
+mpvCacheApply (
+	mpvData_t	*mpvData,
+	const char	*path
+	)
+{
+	cacheRecord_t	*rec;
+	struct stat		statinfo;
+
+	mpvPathSet (mpvData, path);
+	if (mpvData->cache == NULL || mpvData->cache->header == NULL ||
+			stat (path, &statinfo) != 0) {
+		return;
+	}
+	rec = mpvCacheLookup (mpvData->cache, path, &statinfo);
+	if (rec != NULL && (rec->flags & CACHE_DURATION)) {
+		PROPCACHE (mpvData, PROP_DURATION).cache.d = rec->duration;
 	}
+}
 
-	mpvData->state = PS_STOPPED;
+/*
+* Stores the duration reported by mpv for the current file.
+*/
+void
+mpvCacheLearn (
+	mpvData_t	*mpvData,
+	double		duration
+	)
+{
+	cacheRecord_t	values;
+	struct stat		statinfo;
+
+	if (mpvData->cache == NULL || mpvData->cache->header == NULL ||
+			mpvData->path == NULL) {
+		return;
+	}
+	if (stat (mpvData->path, &statinfo) == 0) {
+		values.flags = CACHE_DURATION;
+		values.duration = duration;
+		mpvCachePut (mpvData->cache, mpvData->path, &statinfo, &values, NULL);
+	}
 }
 
+/*
+* Remembers the path of the playing file, NULL forgets it.
+*/
 void
-mpvExitHandler (
-  void *cd
-  )
+mpvPathSet (
+	mpvData_t	*mpvData,
+	const char	*path
+	)
 {
-  mpvData_t     *mpvData = (mpvData_t *) cd;
+	if (mpvData->path != NULL) {
+		ckfree (mpvData->path);
+		mpvData->path = NULL;
+	}
+	if (path != NULL) {
+		mpvData->path = ckalloc (strlen (path) + 1);
+		strcpy (mpvData->path, path);
+	}
+}
 
+/*
+* The reply to the path request made on start-file. Files started
+* from the playlist were not passed to loadfile or media, their path
+* is only known from here on.
+*/
+void
+mpvPathReply (
+	mpvData_t	*mpvData,
+	mpv_event	*event
+	)
+{
+	mpv_event_property	*prop = (mpv_event_property *) event->data;
 
-  Tcl_DeleteTimerHandler (mpvData->timerToken);
-  mpvClose (mpvData);
-/********
-  if (mpvData->debugfh != NULL) {
-    fclose (mpvData->debugfh);
-    mpvData->debugfh = NULL;
-  }
-***********/
-  ckfree (cd);
+	if (event->error < 0 || prop == NULL || prop->format != MPV_FORMAT_STRING) {
+		mpvPathSet (mpvData, NULL);
+	} else if (mpvData->durationSeen) {
+		/* mpv was faster, its duration is not replaced by the cached one */
+		mpvPathSet (mpvData, *(char **) prop->data);
+	} else {
+		mpvCacheApply (mpvData, *(char **) prop->data);
+		++mpvData->generation;
+	}
+	if (mpvData->gainEnabled && mpvData->inst != NULL) {
+		mpvGainApply (mpvData);
+	}
 }
 
-int
-mpvReleaseCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+/*
+* Sets the gain bringing the current file to the target loudness,
+* limited so the true peak stays below -1 dBTP. Files without cached
+* loudness play unchanged.
+*/
+void
+mpvGainApply (
+	mpvData_t	*mpvData
+	)
 {
-  mpvData_t     *mpvData = (mpvData_t *) cd;
+	cacheRecord_t	*rec;
+	struct stat		statinfo;
+	double			gain;
 
-  Tcl_DeleteTimerHandler (mpvData->timerToken);
-  mpvClose (mpvData);
-/********
-  if (mpvData->debugfh != NULL) {
-    fclose (mpvData->debugfh);
-    mpvData->debugfh = NULL;
-  }
-***********/
-  return TCL_OK;
+	gain = 0.0;
+	if (mpvData->cache != NULL && mpvData->cache->header != NULL &&
+			mpvData->path != NULL && stat (mpvData->path, &statinfo) == 0 &&
+			(rec = mpvCacheLookup (mpvData->cache, mpvData->path, &statinfo)) != NULL &&
+			(rec->flags & CACHE_LOUDNESS)) {
+		gain = mpvData->gainTarget - rec->loudness;
+		if (rec->peak + gain > -1.0) {
+			gain = -1.0 - rec->peak;
+		}
+	}
+	mpvGainSet (mpvData, gain);
 }
 
-int
-mpvInitCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+void
+mpvGainSet (
+	mpvData_t	*mpvData,
+	double		gain
+	)
 {
-  char          *tptr;
-  char          *nptr;
-  int           rc;
-  int           i;
-  int           len;
-  int           gstatus;
-  int           status;
-  mpvData_t     *mpvData = (mpvData_t *) cd;
-
-	/* FIXME: I don't quite understand this piece of code. It looks like the parameters
-	* to the init command are processed to form options. However at the end  the 
-	* parameter array in the mpvData structure is set to NULL. And no options are 
-	* passed to the mpv instance.
-	*/
-  mpvData->argv = (const char **) ckalloc (sizeof(const char *) * (size_t) (objc + 1));
-  for (i = 0; i < objc; ++i) {
-    tptr = Tcl_GetStringFromObj (objv[i], &len);
-    nptr = (char *) ckalloc (len+1);
-    strcpy (nptr, tptr);
-    mpvData->argv[i] = nptr;
-  }
-  mpvData->argc = objc;
-  mpvData->argv[objc] = NULL;
+	char			filter[80];
+	const char		*addcmd[] = { "af", "add", filter, NULL };
+	const char		*removecmd[] = { "af", "remove", GAINLABEL, NULL };
+	int				status;
 
-  rc = TCL_ERROR;
-  gstatus = 0;
+	/* volume-gain is available since mpv 0.36, older versions get a filter */
+	status = mpv_set_property (mpvData->inst, "volume-gain", MPV_FORMAT_DOUBLE, &gain);
+	if (status != MPV_ERROR_PROPERTY_NOT_FOUND) {
+		if (status < 0) {
+			TRACE (mpvData, TL_ERROR, TR_COMMAND, 0, status, 0, gain, "volume-gain");
+		}
+		return;
+	}
+	if (gain == 0.0) {
+		mpv_command (mpvData->inst, removecmd);
+	} else {
+		snprintf (filter, sizeof(filter), "%s:lavfi=[volume=%.2fdB]", GAINLABEL, gain);
+		mpv_command (mpvData->inst, addcmd);
+	}
+}
 
-  if (mpvData->inst == NULL) {
-    mpvData->inst = mpv_create ();
-#if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "mpvData->inst: %p\n", (void *) mpvData->inst);
-		fflush (mpvData->debugfh); 
-      }
-#endif
-    if (mpvData->inst != NULL) {
-		status = mpv_initialize (mpvData->inst);
-#if MPVDEBUG
-		fprintf (mpvData->debugfh, "initialization status:%d\n", status);
-		fflush (mpvData->debugfh); 
-#endif
-		if (status < 0) { gstatus = status; }
-		double vol = 100.0;
-		mpv_set_property (mpvData->inst, "volume", MPV_FORMAT_DOUBLE, &vol);
-		mpv_observe_property(mpvData->inst, 0, "duration", MPV_FORMAT_DOUBLE);
-		mpv_observe_property(mpvData->inst, 0, "time-pos", MPV_FORMAT_DOUBLE);
-		mpv_observe_property(mpvData->inst, 0, "filename", MPV_FORMAT_STRING);
-		mpv_observe_property(mpvData->inst, 0, "idle-active", MPV_FORMAT_FLAG);
+/*
+* Called from the on_load hook: the cached cue points of the file
+* become its start and end unless they were given to loadfile.
+*/
+void
+mpvCueHook (
+	mpvData_t	*mpvData
+	)
+{
+	cacheRecord_t	*rec;
+	struct stat		statinfo;
+	char			*path;
+	char			*value;
+	char			pos[40];
+	int				isset;
 
-		/*
-		* From now on, it is expected that events be handled
-		* Call the eventhandler once, it will schedule next periodic call
-		*/
-		mpv_set_wakeup_callback (mpvData->inst, &mpvCallbackHandler, mpvData);
-		//mpvData->timerToken = Tcl_CreateTimerHandler (CHKTIMER, &mpvEventHandler, mpvData);
-		mpvEventHandler (mpvData);
+	if (mpvData->cache == NULL || mpvData->cache->header == NULL ||
+			mpv_get_property (mpvData->inst, "path", MPV_FORMAT_STRING, &path) < 0) {
+		return;
 	}
-  }
-  if (mpvData->inst != NULL && gstatus == 0) {
-    rc = TCL_OK;
-  }
-  return rc;
+	if (stat (path, &statinfo) == 0 &&
+			(rec = mpvCacheLookup (mpvData->cache, path, &statinfo)) != NULL &&
+			(rec->flags & CACHE_CUE)) {
+		/* options passed to loadfile are already file local here */
+		value = mpv_get_property_string (mpvData->inst, "file-local-options/start");
+		isset = value != NULL && strcmp (value, "none") != 0;
+		mpv_free (value);
+		if (! isset && rec->cueIn > 0.0) {
+			snprintf (pos, sizeof(pos), "%.3f", rec->cueIn);
+			mpv_set_property_string (mpvData->inst, "file-local-options/start", pos);
+		}
+		value = mpv_get_property_string (mpvData->inst, "file-local-options/end");
+		isset = value != NULL && strcmp (value, "none") != 0;
+		mpv_free (value);
+		if (! isset && rec->cueOut > rec->cueIn) {
+			snprintf (pos, sizeof(pos), "%.3f", rec->cueOut);
+			mpv_set_property_string (mpvData->inst, "file-local-options/end", pos);
+		}
+	}
+	mpv_free (path);
 }
 
+/*
+* analyze loudness files ?-threads n? ?-command script?
+* analyze gain ?lufs|off?
+* analyze cue files ?-silence db? ?-segue db? ?-threads n? ?-command script?
+* analyze trim ?on|off?
+* Measures integrated loudness, loudness range and true peak (EBU R128)
+* or the cue points of files and stores them in the cache. With a gain
+* target set, files with cached loudness are played at the target level,
+* with trim on files with cached cue points start and end there.
+*/
 int
-mpvAudioDevSetCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvAnalyzeCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
 {
-  mpvData_t     *mpvData = (mpvData_t *) cd;
-  int           rc;
-  char          *dev;
+	mpvData_t	*mpvData = (mpvData_t *) cd;
+	Tcl_Obj		*script;
+	scanParams_t	params;
+	double		target;
+	int			threads;
+	int			sub;
+	int			flag;
+	static const char *subCmds[] = { "cue", "gain", "loudness", "trim", NULL };
+	enum { AC_CUE, AC_GAIN, AC_LOUDNESS, AC_TRIM };
 
-  if (objc != 2) {
-    Tcl_WrongNumArgs(interp, 1, objv, "deviceid");
-    return TCL_ERROR;
-  }
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "loudness|gain|cue|trim ?arg ...?");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObj (interp, objv[1], subCmds, "subcommand", 0, &sub) != TCL_OK) {
+		return TCL_ERROR;
+	}
 
-  rc = TCL_OK;
+	if (sub == AC_LOUDNESS) {
+		if (objc < 3 || (objc % 2) != 1) {
+			Tcl_WrongNumArgs(interp, 2, objv, "files ?-threads n? ?-command script?");
+			return TCL_ERROR;
+		}
+		if (mpvScanOptions (interp, objc - 3, objv + 3, &threads, &script, NULL) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		return mpvScanStart (interp, mpvData->cache, SCAN_LOUDNESS, NULL, objv[2], threads, script);
+	}
 
-  if (mpvData->inst == NULL) {
-    rc = TCL_ERROR;
-  } else {
-    dev = Tcl_GetString(objv[1]);
-    if (mpvData->device != NULL) {
-      free ((void *) mpvData->device);
-    }
-    mpvData->device = NULL;
-    if (strlen (dev) > 0) {
-      mpvData->device = strdup (dev);
-    }
-  }
+	if (sub == AC_CUE) {
+		if (objc < 3 || (objc % 2) != 1) {
+			Tcl_WrongNumArgs(interp, 2, objv,
+				"files ?-silence db? ?-segue db? ?-threads n? ?-command script?");
+			return TCL_ERROR;
+		}
+		params.silence = CUESILENCE;
+		params.segue = CUESEGUE;
+		if (mpvScanOptions (interp, objc - 3, objv + 3, &threads, &script, &params) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (params.silence > 0.0 || params.segue > 0.0) {
+			Tcl_AddErrorInfo (interp, "error: levels must be 0 dBFS or lower");
+			return TCL_ERROR;
+		}
+		return mpvScanStart (interp, mpvData->cache, SCAN_CUE, &params, objv[2], threads, script);
+	}
 
-  return rc;
+	if (sub == AC_TRIM) {
+		if (objc > 3) {
+			Tcl_WrongNumArgs(interp, 2, objv, "?on|off?");
+			return TCL_ERROR;
+		}
+		if (objc == 3) {
+			if (Tcl_GetBooleanFromObj (interp, objv[2], &flag) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			mpvData->trimEnabled = flag;
+			if (flag && mpvData->inst != NULL && ! mpvData->trimHook) {
+				mpvData->trimHook = mpv_hook_add (mpvData->inst, 0, "on_load", 0) >= 0;
+			}
+		}
+		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (mpvData->trimEnabled));
+		return TCL_OK;
+	}
+
+	if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "?lufs|off?");
+		return TCL_ERROR;
+	}
+	if (objc == 3) {
+		if (strcmp (Tcl_GetString (objv[2]), "off") == 0) {
+			mpvData->gainEnabled = 0;
+		} else if (Tcl_GetDoubleFromObj (interp, objv[2], &target) != TCL_OK) {
+			return TCL_ERROR;
+		} else {
+			mpvData->gainEnabled = 1;
+			mpvData->gainTarget = target;
+		}
+		/* the current file follows the new setting */
+		if (mpvData->inst != NULL) {
+			if (mpvData->gainEnabled) {
+				mpvGainApply (mpvData);
+			} else {
+				mpvGainSet (mpvData, 0.0);
+			}
+		}
+	}
+	if (mpvData->gainEnabled) {
+		Tcl_SetObjResult (interp, Tcl_NewDoubleObj (mpvData->gainTarget));
+	} else {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("off", -1));
+	}
+	return TCL_OK;
 }
 
+/*
+* ::tclmpv::cache open path | close | get file | put file dict | info
+*/
 int
-mpvAudioDevListCmd (
-  ClientData cd,
-  Tcl_Interp* interp,
-  int objc,
-  Tcl_Obj * const objv[]
-  )
+mpvCacheCmd (
+	ClientData cd,
+	Tcl_Interp* interp,
+	int objc,
+	Tcl_Obj * const objv[]
+	)
 {
-  mpvData_t     *mpvData = (mpvData_t *) cd;
-  Tcl_Obj       *lobj;
-  Tcl_Obj       *sobj;
-  mpv_node      anodes;
-  mpv_node_list *infolist;
-  mpv_node_list *nodelist;
-  char          *nmptr = NULL;
-  char          *descptr = NULL;
+	mpvPkgData_t	*pkgData = (mpvPkgData_t *) cd;
+	mpvCache_t		*cache = pkgData->cache;
+	cacheRecord_t	*rec;
+	cacheRecord_t	values;
+	struct stat		statinfo;
+	Tcl_Obj			*data;
+	Tcl_Obj			*key;
+	Tcl_Obj			*value;
+	Tcl_Obj			*info;
+	Tcl_DictSearch	search;
+	const char		*name;
+	char			errmsg[256];
+	int				sub;
+	int				done;
+	static const char *subCmds[] = { "close", "get", "info", "open", "put", NULL };
+	enum { CC_CLOSE, CC_GET, CC_INFO, CC_OPEN, CC_PUT };
+	static const int subArgs[] = { 0, 1, 0, 1, 2 };
 
-  if (mpvData->inst == NULL) {
-    return TCL_ERROR;
-  }
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "open|close|get|put|info ?arg ...?");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObj (interp, objv[1], subCmds, "subcommand", 0, &sub) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	if (objc - 2 != subArgs[sub]) {
+		Tcl_WrongNumArgs(interp, 2, objv, sub == CC_OPEN ? "path" :
+			sub == CC_GET ? "file" : sub == CC_PUT ? "file dict" : "");
+		return TCL_ERROR;
+	}
+	if (sub != CC_OPEN && sub != CC_CLOSE && cache->header == NULL) {
+		Tcl_AddErrorInfo (interp, "error: no cache file open");
+		return TCL_ERROR;
+	}
 
-  lobj = Tcl_NewListObj (0, NULL);
+	switch (sub) {
+		case CC_OPEN: {
+			if (mpvCacheOpen (cache, Tcl_GetString (objv[2])) != 0) {
+				snprintf (errmsg, sizeof(errmsg), "error: cannot open cache file %s: %s",
+					Tcl_GetString (objv[2]), errno == EINVAL ? "not a tclmpv cache file" :
+					strerror (errno));
+				Tcl_AddErrorInfo (interp, errmsg);
+				return TCL_ERROR;
+			}
+			break;
+		}
+		case CC_CLOSE: {
+			mpvCacheClose (cache);
+			break;
+		}
+		case CC_GET: {
+			/* a missing or changed file is not an error, just not cached */
+			name = Tcl_GetString (objv[2]);
+			if (stat (name, &statinfo) == 0 &&
+					(rec = mpvCacheLookup (cache, name, &statinfo)) != NULL) {
+				Tcl_SetObjResult (interp, mpvCacheRecordObj (cache, rec));
+			}
+			break;
+		}
+		case CC_PUT: {
+			name = Tcl_GetString (objv[2]);
+			if (stat (name, &statinfo) != 0) {
+				snprintf (errmsg, sizeof(errmsg), "error: %s: %s", name, strerror (errno));
+				Tcl_AddErrorInfo (interp, errmsg);
+				return TCL_ERROR;
+			}
+			if (Tcl_DictObjFirst (interp, objv[3], &search, &key, &value, &done) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			values.flags = 0;
+			values.range = 0.0;
+			values.peak = 0.0;
+			values.cueIn = 0.0;
+			values.cueOut = 0.0;
+			values.segue = -1.0;
+			data = NULL;
+			for ( ; ! done; Tcl_DictObjNext (&search, &key, &value, &done)) {
+				const char	*k = Tcl_GetString (key);
+				double		*dest = NULL;
+				int			flag = 0;
 
-  mpv_get_property (mpvData->inst, "audio-device-list", MPV_FORMAT_NODE, &anodes);
-  if (anodes.format != MPV_FORMAT_NODE_ARRAY) {
-    return TCL_ERROR;
-  }
-  nodelist = anodes.u.list;
-  for (int i = 0; i < nodelist->num; ++i) {
-    infolist = nodelist->values[i].u.list;
-    for (int j = 0; j < infolist->num; ++j) {
-      if (strcmp (infolist->keys[j], "name") == 0) {
-        nmptr = infolist->values[j].u.string;
-      } else if (strcmp (infolist->keys[j], "description") == 0) {
-        descptr = infolist->values[j].u.string;
-      } else {
-        if (mpvData->debugfh != NULL) {
-          fprintf (mpvData->debugfh, "dev: %s\n", infolist->keys[j]);
-        }
-      }
-    }
-	if (nmptr != NULL) {
-		sobj = Tcl_NewStringObj (nmptr, -1);
-		Tcl_ListObjAppendElement (interp, lobj, sobj);
-	}
-	if (descptr != NULL) {
-		sobj = Tcl_NewStringObj (descptr, -1);
-		Tcl_ListObjAppendElement (interp, lobj, sobj);
+				if (strcmp (k, "duration") == 0) {
+					dest = &values.duration;
+					flag = CACHE_DURATION;
+				} else if (strcmp (k, "loudness") == 0) {
+					dest = &values.loudness;
+					flag = CACHE_LOUDNESS;
+				} else if (strcmp (k, "range") == 0) {
+					dest = &values.range;
+					flag = CACHE_LOUDNESS;
+				} else if (strcmp (k, "peak") == 0) {
+					dest = &values.peak;
+					flag = CACHE_LOUDNESS;
+				} else if (strcmp (k, "cuein") == 0) {
+					dest = &values.cueIn;
+					flag = CACHE_CUE;
+				} else if (strcmp (k, "cueout") == 0) {
+					dest = &values.cueOut;
+					flag = CACHE_CUE;
+				} else if (strcmp (k, "segue") == 0) {
+					dest = &values.segue;
+					flag = CACHE_CUE;
+				}
+				if (dest != NULL) {
+					if (Tcl_GetDoubleFromObj (interp, value, dest) != TCL_OK) {
+						Tcl_DictObjDone (&search);
+						if (data != NULL) {
+							Tcl_DecrRefCount (data);
+						}
+						return TCL_ERROR;
+					}
+					values.flags |= (uint32_t) flag;
+				} else {
+					if (data == NULL) {
+						data = Tcl_NewDictObj ();
+						Tcl_IncrRefCount (data);
+					}
+					Tcl_DictObjPut (NULL, data, key, value);
+				}
+			}
+			Tcl_DictObjDone (&search);
+			if (values.segue < 0.0) {
+				values.segue = values.cueOut;
+			}
+			rec = mpvCacheLookup (cache, name, &statinfo);
+			if (rec != NULL && data != NULL && (rec->flags & CACHE_DATA)) {
+				/* keep the stored keys that are not replaced */
+				value = Tcl_NewStringObj (cache->heap + rec->dataOff, (int) rec->dataLen);
+				Tcl_IncrRefCount (value);
+				if (Tcl_DictObjFirst (NULL, value, &search, &key, &info, &done) == TCL_OK) {
+					for ( ; ! done; Tcl_DictObjNext (&search, &key, &info, &done)) {
+						Tcl_Obj *cur;
+						if (Tcl_DictObjGet (NULL, data, key, &cur) == TCL_OK && cur == NULL) {
+							Tcl_DictObjPut (NULL, data, key, info);
+						}
+					}
+					Tcl_DictObjDone (&search);
+				}
+				Tcl_DecrRefCount (value);
+			}
+			if (mpvCachePut (cache, name, &statinfo, &values, data) != 0) {
+				snprintf (errmsg, sizeof(errmsg), "error: cannot grow cache file: %s",
+					strerror (errno));
+				Tcl_AddErrorInfo (interp, errmsg);
+				if (data != NULL) {
+					Tcl_DecrRefCount (data);
+				}
+				return TCL_ERROR;
+			}
+			if (data != NULL) {
+				Tcl_DecrRefCount (data);
+			}
+			break;
+		}
+		case CC_INFO: {
+			info = Tcl_NewDictObj ();
+			Tcl_DictObjPut (NULL, info, Tcl_NewStringObj ("path", -1),
+				Tcl_NewStringObj (cache->path, -1));
+			Tcl_DictObjPut (NULL, info, Tcl_NewStringObj ("records", -1),
+				Tcl_NewWideIntObj ((Tcl_WideInt) cache->header->used));
+			Tcl_DictObjPut (NULL, info, Tcl_NewStringObj ("slots", -1),
+				Tcl_NewWideIntObj ((Tcl_WideInt) cache->header->slotCount));
+			Tcl_DictObjPut (NULL, info, Tcl_NewStringObj ("heapused", -1),
+				Tcl_NewWideIntObj ((Tcl_WideInt) cache->header->heapUsed));
+			Tcl_DictObjPut (NULL, info, Tcl_NewStringObj ("heapsize", -1),
+				Tcl_NewWideIntObj ((Tcl_WideInt) cache->header->heapSize));
+			Tcl_SetObjResult (interp, info);
+			break;
+		}
 	}
-  }
-  mpv_free_node_contents (&anodes);
-  Tcl_SetObjResult (interp, lobj);
-  return TCL_OK;
+	return TCL_OK;
 }
 
 int
@@ -1167,51 +7261,30 @@ Tclmpv_Init (Tcl_Interp *interp)
   Tcl_Obj       *dictObj = NULL;
   Tcl_DString   ds;
   mpvData_t     *mpvData;
-  unsigned int  ivers;
+  mpvPkgData_t  *pkgData;
   int           i;
-  int           debug;
   const char    *nsName = "::tclmpv";
   const char    *cmdName = nsName + 5;
-  char          tvers [20];
 
   if (!Tcl_InitStubs (interp,"8.3",0)) {
     return TCL_ERROR;
   }
 
-  debug = 0;
-#if MPVDEBUG
-  debug = 1;
-#endif
-  mpvData = (mpvData_t *) ckalloc (sizeof (mpvData_t));
-  mpvData->interp = interp;
-  mpvData->inst = NULL;
-  mpvData->argv = NULL;
-  mpvData->state = PS_NONE;
-  mpvData->device = NULL;
-  mpvData->paused = 0;
-  mpvData->duration = 0.0;
-  mpvData->tm = 0.0;
-  mpvData->hasEvent = 0;
-  mpvData->timerToken = NULL;
-  mpvData->debugfh = NULL;
-  mpvData->end_file = (mpv_event_end_file) {.reason = 0, .error = 0};
-  for (i = 0; i < stateMapIdxMax; ++i) {
-    mpvData->stateMapIdx[i] = 0;
-  }
-  for (i = 0; i < stateMapMax; ++i) {
-    mpvData->stateMapIdx[stateMap[i].state] = i;
-  }
-
-  if (debug) {
-    mpvData->debugfh = fopen ("mpvdebug.txt", "w+");
-  }
+  mpvData = mpvDataAlloc (interp);
+  pkgData = (mpvPkgData_t *) ckalloc (sizeof (mpvPkgData_t));
+  pkgData->interp = interp;
+  pkgData->player = mpvData;
+  pkgData->instanceCount = 0;
+  pkgData->cache = (mpvCache_t *) ckalloc (sizeof (mpvCache_t));
+  pkgData->cache->path = NULL;
+  pkgData->cache->fd = -1;
+  pkgData->cache->mapSize = 0;
+  pkgData->cache->header = NULL;
+  pkgData->cache->records = NULL;
+  pkgData->cache->heap = NULL;
+  mpvData->cache = pkgData->cache;
+  Tcl_CreateExitHandler (mpvCacheExitHandler, (ClientData) pkgData->cache);
 
-#if MPVDEBUG
-      if (mpvData->debugfh != NULL) {
-        fprintf (mpvData->debugfh, "debug output file created\n");
-		fflush (mpvData->debugfh); 
-      }
-#endif
 
   nsPtr = Tcl_FindNamespace(interp, nsName, NULL, 0);
   if (nsPtr == NULL) {
@@ -1242,6 +7315,17 @@ Tclmpv_Init (Tcl_Interp *interp)
            mpvCmdMap[i].proc, (ClientData) mpvData, NULL);
     }
   }
+  for (i = 0; mpvPkgCmdMap[i].name != NULL; ++i) {
+    Tcl_Obj *nameObj;
+    Tcl_Obj *fqdnObj;
+
+    nameObj = Tcl_NewStringObj (mpvPkgCmdMap[i].name, -1);
+    fqdnObj = Tcl_NewStringObj (Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_AppendStringsToObj (fqdnObj, "::", mpvPkgCmdMap[i].name, NULL);
+    Tcl_DictObjPut (NULL, dictObj, nameObj, fqdnObj);
+    Tcl_CreateObjCommand (interp, Tcl_GetString (fqdnObj),
+         mpvPkgCmdMap[i].proc, (ClientData) pkgData, NULL);
+  }
 
   if (ensemble) {
     Tcl_SetEnsembleMappingDict (interp, ensemble, dictObj);
@@ -1249,10 +7333,6 @@ Tclmpv_Init (Tcl_Interp *interp)
 
   Tcl_DStringFree(&ds);
 
-  ivers = mpv_client_api_version();
-  sprintf (tvers, "%d.%d", ivers >> 16, ivers & 0xFF);
-  strcpy (mpvData->version, tvers);
-
   /* If the 'package ifneeded' and package provides do
    * not match, tcl fails.  Can't really use the mpv
    * version number here.
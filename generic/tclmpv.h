@@ -7,6 +7,28 @@
 
 #define CHKTIMER 100
 
+/* reply_userdata of the path request made on start-file, the ids of
+ * the -async requests count up from 1 */
+#define REPLY_PATH UINT64_MAX
+
+/*
+ * How the mpv wakeup callback reaches the Tcl event loop.
+ * WAKEUP_TIMER polls a flag every CHKTIMER ms, WAKEUP_FD has the
+ * callback write to a pipe which is watched by a Tcl file handler,
+ * WAKEUP_EVENT queues a Tcl event to the thread owning the player.
+ */
+typedef enum wakeupmode {
+  WAKEUP_TIMER = 0,
+  WAKEUP_FD = 1,
+  WAKEUP_EVENT = 2
+} wakeupmode;
+
+#if TCL_THREADS
+# define WAKEUP_DEFAULT WAKEUP_EVENT
+#else
+# define WAKEUP_DEFAULT WAKEUP_FD
+#endif
+
 typedef struct { char *name; Tcl_ObjCmdProc *proc; } EnsembleData;
 
 typedef enum playstate {
@@ -39,6 +61,35 @@ static const playStateMap_t playStateMap[] = {
 };
 #define playStateMapMax (sizeof(playStateMap)/sizeof(playStateMap_t))
 
+/* keys of the dict of ::tclmpv::status */
+typedef enum statusfield {
+  SF_STATE = 0,
+  SF_PLAYING = 1,
+  SF_PAUSED = 2,
+  SF_TIME = 3,
+  SF_DURATION = 4,
+  SF_RATE = 5,
+  SF_FILENAME = 6,
+  SF_EOFREASON = 7,
+  SF_EOFERROR = 8,
+  SF_GENERATION = 9,
+  SF_MAX = 10
+} statusfield;
+
+static const char *statusFieldNames[] = {
+  [SF_STATE] = "state",
+  [SF_PLAYING] = "playing",
+  [SF_PAUSED] = "paused",
+  [SF_TIME] = "time",
+  [SF_DURATION] = "duration",
+  [SF_RATE] = "rate",
+  [SF_FILENAME] = "filename",
+  [SF_EOFREASON] = "eofreason",
+  [SF_EOFERROR] = "eoferror",
+  [SF_GENERATION] = "generation",
+  [SF_MAX] = NULL
+};
+
 static const char *const efr_table[] = {
 // Table copied and adapted from mpv/player/client.c
 	[MPV_END_FILE_REASON_EOF] = "end of file reached",
@@ -48,6 +99,33 @@ static const char *const efr_table[] = {
     [MPV_END_FILE_REASON_REDIRECT] = "file redirect",
 };
 
+/*
+ * Events for which a script can be registered with ::tclmpv::on
+ */
+typedef enum cbevent {
+  CB_START_FILE = 0,
+  CB_FILE_LOADED = 1,
+  CB_END_FILE = 2,
+  CB_SEEK = 3,
+  CB_PLAYBACK_RESTART = 4,
+  CB_IDLE = 5,
+  CB_PAUSE = 6,
+  CB_PROPERTY_CHANGE = 7,
+  CB_MAX = 8
+} cbevent;
+
+static const char *cbEventNames[] = {
+  [CB_START_FILE] = "start-file",
+  [CB_FILE_LOADED] = "file-loaded",
+  [CB_END_FILE] = "end-file",
+  [CB_SEEK] = "seek",
+  [CB_PLAYBACK_RESTART] = "playback-restart",
+  [CB_IDLE] = "idle",
+  [CB_PAUSE] = "pause",
+  [CB_PROPERTY_CHANGE] = "property-change",
+  [CB_MAX] = NULL
+};
+
 typedef struct {
   mpv_event_id          state;
   const char *          name;
@@ -69,6 +147,279 @@ static const stateMap_t stateMap[] = {
 #define stateMapMax (sizeof(stateMap)/sizeof(stateMap_t))
 
 #define stateMapIdxMax 40 /* mpv currently has 24 states coded */
+
+/*
+ * Event journal: a ring buffer with the last JOURNALSIZE state
+ * related events, read with ::tclmpv::events
+ */
+#define JOURNALSIZE 256
+typedef struct {
+  Tcl_WideInt           seq;
+  mpv_event_id          event;
+  playstate             state;
+  struct timespec       tstamp;
+  mpv_end_file_reason   reason;
+  int                   error;
+} journalEntry_t;
+
+/*
+ * Trace buffer for ::tclmpv::trace: fixed size binary records in a
+ * ring, written without locks and formatted only when drained. Old
+ * records are overwritten when the ring is not drained in time.
+ */
+#define TRACESIZE 4096          /* records, a power of 2 */
+#define TRACETEXT 96
+
+typedef enum tracelevel {
+  TL_NO = 0,
+  TL_FATAL,
+  TL_ERROR,
+  TL_WARN,
+  TL_INFO,
+  TL_V,
+  TL_DEBUG,
+  TL_TRACE
+} tracelevel;
+
+/* the names of mpv_request_log_messages, mpv_log_level is 10 * index */
+static const char *traceLevelNames[] = {
+  "no", "fatal", "error", "warn", "info", "v", "debug", "trace", NULL
+};
+
+typedef enum tracekind {
+  TR_HANDLER,                   /* a = events drained */
+  TR_EVENT,                     /* a = mpv_event_id */
+  TR_END_FILE,                  /* a = reason, b = error, w = entry id */
+  TR_PROPERTY,                  /* text = name, a = format, w or d = value */
+  TR_STATE,                     /* a = playstate */
+  TR_COMMAND,                   /* text = command, a = async, b = mpv status,
+                                   w = request id or value, d = value */
+  TR_MPVLOG                     /* text = prefix: message */
+} tracekind;
+
+typedef struct {
+  uint64_t              seq;            /* position + 1 once complete */
+  uint64_t              nsec;           /* CLOCK_MONOTONIC */
+  uint16_t              kind;
+  uint16_t              level;
+  int32_t               a;
+  int32_t               b;
+  int64_t               w;
+  double                d;
+  char                  text [TRACETEXT];
+} traceRecord_t;
+
+typedef struct {
+  int                   enabled;
+  int                   level;          /* tracelevel */
+  traceRecord_t         *ring;          /* TRACESIZE records */
+  uint64_t              head;           /* next position, claimed atomically */
+  uint64_t              tail;           /* next position to drain */
+  uint64_t              dropped;        /* overwritten before drained */
+  char                  *channel;       /* name of the Tcl channel or NULL */
+  int                   idleQueued;
+} mpvTrace_t;
+
+#define TRACE(mpvData, lvl, kind, a, b, w, d, text) \
+  do { \
+    if ((mpvData)->trace.enabled && (lvl) <= (mpvData)->trace.level) { \
+      mpvTraceAdd ((mpvData), (lvl), (kind), (a), (b), (w), (d), (text)); \
+    } \
+  } while (0)
+
+/*
+ * Counters for ::tclmpv::stats. Histogram bucket 0 counts values
+ * below 1, bucket i values below 2^i and the last bucket the rest.
+ * Durations are in microseconds.
+ */
+#define STATSBUCKETS 22
+#define STATSERRORS 32          /* mpv error codes are -1 .. -31 */
+
+typedef struct {
+  uint64_t              count;
+  uint64_t              sum;
+  uint64_t              max;
+  uint64_t              buckets [STATSBUCKETS];
+} statsHist_t;
+
+typedef struct {
+  uint64_t              events [stateMapIdxMax];  /* by mpv_event_id */
+  uint64_t              handlerCalls;
+  statsHist_t           drained;        /* events per handler call */
+  statsHist_t           runtime;        /* handler run time */
+  uint64_t              wakeupNsec;     /* first wakeup not drained yet */
+  statsHist_t           wakeup;         /* wakeup callback to handler */
+  Tcl_HashTable         commands;       /* command name -> statsHist_t */
+  uint64_t              errors [STATSERRORS];
+} mpvStats_t;
+
+/*
+ * Variables written by the event handler, set with ::tclmpv::bind.
+ * A variable is written when its value changed, at most once per
+ * interval, a change within the interval is written by a timer.
+ */
+#define BINDINTERVAL 100        /* default -interval in ms */
+
+typedef enum bindvar {
+  BV_POSITION = 0,
+  BV_STATE = 1,
+  BV_DURATION = 2,
+  BV_MAX = 3
+} bindvar;
+
+static const char *bindOptionNames[] = {
+  [BV_POSITION] = "-position",
+  [BV_STATE] = "-state",
+  [BV_DURATION] = "-duration",
+  [BV_MAX] = "-interval",
+  NULL
+};
+
+typedef struct {
+  Tcl_Obj               *vars [BV_MAX]; /* variable names, NULL when not bound */
+  unsigned int          written;        /* bit per variable holding the values below */
+  double                position;       /* values last written */
+  playstate             state;
+  double                duration;
+  int                   interval;       /* ms */
+  uint64_t              lastWrite;      /* mpvStatsNow of the last write */
+  Tcl_TimerToken        timer;          /* write deferred by the interval */
+} mpvBind_t;
+
+/* an asynchronous request waiting for its reply */
+typedef struct {
+  Tcl_Obj               *script;        /* -command script or NULL */
+  statsHist_t           *hist;          /* round trip of the command */
+  uint64_t              sent;           /* monotonic nanoseconds */
+} mpvRequest_t;
+
+/*
+ * End-file history: reason and error of the last EOFHISTORYSIZE
+ * playlist entries, read with ::tclmpv::eofinfo entryid
+ */
+#define EOFHISTORYSIZE 256
+typedef struct {
+  int64_t               entryId;
+  mpv_end_file_reason   reason;
+  int                   error;
+} eofEntry_t;
+
+/*
+ * Observed property registry. The index of a property in the
+ * registry + 1 is the reply_userdata passed to mpv_observe_property,
+ * so a property change is routed without comparing names. The first
+ * slots hold the properties the extension needs itself, the
+ * properties observed with ::tclmpv::observe follow.
+ */
+typedef enum builtinprop {
+  PROP_NONE = 0,
+  PROP_DURATION = 1,
+  PROP_TIME_POS = 2,
+  PROP_FILENAME = 3,
+  PROP_IDLE_ACTIVE = 4,
+  PROP_PAUSE = 5,
+  PROP_SPEED = 6,
+  PROP_BUILTIN_MAX = 7
+} builtinprop;
+
+typedef struct {
+  const char            *name;
+  mpv_format            format;
+} propMap_t;
+
+static const propMap_t builtinPropMap[] = {
+  [PROP_NONE] = { NULL, MPV_FORMAT_NONE },
+  [PROP_DURATION] = { "duration", MPV_FORMAT_DOUBLE },
+  [PROP_TIME_POS] = { "time-pos", MPV_FORMAT_DOUBLE },
+  [PROP_FILENAME] = { "filename", MPV_FORMAT_STRING },
+  [PROP_IDLE_ACTIVE] = { "idle-active", MPV_FORMAT_FLAG },
+  [PROP_PAUSE] = { "pause", MPV_FORMAT_FLAG },
+  [PROP_SPEED] = { "speed", MPV_FORMAT_DOUBLE }
+};
+
+/* longest time in seconds gettime -precise extrapolates past a time-pos sample */
+#define MAXEXTRAPOLATE 1.0
+
+typedef struct {
+  char                  *name;          /* NULL for a free slot */
+  mpv_format            format;
+  Tcl_Obj               *script;        /* set with ::tclmpv::observe */
+  int                   valid;          /* the cache holds a value */
+  union {
+    double              d;
+    int                 flag;
+    Tcl_WideInt         i;
+  } cache;
+  Tcl_Obj               *value;         /* cache for strings and nodes */
+  double                mindelta;       /* smaller numeric changes are dropped */
+  double                maxrate;        /* most notifications per second, 0 for all */
+  double                lastNumeric;    /* numeric value last accepted */
+  int                   hasNumeric;
+  int                   dirty;          /* changed in this drain pass */
+  int                   nextDirty;      /* index + 1 of the next changed entry */
+  int                   held;           /* notification deferred by maxrate */
+  uint64_t              lastNotify;     /* mpvStatsNow of the last notification */
+} mpvObserved_t;
+
+#define PROPCACHE(mpvData, id) ((mpvData)->observed[(id) - 1])
+
+/*
+ * Metadata cache file, mapped with mmap. A header is followed by an
+ * open addressed table of fixed size records and a heap with the
+ * strings they refer to. A record is valid as long as the size and
+ * mtime of the file match. The layout is native, a cache file is not
+ * portable between architectures.
+ */
+#define CACHEMAGIC "TMPVCACH"
+#define CACHEVERSION 1
+#define CACHESLOTS 4096           /* initial number of records, a power of 2 */
+#define CACHEHEAP (256 * 1024)    /* initial size of the string heap */
+
+typedef enum cacheflag {
+  CACHE_DURATION = 0x01,
+  CACHE_LOUDNESS = 0x02,
+  CACHE_CUE = 0x04,
+  CACHE_DATA = 0x08
+} cacheflag;
+
+typedef struct {
+  char                  magic [8];
+  uint32_t              version;
+  uint32_t              recordSize;     /* sizeof (cacheRecord_t) */
+  uint32_t              slotCount;
+  uint32_t              used;
+  uint32_t              heapUsed;
+  uint32_t              heapSize;
+} cacheHeader_t;
+
+typedef struct {
+  uint64_t              hash;           /* hash of the path, 0 for a free slot */
+  int64_t               size;
+  int64_t               mtime;
+  uint32_t              pathOff;        /* offsets into the heap */
+  uint32_t              pathLen;
+  uint32_t              dataOff;        /* dict with tags, codec, audio-params */
+  uint32_t              dataLen;
+  uint32_t              flags;          /* cacheflag: the values set */
+  uint32_t              unused;
+  double                duration;
+  double                loudness;       /* integrated loudness in LUFS */
+  double                range;          /* loudness range in LU */
+  double                peak;           /* true peak in dBTP */
+  double                cueIn;
+  double                cueOut;
+  double                segue;          /* end of the last loud part */
+} cacheRecord_t;
+
+typedef struct {
+  char                  *path;          /* NULL when no cache file is open */
+  int                   fd;
+  size_t                mapSize;
+  cacheHeader_t         *header;        /* the mapped file */
+  cacheRecord_t         *records;
+  char                  *heap;
+} mpvCache_t;
+
 typedef struct {
 	 Tcl_Interp					*interp;
 	 mpv_handle					*inst;
@@ -77,66 +428,570 @@ typedef struct {
 	 int						argc;
 	 const char					**argv;
 	 const char					*device;
-	 double						duration;
-	 double						tm;
+	 const char					*appliedDevice; /* audio-device last sent, NULL when unknown */
+	 double						appliedSpeed;   /* speed last sent, negative when unknown */
+	 int						loadfileIndex;  /* loadfile takes an index before the options */
 	 int						paused;
-	 int						hasEvent;       /* flag to process mpv event */
+	 int						hasEvent;       /* flag to process mpv event, atomic */
+	 int						eventQueued;    /* a wakeup event is queued, atomic */
+	 int						inHandler;      /* mpvEventHandler is draining the queue */
+	 int						rewake;         /* a nested drain was skipped, wake up again */
+	 Tcl_ThreadId				owner;          /* the thread of interp */
+	 wakeupmode					wakeupMode;
+	 int						wakeupFd [2];   /* pipe written by the wakeup callback */
 	 Tcl_TimerToken				timerToken;
 	 int						stateMapIdx [stateMapIdxMax];
 	 struct mpv_event_end_file	end_file;
-	 FILE		                *debugfh;
+	 eofEntry_t					eofHistory [EOFHISTORYSIZE];
+	 Tcl_WideInt				eofCount;       /* number of end-file events seen */
+	 Tcl_Obj					*callbacks [CB_MAX];  /* scripts set with ::tclmpv::on */
+	 mpvObserved_t				*observed;
+	 int						observedCount;
+	 int						dirtyHead;      /* changed properties, index + 1 */
+	 int						dirtyTail;
+	 Tcl_TimerToken				holdTimer;      /* notifies properties held by -maxrate */
+	 uint64_t					holdDue;        /* when holdTimer fires, mpvStatsNow () */
+	 Tcl_HashTable				pending;        /* reply_userdata -> mpvRequest_t */
+	 uint64_t					nextReplyId;
+	 double						posAnchor;      /* position at posStamp */
+	 struct timespec			posStamp;       /* monotonic time of the last time-pos sample */
+	 journalEntry_t				journal [JOURNALSIZE];
+	 Tcl_WideInt				journalSeq;     /* sequence number of the last entry */
+	 mpvCache_t					*cache;         /* shared by all players */
+	 char						*path;          /* path of the playing file, NULL when unknown */
+	 int						durationSeen;   /* mpv reported the duration since start-file */
+	 int						gainEnabled;    /* apply cached loudness as gain */
+	 double						gainTarget;     /* target loudness in LUFS */
+	 int						trimEnabled;    /* apply cached cue points on load */
+	 int						trimHook;       /* the on_load hook is registered */
+	 mpvTrace_t					trace;
+	 mpvStats_t					stats;
+	 mpvBind_t					bind;
+	 struct mpvShare			*share;         /* set with ::tclmpv::share */
+	 Tcl_Obj					*stateObjs [PS_ERROR + 1];  /* state names, shared */
+	 Tcl_Obj					*statusKeys [SF_MAX];       /* keys of ::tclmpv::status */
+	 Tcl_WideInt				generation;     /* counts changes of the status values */
 } mpvData_t;
 
+/*
+ * Players shared with ::tclmpv::share, by name, guarded by a mutex.
+ * Other threads reach a player only through this registry and only
+ * the owner thread touches the mpvData_t: commands of a proxy created
+ * with ::tclmpv::attach are queued to the owner as Tcl events, events
+ * for the on scripts of a proxy are queued back to its thread.
+ */
+typedef struct mpvSubscriber {
+  struct mpvSubscriber  *next;
+  struct mpvProxy       *proxy;
+  cbevent               ev;
+  char                  *script;
+} mpvSubscriber_t;
+
+typedef struct mpvShare {
+  char                  *name;
+  Tcl_ThreadId          owner;
+  mpvData_t             *mpvData;       /* only used in the owner thread */
+  unsigned int          mask;           /* 1 << cbevent with subscribers, atomic */
+  mpvSubscriber_t       *subscribers;
+} mpvShare_t;
+
+typedef struct mpvProxy {
+  char                  *name;          /* of the shared player */
+  Tcl_Interp            *interp;
+  Tcl_ThreadId          thread;
+  Tcl_Command           token;
+} mpvProxy_t;
+
+/* a command of a proxy, run by the owner thread */
+typedef struct {
+  char                  *name;
+  int                   argc;
+  char                  **argv;
+  int                   refCount;       /* the caller and the queued event */
+  int                   abandoned;      /* the caller stopped waiting */
+  int                   finished;
+  int                   code;
+  char                  *result;
+  char                  *errorInfo;
+  Tcl_Condition         done;
+} mpvRemoteCall_t;
+
+typedef struct {
+  Tcl_Event             header;
+  mpvData_t             *mpvData;
+} mpvWakeupEvent_t;
+
+typedef struct {
+  Tcl_Event             header;
+  mpvRemoteCall_t       *call;
+} mpvRemoteEvent_t;
+
+typedef struct {
+  Tcl_Event             header;
+  mpvProxy_t            *proxy;
+  char                  *script;
+  char                  *details;
+} mpvNotifyEvent_t;
+
+/* the player has a script for the event, its own or of a proxy */
+#define HASCALLBACK(mpvData, ev) \
+  ((mpvData)->callbacks[ev] != NULL || ((mpvData)->share != NULL && \
+    (__atomic_load_n (&(mpvData)->share->mask, __ATOMIC_ACQUIRE) & (1u << (ev))) != 0))
+
+/*
+ * Package wide data, shared by the ::tclmpv ensemble and all
+ * player instances created with ::tclmpv::create
+ */
+typedef struct {
+	 Tcl_Interp					*interp;
+	 mpvData_t					*player;        /* player of the ::tclmpv ensemble */
+	 int						instanceCount;
+	 mpvCache_t					*cache;
+} mpvPkgData_t;
+
+/*
+ * Background scanner for ::tclmpv::scan. Worker threads each run a
+ * headless mpv handle and claim files from the job one at a time.
+ * Results are collected in order of completion and handed to the
+ * Tcl thread in batches of SCANBATCH with Tcl_ThreadQueueEvent.
+ */
+#define SCANBATCH 32
+#define SCANTHREADS 4
+#define SCANMAXTHREADS 64
+#define SCANTIMEOUT 10.0        /* seconds to wait for mpv per file */
+
+typedef struct {
+  const char            *name;
+  const char            *value;
+} optionMap_t;
+
+/*
+* ::tclmpv::init -profile: tuning options set before mpv_initialize.
+* The options given to init are set after them and override them.
+*/
+static const char *profileNames[] = { "lowlatency", "lowmem", "stream", NULL };
+
+/* cueing and live use: small audio buffer, no readahead beyond need */
+static const optionMap_t lowlatencyOptionMap[] = {
+  { "audio-buffer", "0.05" },
+  { "cache", "no" },
+  { "demuxer-readahead-secs", "1" },
+  { "demuxer-max-bytes", "8MiB" },
+  { "demuxer-max-back-bytes", "1MiB" },
+  { NULL, NULL }
+};
+
+/* many players in one process: small demuxer caches */
+static const optionMap_t lowmemOptionMap[] = {
+  { "cache", "no" },
+  { "demuxer-readahead-secs", "2" },
+  { "demuxer-max-bytes", "2MiB" },
+  { "demuxer-max-back-bytes", "0" },
+  { NULL, NULL }
+};
+
+/* network streams: a large cache to ride out stalls */
+static const optionMap_t streamOptionMap[] = {
+  { "audio-buffer", "0.5" },
+  { "cache", "yes" },
+  { "cache-secs", "60" },
+  { "demuxer-readahead-secs", "30" },
+  { "demuxer-max-bytes", "64MiB" },
+  { "demuxer-max-back-bytes", "16MiB" },
+  { NULL, NULL }
+};
+
+static const optionMap_t *profileOptionMaps[] = {
+  lowlatencyOptionMap,
+  lowmemOptionMap,
+  streamOptionMap
+};
+
+typedef enum scankind {
+  SCAN_METADATA = 0,
+  SCAN_LOUDNESS = 1,
+  SCAN_CUE = 2,
+  SCAN_PEAKS = 3
+} scankind;
+
+/* options of the worker mpv handles: no output, no playback */
+static const optionMap_t scanOptionMap[] = {
+  { "ao", "null" },
+  { "vo", "null" },
+  { "vid", "no" },
+  { "pause", "yes" },
+  { "idle", "yes" },
+  { "config", "no" },
+  { "load-scripts", "no" },
+  { "ytdl", "no" },
+  { "terminal", "no" },
+  { NULL, NULL }
+};
+
+/* loudness analysis: decode as fast as possible through ebur128 and
+ * stay at the end of the file so af-metadata can be read */
+#define LOUDNESSLABEL "tclmpvr128"
+static const optionMap_t loudnessOptionMap[] = {
+  { "ao", "null" },
+  { "ao-null-untimed", "yes" },
+  { "untimed", "yes" },
+  { "vo", "null" },
+  { "vid", "no" },
+  { "keep-open", "yes" },
+  { "idle", "yes" },
+  { "config", "no" },
+  { "load-scripts", "no" },
+  { "ytdl", "no" },
+  { "terminal", "no" },
+  { "af", "@" LOUDNESSLABEL ":lavfi=[ebur128=metadata=1:peak=true]" },
+  { NULL, NULL }
+};
+
+/* true peak in dBTP of a file without any signal */
+#define PEAKFLOOR -144.0
+
+/* reply_userdata of the properties observed by a loudness worker */
+#define LOUDNESS_EOF 1
+#define LOUDNESS_PROGRESS 2
+
+/* label of the filter applying the gain when volume-gain is not available */
+#define GAINLABEL "@tclmpvgain"
+
+/* cue point detection: decoded audio is written as raw mono samples
+ * to a pipe, ao-pcm-file is added per worker */
+#define PCMRATE 8000
+#define PCMRATESTR "8000"
+#define CUEBLOCK (PCMRATE / 100) /* samples per level decision */
+#define CUESILENCE -50.0        /* default silence level in dBFS */
+#define CUESEGUE -30.0          /* default segue level in dBFS */
+static const optionMap_t pcmOptionMap[] = {
+  { "ao", "pcm" },
+  { "ao-pcm-waveheader", "no" },
+  { "audio-format", "s16" },
+  { "audio-channels", "mono" },
+  { "audio-samplerate", PCMRATESTR },
+  { "gapless-audio", "no" },
+  { "untimed", "yes" },
+  { "vo", "null" },
+  { "vid", "no" },
+  { "idle", "yes" },
+  { "config", "no" },
+  { "load-scripts", "no" },
+  { "ytdl", "no" },
+  { "terminal", "no" },
+  { NULL, NULL }
+};
+
+/* peak overviews are made from a higher rate than cue points */
+#define PEAKRATE 22050
+#define PEAKRATESTR "22050"
+#define PEAKRESOLUTION 100      /* default min/max pairs per second */
+#define PEAKMAXRESOLUTION 1000
+
+/* peak overview file: header followed by min/max pairs,
+ * all values little endian */
+#define PEAKMAGIC "TMPVPEAK"
+#define PEAKVERSION 1
+#define PEAKHEADERSIZE 32
+/*
+* offset  size
+*  0      8     magic
+*  8      4     version
+* 12      4     bits per value, 8 or 16
+* 16      4     pairs per second
+* 20      4     sample rate the peaks were taken from
+* 24      8     number of pairs
+*/
+
+typedef struct {
+  double                silence;        /* cue levels in dBFS */
+  double                segue;
+  int                   resolution;     /* peaks: pairs per second */
+  int                   bits;           /* peaks: 8 or 16 */
+  char                  *output;        /* peaks: file to write, owned by the job */
+} scanParams_t;
+
+/* receives the decoded samples of a file */
+typedef void (pcmProc_t) (const int16_t *samples, size_t count, void *cd);
+
+typedef struct {
+  int                   silence;        /* levels as sample values */
+  int                   segue;
+  int64_t               count;          /* samples seen */
+  int64_t               first;          /* first loud block, -1 if none */
+  int64_t               last;           /* end of the last loud block */
+  int64_t               segueEnd;       /* end of the last block above segue */
+  int64_t               blockStart;
+  int                   blockPeak;
+  int                   blockFill;
+} cueScan_t;
+
+typedef struct {
+  int                   resolution;
+  int64_t               count;          /* samples seen */
+  int64_t               next;           /* sample ending the current pair */
+  int                   min;
+  int                   max;
+  int16_t               *pairs;         /* min/max, ckalloc'ed */
+  int64_t               pairCount;
+  int64_t               pairAlloc;
+} peakScan_t;
+
+typedef struct {
+  int                   file;           /* index in scanJob_t.files */
+  int                   status;         /* mpv error code */
+  int                   hasDuration;
+  double                duration;
+  char                  *codec;         /* allocated by mpv */
+  mpv_node              metadata;
+  mpv_node              audioParams;
+  int                   hasLoudness;
+  double                loudness;       /* integrated loudness in LUFS */
+  double                range;          /* loudness range in LU */
+  double                peak;           /* true peak in dBTP */
+  int                   hasCue;
+  double                cueIn;
+  double                cueOut;
+  double                segue;
+  unsigned char         *peaks;         /* encoded pairs, ckalloc'ed */
+  int                   peakSize;       /* bytes */
+} scanResult_t;
+
+typedef struct scanJob {
+  scankind              kind;
+  scanParams_t          params;
+  Tcl_Interp            *interp;
+  mpvCache_t            *cache;
+  Tcl_Obj               *cached;        /* results served from the cache */
+  Tcl_Obj               *script;        /* NULL for a synchronous scan */
+  Tcl_ThreadId          owner;
+  Tcl_Mutex             lock;           /* protects the fields below */
+  char                  **files;
+  int                   fileCount;
+  int                   nextFile;       /* next file to be claimed by a worker */
+  scanResult_t          *results;
+  int                   completed;
+  int                   delivered;
+  int                   eventQueued;
+  int                   cancel;
+  int                   running;        /* workers not yet finished */
+  int                   threadCount;
+  Tcl_ThreadId          *threads;
+} scanJob_t;
+
+typedef struct {
+  Tcl_Event             header;
+  scanJob_t             *job;
+} scanEvent_t;
+
 const char * mpvStateToStr (mpv_event_id state);
 const char * stateToStr (playstate state);
 const char *mpv_efr_string(mpv_end_file_reason reason);
+Tcl_Obj * mpvNodeToObj (mpv_node *node);
+void mpvObjToNode (Tcl_Obj *obj, mpv_node *node);
+void mpvFreeNode (mpv_node *node);
+Tcl_Obj * mpvPropertyToObj (mpv_event_property *prop);
+void mpvCacheProperty (mpvObserved_t *obs, mpv_event_property *prop);
+void mpvAnchorPosition (mpvData_t *mpvData, double pos, struct timespec *now);
+double mpvPrecisePosition (mpvData_t *mpvData, struct timespec *now);
+Tcl_Obj * mpvCachedObj (mpvObserved_t *obs);
+mpvObserved_t * mpvFindObserved (mpvData_t *mpvData, const char *name);
+void mpvObservedInit (mpvObserved_t *obs);
+int mpvObservedAccept (mpvObserved_t *obs, mpv_event_property *prop);
+void mpvObservedMark (mpvData_t *mpvData, int idx);
+void mpvObservedUnmark (mpvData_t *mpvData, int idx);
+void mpvObservedFlush (mpvData_t *mpvData);
+void mpvObservedNotify (mpvData_t *mpvData, int idx);
+void mpvObservedTimer (ClientData cd);
+void mpvObservedReset (mpvData_t *mpvData);
+int mpvAsyncOptions (Tcl_Interp *interp, int objc, Tcl_Obj * const objv[], int *first, int *async, Tcl_Obj **callback);
+uint64_t mpvAsyncRegister (mpvData_t *mpvData, int async, Tcl_Obj *callback, const char *prefix, const char *name);
+void mpvAsyncFree (mpvRequest_t *req);
+void mpvAsyncCancel (mpvData_t *mpvData, uint64_t id);
+void mpvAsyncReply (mpvData_t *mpvData, mpv_event *event);
+int mpvDirtyApply (mpvData_t *mpvData, Tcl_Interp *interp);
+void mpvDirtyReset (mpvData_t *mpvData);
+int mpvCommand (mpvData_t *mpvData, int async, uint64_t id, const char **cmd, mpv_node *result);
+Tcl_Obj * mpvEntryIdObj (mpv_node *result);
 void mpvCallbackHandler (void *cd);
 void mpvEventHandler (ClientData cd);
+void mpvTimerHandler (ClientData cd);
+void mpvBindUpdate (mpvData_t *mpvData);
+int mpvBindWrite (mpvData_t *mpvData, int dryrun);
+void mpvBindTimer (ClientData cd);
+void mpvBindFree (mpvData_t *mpvData);
+Tcl_Obj * mpvCallbackDetails (cbevent ev);
+void mpvInvokeCallback (mpvData_t *mpvData, cbevent ev, Tcl_Obj *details);
+void mpvInvokeScript (Tcl_Interp *interp, Tcl_Obj *script, Tcl_Obj *details);
+void mpvInvokeObserver (mpvData_t *mpvData, Tcl_Obj *script, Tcl_Obj *details);
+void mpvJournalAdd (mpvData_t *mpvData, mpv_event_id event, struct timespec *tstamp);
+void mpvWakeupHandler (ClientData cd, int mask);
+int mpvWakeupOpen (mpvData_t *mpvData);
+void mpvWakeupClose (mpvData_t *mpvData);
 int mpvDurationCmd (ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvEofInfoCmd (ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvEventsCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvGetCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvGetProperty (mpvData_t *mpvData, const char *name, Tcl_Obj **value);
+int mpvBatchCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvBindCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvGetTimeCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvIsPlayCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvOnCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvMediaCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvLoadFileCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvObserveCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvPlaylistCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvPauseCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvPlayCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvRateCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvSeekCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvSetCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvStateCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvStatusCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvStopCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvQuitCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvHaveAudioDevListCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvVersionCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+void mpvFreeArgv (mpvData_t *mpvData);
 void mpvClose ( mpvData_t     *mpvData);
+mpvData_t * mpvDataAlloc (Tcl_Interp *interp);
+void mpvDataFree (char *cd);
+void mpvTraceAdd (mpvData_t *mpvData, int level, tracekind kind, int a, int b, int64_t w, double d, const char *text);
+void mpvTraceFormat (traceRecord_t *rec, Tcl_DString *line);
+void mpvTraceDrain (mpvData_t *mpvData, Tcl_Obj *list);
+void mpvTraceIdle (ClientData cd);
+void mpvTraceLogLevel (mpvData_t *mpvData);
+void mpvTraceLogMessage (mpvData_t *mpvData, mpv_event_log_message *msg);
+void mpvTraceFree (mpvData_t *mpvData);
+int mpvTraceCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+uint64_t mpvStatsNow (void);
+void mpvStatsAdd (statsHist_t *hist, uint64_t value);
+statsHist_t *mpvStatsCommandHist (mpvData_t *mpvData, const char *prefix, const char *name);
+void mpvStatsCommand (mpvData_t *mpvData, const char *prefix, const char *name, uint64_t start, int status);
+void mpvStatsError (mpvData_t *mpvData, int status);
+Tcl_Obj *mpvStatsHistObj (statsHist_t *hist);
+void mpvStatsReset (mpvData_t *mpvData);
+void mpvStatsFree (mpvData_t *mpvData);
+int mpvStatsCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvWakeupEventProc (Tcl_Event *evPtr, int flags);
+int mpvWakeupEventFilter (Tcl_Event *evPtr, ClientData cd);
+mpvShare_t *mpvShareFind (const char *name);
+void mpvShareRemove (mpvData_t *mpvData);
+void mpvShareThreadExit (ClientData cd);
+void mpvShareMask (mpvShare_t *share);
+void mpvShareNotify (mpvData_t *mpvData, cbevent ev, Tcl_Obj *details);
+int mpvShareCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvDispatch (mpvData_t *mpvData, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[]);
+void mpvRemoteCallRelease (mpvRemoteCall_t *call);
+void mpvRemoteCallError (mpvRemoteCall_t *call);
+void mpvRemoteCallFinish (mpvRemoteCall_t *call);
+int mpvRemoteEventProc (Tcl_Event *evPtr, int flags);
+int mpvRemoteEventFilter (Tcl_Event *evPtr, ClientData cd);
+int mpvRemoteCall (Tcl_Interp *interp, mpvProxy_t *proxy, int objc, Tcl_Obj * const objv[]);
+int mpvNotifyEventProc (Tcl_Event *evPtr, int flags);
+int mpvNotifyEventFilter (Tcl_Event *evPtr, ClientData cd);
+int mpvProxyOn (Tcl_Interp *interp, mpvProxy_t *proxy, int objc, Tcl_Obj * const objv[]);
+int mpvProxyCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+void mpvProxyDeleteProc (ClientData cd);
+int mpvAttachCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 void mpvExitHandler ( void *cd);
+int mpvInstanceCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+void mpvInstanceDeleteProc (ClientData cd);
+int mpvCreateCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+Tcl_ThreadCreateType mpvScanThread (ClientData cd);
+void mpvScanFile (mpv_handle *handle, const char *path, scanResult_t *res);
+void mpvAnalyzeFile (mpv_handle *handle, const char *path, scanResult_t *res);
+int mpvScanStart (Tcl_Interp *interp, mpvCache_t *cache, scankind kind, const scanParams_t *params, Tcl_Obj *files, int threads, Tcl_Obj *script);
+int mpvPcmDecode (mpv_handle *handle, int fd, const char *path, pcmProc_t *proc, void *cd);
+void mpvCueFile (mpv_handle *handle, int fd, const char *path, const scanParams_t *params, scanResult_t *res);
+void mpvCueSamples (const int16_t *samples, size_t count, void *cd);
+void mpvCueHook (mpvData_t *mpvData);
+void mpvPeaksFile (mpv_handle *handle, int fd, const char *path, const scanParams_t *params, scanResult_t *res);
+void mpvPeaksSamples (const int16_t *samples, size_t count, void *cd);
+void mpvPeaksPush (peakScan_t *peak);
+int mpvPeaksWrite (const char *path, const scanParams_t *params, scanResult_t *res);
+int mpvPeaksCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+int mpvScanOptions (Tcl_Interp *interp, int objc, Tcl_Obj * const objv[], int *threads, Tcl_Obj **script, scanParams_t *params);
+void mpvGainApply (mpvData_t *mpvData);
+void mpvGainSet (mpvData_t *mpvData, double gain);
+int mpvAnalyzeCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+Tcl_Obj * mpvScanResultObj (scanJob_t *job, scanResult_t *res);
+void mpvScanQueueEvent (scanJob_t *job);
+int mpvScanEventProc (Tcl_Event *evPtr, int flags);
+void mpvScanJobFree (scanJob_t *job);
+int mpvScanCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
+uint64_t mpvCacheHash (const char *path, size_t len);
+int mpvCacheMap (mpvCache_t *cache);
+int mpvCacheOpen (mpvCache_t *cache, const char *path);
+void mpvCacheClose (mpvCache_t *cache);
+void mpvCacheExitHandler (ClientData cd);
+int mpvCacheResize (mpvCache_t *cache, uint32_t slotCount, uint32_t heapSize);
+cacheRecord_t * mpvCacheFind (mpvCache_t *cache, const char *path, size_t len, uint64_t hash);
+cacheRecord_t * mpvCacheLookup (mpvCache_t *cache, const char *path, struct stat *st);
+int mpvCachePut (mpvCache_t *cache, const char *path, struct stat *st, cacheRecord_t *values, Tcl_Obj *data);
+Tcl_Obj * mpvCacheRecordObj (mpvCache_t *cache, cacheRecord_t *rec);
+Tcl_Obj * mpvDictGet (Tcl_Obj *dict, const char *key);
+void mpvCacheScanResult (mpvCache_t *cache, Tcl_Obj *result);
+void mpvCacheApply (mpvData_t *mpvData, const char *path);
+void mpvCacheLearn (mpvData_t *mpvData, double duration);
+void mpvPathSet (mpvData_t *mpvData, const char *path);
+void mpvPathReply (mpvData_t *mpvData, mpv_event *event);
+int mpvCacheCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvReleaseCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvInitCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvAudioDevSetCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 int mpvAudioDevListCmd ( ClientData cd, Tcl_Interp* interp, int objc, Tcl_Obj * const objv[]);
 
 static const EnsembleData mpvCmdMap[] = {
+  { "analyze",      mpvAnalyzeCmd },
   { "audiodevlist", mpvAudioDevListCmd },
   { "audiodevset",  mpvAudioDevSetCmd },
+  { "batch",        mpvBatchCmd },
+  { "bind",         mpvBindCmd },
   { "close",        mpvReleaseCmd },
   { "duration",     mpvDurationCmd },
   { "eofinfo",      mpvEofInfoCmd },
+  { "events",       mpvEventsCmd },
+  { "get",          mpvGetCmd },
   { "gettime",      mpvGetTimeCmd },
   { "init",         mpvInitCmd },
   { "haveaudiodevlist", mpvHaveAudioDevListCmd },
   { "isplay",       mpvIsPlayCmd },
   { "loadfile",     mpvLoadFileCmd },
   { "media",        mpvMediaCmd },
+  { "observe",      mpvObserveCmd },
+  { "on",           mpvOnCmd },
   { "pause",        mpvPauseCmd },
   { "play",         mpvPlayCmd },
+  { "playlist",     mpvPlaylistCmd },
   { "quit",         mpvQuitCmd },
   { "rate",         mpvRateCmd },
   { "seek",         mpvSeekCmd },
+  { "set",          mpvSetCmd },
+  { "share",        mpvShareCmd },
   { "state",        mpvStateCmd },
+  { "stats",        mpvStatsCmd },
+  { "status",       mpvStatusCmd },
   { "stop",         mpvStopCmd },
+  { "trace",        mpvTraceCmd },
   { "version",      mpvVersionCmd },
   { NULL, NULL }
 };
 
+/*
+ * Commands of the ::tclmpv ensemble which do not act on a player,
+ * they are called with the mpvPkgData_t as client data
+ */
+static const EnsembleData mpvPkgCmdMap[] = {
+  { "attach",       mpvAttachCmd },
+  { "cache",        mpvCacheCmd },
+  { "create",       mpvCreateCmd },
+  { "peaks",        mpvPeaksCmd },
+  { "scan",         mpvScanCmd },
+  { NULL, NULL }
+};
+
 int Tclmpv_Init (Tcl_Interp *interp);
 
 #endif 
@@ -0,0 +1,199 @@
+# bench.tcl --
+#
+# Measures command latencies and the event dispatch of tclmpv. The
+# player runs with ao=null, so no sound device is needed, on the mp3
+# files in the examples directory. Run it with "make bench" or
+#
+#   tclsh bench.tcl ?-examples dir? ?-iterations n? ?-output file?
+#
+# The results are written as one JSON object, to stdout unless -output
+# is given, so runs can be compared between releases of tclmpv and of
+# libmpv. Latencies are in microseconds.
+
+package require tclmpv
+
+array set opts [list \
+	-examples [file join [file dirname [file dirname [file normalize [info script]]]] examples] \
+	-iterations 20 \
+	-output "" \
+	]
+foreach {key value} $argv {
+	if {! [info exists opts($key)]} {
+		puts stderr "usage: bench.tcl ?-examples dir? ?-iterations n? ?-output file?"
+		exit 2
+	}
+	set opts($key) $value
+}
+
+set files [lsort [glob -nocomplain -directory $opts(-examples) *.mp3]]
+if {[llength $files] == 0} {
+	puts stderr "bench.tcl: no mp3 files in $opts(-examples)"
+	exit 2
+}
+
+# waits until the variable is set by a callback, returns 0 on timeout
+proc waitfor {var {timeout 5000}} {
+	set id [after $timeout [list set $var timeout]]
+	vwait $var
+	after cancel $id
+	return [expr {[set $var] ne "timeout"}]
+}
+
+proc stamp {var args} {
+	set $var [clock microseconds]
+}
+
+# min, median, mean and max of a list of samples
+proc summary {samples {timeouts 0}} {
+	set n [llength $samples]
+	if {$n == 0} {
+		return [dict create n 0 timeouts $timeouts]
+	}
+	set sorted [lsort -real $samples]
+	set sum 0.0
+	foreach s $sorted {
+		set sum [expr {$sum + $s}]
+	}
+	return [dict create n $n timeouts $timeouts \
+		min [lindex $sorted 0] \
+		median [lindex $sorted [expr {$n / 2}]] \
+		mean [format %.1f [expr {$sum / $n}]] \
+		max [lindex $sorted end]]
+}
+
+# sequence number of the newest entry of the event journal
+proc journalseq {{seq 0}} {
+	while {[llength [dict get [set r [::tclmpv::events -since $seq]] events]] > 0} {
+		set seq [dict get $r seq]
+	}
+	return $seq
+}
+
+# versions look like numbers but are strings
+proc json {value {string 0}} {
+	if {! $string && [string is double -strict $value]} {
+		return $value
+	}
+	return "\"[string map {\\ \\\\ \" \\\"} $value]\""
+}
+
+proc jsondict {d {indent "  "}} {
+	set items {}
+	dict for {key value} $d {
+		if {[llength $value] > 1 && [llength $value] % 2 == 0} {
+			lappend items "$indent[json $key]: [jsondict $value "$indent  "]"
+		} else {
+			lappend items "$indent[json $key]: [json $value]"
+		}
+	}
+	return "\{\n[join $items ",\n"]\n[string range $indent 2 end]\}"
+}
+
+set results [dict create]
+
+::tclmpv::init
+::tclmpv::set ao null
+::tclmpv::set volume 0
+
+# loadfile until the audio runs
+set samples {}
+set timeouts 0
+::tclmpv::on playback-restart {stamp ::restart}
+for {set i 0} {$i < $opts(-iterations)} {incr i} {
+	set file [lindex $files [expr {$i % [llength $files]}]]
+	unset -nocomplain ::restart
+	set t0 [clock microseconds]
+	::tclmpv::loadfile $file
+	if {[waitfor ::restart]} {
+		lappend samples [expr {$::restart - $t0}]
+	} else {
+		incr timeouts
+	}
+}
+dict set results loadfile_playing_us [summary $samples $timeouts]
+
+# seek until the audio runs again
+set samples {}
+set timeouts 0
+set duration [::tclmpv::duration]
+for {set i 0} {$i < $opts(-iterations)} {incr i} {
+	unset -nocomplain ::restart
+	set t0 [clock microseconds]
+	::tclmpv::seek [expr {($i * 7) % int($duration > 2 ? $duration - 2 : 1)}]
+	if {[waitfor ::restart]} {
+		lappend samples [expr {$::restart - $t0}]
+	} else {
+		incr timeouts
+	}
+}
+dict set results seek_restart_us [summary $samples $timeouts]
+::tclmpv::on playback-restart ""
+
+# from a property set by mpv to its callback: the wakeup, the event
+# loop and the dispatch by the event handler
+set samples {}
+set timeouts 0
+::tclmpv::on pause {stamp ::paused}
+for {set i 0} {$i < $opts(-iterations)} {incr i} {
+	unset -nocomplain ::paused
+	set t0 [clock microseconds]
+	::tclmpv::set pause [expr {$i % 2 == 0 ? "yes" : "no"}]
+	if {[waitfor ::paused]} {
+		lappend samples [expr {$::paused - $t0}]
+	} else {
+		incr timeouts
+	}
+}
+dict set results wakeup_dispatch_us [summary $samples $timeouts]
+::tclmpv::on pause ""
+::tclmpv::play
+
+# the cost of the queries served from the cache of the event handler
+set calls [expr {$opts(-iterations) * 1000}]
+foreach {name cmd} {
+	state_call_us {::tclmpv::state}
+	gettime_call_us {::tclmpv::gettime}
+	gettime_precise_call_us {::tclmpv::gettime -precise}
+	duration_call_us {::tclmpv::duration}
+	status_call_us {::tclmpv::status}
+} {
+	dict set results $name [lindex [time $cmd $calls] 0]
+}
+
+# events drained while decoding as fast as the null output allows
+set ::eventcount 0
+::tclmpv::on property-change {apply {args {incr ::eventcount}}}
+::tclmpv::set loop-file inf
+::tclmpv::rate 100
+set since [journalseq]
+set t0 [clock microseconds]
+after 2000 {set ::drained 1}
+vwait ::drained
+set elapsed [expr {([clock microseconds] - $t0) / 1000000.0}]
+set journal [journalseq $since]
+::tclmpv::on property-change ""
+dict set results events_per_sec [dict create \
+	property_changes [format %.1f [expr {$::eventcount / $elapsed}]] \
+	journaled [format %.1f [expr {($journal - $since) / $elapsed}]] \
+	]
+::tclmpv::set loop-file no
+set libmpv [::tclmpv::version]
+::tclmpv::stop
+::tclmpv::close
+
+set report "\{
+  \"tclmpv\": [json [package present tclmpv] 1],
+  \"libmpv\": [json $libmpv 1],
+  \"tcl\": [json [info patchlevel] 1],
+  \"time\": [json [clock format [clock seconds] -format %Y-%m-%dT%H:%M:%SZ -gmt 1] 1],
+  \"iterations\": $opts(-iterations),
+  \"results\": [jsondict $results "    "]
+\}"
+if {$opts(-output) eq ""} {
+	puts $report
+} else {
+	set fh [open $opts(-output) w]
+	puts $fh $report
+	close $fh
+}
+exit 0